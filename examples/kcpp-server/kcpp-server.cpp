@@ -0,0 +1,1126 @@
+// native http front end for koboldcpp text generation, for headless deployments without python
+// serves /api/v1/generate, /api/extra/generate/stream and /v1/chat/completions directly against the
+// generation functions in expose.cpp, with the same request fields and response formats as koboldcpp.py
+// usage: koboldcpp_server --model <model.gguf> [--port 5001] [--contextsize 4096] [--threads n] ...
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "expose.h"
+#include "examples/server/httplib.h"
+#include "json.hpp"
+#include "utils.h"
+
+using json = nlohmann::ordered_json;
+
+extern "C"
+{
+    bool load_model(const load_model_inputs inputs);
+    generation_outputs generate(const generation_inputs inputs);
+    const char * new_token(int idx);
+    int get_stream_count();
+    bool has_finished();
+    int get_last_stop_reason();
+    int get_extra_output_count();
+    const char * get_extra_output(int idx, int * stopreason);
+    bool abort_generate();
+    const char * get_metrics();
+}
+
+#ifndef KCPP_VERSION
+#define KCPP_VERSION "unknown" //the makefile passes the KcppVersion of koboldcpp.py
+#endif
+static const char * kcpp_server_version = KCPP_VERSION;
+static const int stop_token_max = 256;
+static const int ban_token_max = 768;
+static const int logit_bias_max = 512;
+static const int dry_seq_break_max = 128;
+static const float bias_min_value = -100.0f;
+static const float bias_max_value = 100.0f;
+static const int max_queued_requests = 6; //same as the python server with --multiuser
+
+struct kcpp_server_args
+{
+    std::string model;
+    std::string mmproj;
+    std::string host = "0.0.0.0";
+    int port = 5001;
+    int contextsize = 4096;
+    int threads = 0;
+    int blasthreads = 0;
+    int blasbatchsize = 512;
+    int gpulayers = 0;
+    std::string rpc;
+    bool flashattention = false;
+    bool usemmap = false;
+    bool noshift = false;
+    bool nofastforward = false;
+    int sinktokens = 0;
+    bool asyncoutput = false;
+    bool pagedkv = false;
+    int kvtier = 0;
+    std::string kvtierdir;
+    bool quiet = false;
+    int debugmode = 0;
+    std::string password;
+    std::string chatcompletionsadapter;
+};
+
+static kcpp_server_args server_args;
+static std::string friendlymodelname = "inactive";
+static json chatcompl_adapter = json::object();
+static std::mutex generate_mutex;
+static std::atomic<int> requests_in_queue{0};
+
+//owns every string and array that the generation_inputs of one request points into
+struct kcpp_gen_request
+{
+    std::string prompt;
+    std::string memory;
+    std::string grammar;
+    std::string model_name;
+    std::vector<std::vector<uint8_t>> images;
+    int max_context_length = 0;
+    int max_length = 200;
+    float temperature = 0.75f;
+    int top_k = 100;
+    float top_a = 0.0f;
+    float top_p = 0.92f;
+    float min_p = 0.0f;
+    float typical_p = 1.0f;
+    float tfs = 1.0f;
+    float rep_pen = 1.0f;
+    int rep_pen_range = 320;
+    float rep_pen_slope = 1.0f;
+    float presence_penalty = 0.0f;
+    int mirostat = 0;
+    float mirostat_tau = 5.0f;
+    float mirostat_eta = 0.1f;
+    float dry_multiplier = 0.0f;
+    float dry_base = 1.75f;
+    int dry_allowed_length = 2;
+    int dry_penalty_last_n = 320;
+    float xtc_threshold = 0.2f;
+    float xtc_probability = 0.0f;
+    std::vector<samplers> sampler_order = {KCPP_SAMPLER_REP_PEN, KCPP_SAMPLER_TOP_K, KCPP_SAMPLER_TOP_A, KCPP_SAMPLER_TFS, KCPP_SAMPLER_TYP, KCPP_SAMPLER_TOP_P, KCPP_SAMPLER_TEMP};
+    int seed = -1;
+    bool ban_eos_token = false;
+    bool bypass_eos_token = false;
+    bool render_special = false;
+    bool grammar_retain_state = false;
+    float dynatemp_range = 0.0f;
+    float dynatemp_exponent = 1.0f;
+    float smoothing_factor = 0.0f;
+    bool trim_stop = true;
+    bool using_openai_tools = false;
+    int num_outputs = 1;
+    std::vector<std::string> stop_sequence;
+    std::vector<std::string> dry_sequence_breakers;
+    std::vector<std::string> banned_tokens;
+    std::vector<logit_bias> logit_biases;
+
+    std::vector<const char *> stop_ptrs;
+    std::vector<const char *> dry_ptrs;
+    std::vector<const char *> banned_ptrs;
+};
+
+static std::vector<const char *> to_c_strings(const std::vector<std::string> & strs)
+{
+    std::vector<const char *> ptrs;
+    for(const auto & s : strs)
+    {
+        ptrs.push_back(s.c_str());
+    }
+    return ptrs;
+}
+
+static generation_inputs make_generation_inputs(kcpp_gen_request & req, bool stream_flag)
+{
+    req.stop_ptrs = to_c_strings(req.stop_sequence);
+    req.dry_ptrs = to_c_strings(req.dry_sequence_breakers);
+    req.banned_ptrs = to_c_strings(req.banned_tokens);
+    generation_inputs in = {};
+    in.seed = req.seed;
+    in.prompt = req.prompt.c_str();
+    in.memory = req.memory.c_str();
+    for(int i=0;i<images_max;++i)
+    {
+        in.images[i] = "";
+        if(i<req.images.size())
+        {
+            in.image_buffers[i] = req.images[i].data();
+            in.image_buffer_lens[i] = req.images[i].size();
+        }
+    }
+    in.max_context_length = req.max_context_length;
+    in.max_length = req.max_length;
+    in.temperature = req.temperature;
+    in.top_k = req.top_k;
+    in.top_a = req.top_a;
+    in.top_p = req.top_p;
+    in.min_p = req.min_p;
+    in.typical_p = req.typical_p;
+    in.tfs = req.tfs;
+    in.rep_pen = req.rep_pen;
+    in.rep_pen_range = req.rep_pen_range;
+    in.rep_pen_slope = req.rep_pen_slope;
+    in.presence_penalty = req.presence_penalty;
+    in.mirostat = req.mirostat;
+    in.mirostat_eta = req.mirostat_eta;
+    in.mirostat_tau = req.mirostat_tau;
+    in.xtc_threshold = req.xtc_threshold;
+    in.xtc_probability = req.xtc_probability;
+    const int sampler_max = sizeof(in.sampler_order)/sizeof(in.sampler_order[0]);
+    in.sampler_len = std::min((int)req.sampler_order.size(), sampler_max);
+    for(int i=0;i<in.sampler_len;++i)
+    {
+        in.sampler_order[i] = req.sampler_order[i];
+    }
+    in.allow_eos_token = !req.ban_eos_token;
+    in.bypass_eos_token = req.bypass_eos_token;
+    in.render_special = req.render_special;
+    in.stream_sse = stream_flag;
+    in.grammar = req.grammar.c_str();
+    in.grammar_retain_state = req.grammar_retain_state;
+    in.dynatemp_range = req.dynatemp_range;
+    in.dynatemp_exponent = req.dynatemp_exponent;
+    in.smoothing_factor = req.smoothing_factor;
+    in.dry_multiplier = req.dry_multiplier;
+    in.dry_base = req.dry_base;
+    in.dry_allowed_length = req.dry_allowed_length;
+    in.dry_penalty_last_n = req.dry_penalty_last_n;
+    in.dry_sequence_breakers_len = req.dry_ptrs.size();
+    in.dry_sequence_breakers = req.dry_ptrs.data();
+    in.stop_sequence_len = req.stop_ptrs.size();
+    in.stop_sequence = req.stop_ptrs.data();
+    in.logit_biases_len = req.logit_biases.size();
+    in.logit_biases = req.logit_biases.data();
+    in.banned_tokens_len = req.banned_ptrs.size();
+    in.banned_tokens = req.banned_ptrs.data();
+    in.model_name = req.model_name.c_str();
+    in.num_outputs = (stream_flag?1:req.num_outputs);
+    return in;
+}
+
+template <typename T>
+static T json_get(const json & body, const char * key, T fallback)
+{
+    auto it = body.find(key);
+    if(it == body.end() || it->is_null())
+    {
+        return fallback;
+    }
+    try
+    {
+        if constexpr (std::is_same<T, std::string>::value)
+        {
+            return it->is_string() ? it->get<std::string>() : it->dump();
+        }
+        else if constexpr (std::is_same<T, bool>::value)
+        {
+            return it->get<bool>();
+        }
+        else
+        {
+            return (it->is_string() ? (T)std::stod(it->get<std::string>()) : it->get<T>());
+        }
+    }
+    catch(const std::exception &)
+    {
+        return fallback;
+    }
+}
+
+static std::vector<std::string> json_string_list(const json & body, const char * key)
+{
+    std::vector<std::string> out;
+    auto it = body.find(key);
+    if(it == body.end() || it->is_null())
+    {
+        return out;
+    }
+    if(it->is_string())
+    {
+        out.push_back(it->get<std::string>());
+        return out;
+    }
+    if(it->is_array())
+    {
+        for(const auto & v : *it)
+        {
+            out.push_back(v.is_string()?v.get<std::string>():"");
+        }
+    }
+    return out;
+}
+
+static void add_image(kcpp_gen_request & req, const std::string & b64)
+{
+    if(req.images.size() >= images_max)
+    {
+        return;
+    }
+    std::vector<uint8_t> bytes = kcpp_base64_decode(b64);
+    if(bytes.size() > 0)
+    {
+        req.images.push_back(std::move(bytes));
+    }
+}
+
+//forces a json array answer when openai tools are used (llama.cpp's grammars/json_arr.gbnf)
+static const char * tool_call_grammar = R"(
+root   ::= arr
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+arr  ::=
+  "[\n" ws (
+            value
+    (",\n" ws value)*
+  )? "]"
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4})
+  )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [1-9] [0-9]{0,15})? ws
+ws ::= | " " | "\n" [ \t]{0,20}
+)";
+
+//the example tool call shown to the model, formatted like json.dumps(indent=0)
+static std::string tool_call_example(const std::string & function_name)
+{
+    json example = json::array({{{"id", "insert an id for the response"}, {"type", "function"},
+        {"function", {{"name", function_name}, {"arguments", {{"first property key", "first property value"}, {"second property key", "second property value"}}}}}}});
+    return example.dump(0);
+}
+
+//finds the tool calls in a generated answer like extract_json_from_string in koboldcpp.py
+static json extract_tool_calls(const std::string & text)
+{
+    json parsed = json::parse(text, nullptr, false);
+    if(!parsed.is_discarded())
+    {
+        return parsed;
+    }
+    parsed = json::parse("[" + text + "]", nullptr, false);
+    if(!parsed.is_discarded())
+    {
+        return parsed;
+    }
+    //otherwise the first part from a bracket up to the nearest matching closing bracket that parses
+    for(size_t pos = text.find_first_of("{["); pos != std::string::npos; pos = text.find_first_of("{[", pos))
+    {
+        size_t end = text.find(text[pos]=='{'?'}':']', pos+1);
+        if(end == std::string::npos)
+        {
+            ++pos;
+            continue;
+        }
+        parsed = json::parse(text.substr(pos, end-pos+1), nullptr, false);
+        if(!parsed.is_discarded())
+        {
+            return parsed;
+        }
+        pos = end + 1;
+    }
+    return json::array();
+}
+
+//api format 2=kai, 4=oai-chat. mirrors transform_genparams and generate in koboldcpp.py
+static kcpp_gen_request parse_genparams(const json & body, int api_format)
+{
+    kcpp_gen_request req;
+    float rp = std::max({json_get<float>(body,"repeat_penalty",1.0f),json_get<float>(body,"repetition_penalty",1.0f),json_get<float>(body,"rep_pen",1.0f)});
+    req.rep_pen = rp;
+    req.ban_eos_token = json_get<bool>(body,"ban_eos_token",json_get<bool>(body,"use_default_badwordsids",false));
+
+    req.prompt = json_get<std::string>(body,"prompt","");
+    req.memory = json_get<std::string>(body,"memory","");
+    req.max_context_length = json_get<int>(body,"max_context_length",server_args.contextsize);
+    req.max_length = json_get<int>(body,"max_length",200);
+    req.temperature = json_get<float>(body,"temperature",0.75f);
+    req.top_k = json_get<int>(body,"top_k",100);
+    req.top_a = json_get<float>(body,"top_a",0.0f);
+    req.top_p = json_get<float>(body,"top_p",0.92f);
+    req.min_p = json_get<float>(body,"min_p",0.0f);
+    req.typical_p = json_get<float>(body,"typical",1.0f);
+    req.tfs = json_get<float>(body,"tfs",1.0f);
+    req.rep_pen_range = json_get<int>(body,"rep_pen_range",320);
+    req.rep_pen_slope = json_get<float>(body,"rep_pen_slope",1.0f);
+    req.presence_penalty = json_get<float>(body,"presence_penalty",0.0f);
+    req.mirostat = json_get<int>(body,"mirostat",0);
+    req.mirostat_tau = json_get<float>(body,"mirostat_tau",5.0f);
+    req.mirostat_eta = json_get<float>(body,"mirostat_eta",0.1f);
+    req.dry_multiplier = json_get<float>(body,"dry_multiplier",0.0f);
+    req.dry_base = json_get<float>(body,"dry_base",1.75f);
+    req.dry_allowed_length = json_get<int>(body,"dry_allowed_length",2);
+    req.dry_penalty_last_n = json_get<int>(body,"dry_penalty_last_n",320);
+    req.xtc_threshold = json_get<float>(body,"xtc_threshold",0.2f);
+    req.xtc_probability = json_get<float>(body,"xtc_probability",0.0f);
+    req.seed = json_get<int>(body,"sampler_seed",-1);
+    req.grammar = json_get<std::string>(body,"grammar","");
+    req.grammar_retain_state = json_get<bool>(body,"grammar_retain_state",false);
+    req.trim_stop = json_get<bool>(body,"trim_stop",true);
+    req.dynatemp_range = json_get<float>(body,"dynatemp_range",0.0f);
+    req.dynatemp_exponent = json_get<float>(body,"dynatemp_exponent",1.0f);
+    req.smoothing_factor = json_get<float>(body,"smoothing_factor",0.0f);
+    req.render_special = json_get<bool>(body,"render_special",false);
+    req.bypass_eos_token = json_get<bool>(body,"bypass_eos",false);
+    req.model_name = json_get<std::string>(body,"model","");
+    req.num_outputs = std::max(1,json_get<int>(body,"num_outputs",json_get<int>(body,"n",1)));
+    req.stop_sequence = json_string_list(body,"stop_sequence");
+    req.banned_tokens = json_string_list(body,(body.contains("banned_tokens")?"banned_tokens":"banned_strings"));
+    for(const auto & img : json_string_list(body,"images"))
+    {
+        add_image(req, img);
+    }
+
+    if(body.contains("sampler_order") && body["sampler_order"].is_array() && body["sampler_order"].size()>0 && body["sampler_order"].size()<=KCPP_SAMPLER_MAX)
+    {
+        req.sampler_order.clear();
+        for(const auto & s : body["sampler_order"])
+        {
+            int v = s.is_number_integer()?s.get<int>():0;
+            req.sampler_order.push_back((samplers)(v<0||v>=KCPP_SAMPLER_MAX?0:v));
+        }
+    }
+    if(req.dry_multiplier > 0)
+    {
+        auto it = body.find("dry_sequence_breakers");
+        if(it != body.end() && it->is_string())
+        {
+            //sillytavern sends the breakers as a json encoded array
+            json parsed = json::parse(it->get<std::string>(), nullptr, false);
+            if(parsed.is_array())
+            {
+                for(const auto & v : parsed)
+                {
+                    if(v.is_string()) { req.dry_sequence_breakers.push_back(v.get<std::string>()); }
+                }
+            }
+        }
+        else
+        {
+            req.dry_sequence_breakers = json_string_list(body,"dry_sequence_breakers");
+        }
+    }
+    if(body.contains("logit_bias") && body["logit_bias"].is_object())
+    {
+        for(const auto & [key, value] : body["logit_bias"].items())
+        {
+            try
+            {
+                int t_id = std::max(-1, std::stoi(key));
+                float bias = value.is_string()?std::stof(value.get<std::string>()):value.get<float>();
+                req.logit_biases.push_back({t_id, std::min(bias_max_value, std::max(bias_min_value, bias))});
+            }
+            catch(const std::exception &)
+            {
+                printf("\nSkipped unparsable logit bias: %s\n",key.c_str());
+            }
+        }
+    }
+    std::string custom_bans = json_get<std::string>(body,"custom_token_bans","");
+    size_t pos = 0;
+    while(pos <= custom_bans.size() && custom_bans.size()>0)
+    {
+        size_t comma = custom_bans.find(',', pos);
+        std::string tok = custom_bans.substr(pos, comma==std::string::npos?std::string::npos:comma-pos);
+        tok.erase(0, tok.find_first_not_of(" \t"));
+        tok.erase(tok.find_last_not_of(" \t")+1);
+        if(!tok.empty() && tok.find_first_not_of("0123456789")==std::string::npos)
+        {
+            try
+            {
+                req.logit_biases.push_back({std::stoi(tok), bias_min_value});
+            }
+            catch(const std::exception &)
+            {
+                printf("\nSkipped unparsable token ban: %s\n",tok.c_str());
+            }
+        }
+        if(comma==std::string::npos) { break; }
+        pos = comma + 1;
+    }
+
+    if(api_format==4)
+    {
+        const json & adapter = (body.contains("adapter") && body["adapter"].is_object())?body["adapter"]:chatcompl_adapter;
+        req.max_length = json_get<int>(body,"max_tokens",json_get<int>(body,"max_completion_tokens",json_get<int>(adapter,"max_length",512)));
+        req.presence_penalty = json_get<float>(body,"presence_penalty",json_get<float>(body,"frequency_penalty",0.0f));
+        req.stop_sequence = json_string_list(body,"stop");
+        req.seed = json_get<int>(body,"seed",-1);
+        req.mirostat = json_get<int>(body,"mirostat_mode",0);
+
+        //translate the chat messages into one prompt with the adapter's instruct tags
+        const std::string system_start = json_get<std::string>(adapter,"system_start","\n### Instruction:\n");
+        const std::string system_end = json_get<std::string>(adapter,"system_end","");
+        const std::string user_start = json_get<std::string>(adapter,"user_start","\n### Instruction:\n");
+        const std::string user_end = json_get<std::string>(adapter,"user_end","");
+        const std::string assistant_start = json_get<std::string>(adapter,"assistant_start","\n### Response:\n");
+        const std::string assistant_end = json_get<std::string>(adapter,"assistant_end","");
+        const std::string tools_start = json_get<std::string>(adapter,"tools_start","");
+        const std::string tools_end = json_get<std::string>(adapter,"tools_end","");
+        std::string prompt;
+        if(body.contains("messages") && body["messages"].is_array())
+        {
+            const json & messages = body["messages"];
+            for(size_t message_index=0;message_index<messages.size();++message_index)
+            {
+                const json & message = messages[message_index];
+                std::string role = json_get<std::string>(message,"role","");
+                prompt += (role=="system"?system_start:role=="user"?user_start:role=="assistant"?assistant_start:role=="tool"?tools_start:"");
+                auto content = message.find("content");
+                if(content != message.end() && content->is_string())
+                {
+                    prompt += content->get<std::string>();
+                }
+                else if(content != message.end() && content->is_array())
+                {
+                    for(const auto & item : *content)
+                    {
+                        std::string type = json_get<std::string>(item,"type","");
+                        if(type=="text")
+                        {
+                            prompt += json_get<std::string>(item,"text","");
+                        }
+                        else if(type=="image_url" && item.contains("image_url"))
+                        {
+                            std::string url = json_get<std::string>(item["image_url"],"url","");
+                            if(url.rfind("data:image",0)==0 && url.find(',')!=std::string::npos)
+                            {
+                                add_image(req, url.substr(url.find(',')+1));
+                            }
+                        }
+                    }
+                }
+                //after the last user message, describe the tools and ask for a json function call, unless tool_choice is null
+                auto tools = body.find("tools");
+                auto tool_choice = body.find("tool_choice");
+                if(role=="user" && message_index+1==messages.size() && tools!=body.end() && tools->is_array() && !tools->empty()
+                && tool_choice!=body.end() && !tool_choice->is_null())
+                {
+                    prompt += tools->dump(0);
+                    std::string instruction = " Use this style of JSON object formatting to give your answer if you think the user is asking you to perform an action: " + tool_call_example("insert the name of the function you want to call");
+                    if(tool_choice->is_object() && tool_choice->contains("function") && (*tool_choice)["function"].is_object()
+                    && (*tool_choice)["function"].contains("name") && (*tool_choice)["function"]["name"].is_string())
+                    {
+                        const std::string specified_function = (*tool_choice)["function"]["name"].get<std::string>();
+                        instruction = "The user is asking you to use the style of this JSON object formatting to complete the parameters for the specific function named " + specified_function + " in the following format: " + tool_call_example(specified_function);
+                    }
+                    prompt += instruction;
+                    req.temperature = 0.2f;
+                    req.using_openai_tools = true;
+                    req.grammar = tool_call_grammar;
+                }
+                prompt += (role=="system"?system_end:role=="user"?user_end:role=="assistant"?assistant_end:role=="tool"?tools_end:"");
+            }
+        }
+        prompt += assistant_start;
+        req.prompt = prompt;
+        auto strip = [](std::string s) {
+            s.erase(0, s.find_first_not_of(" \t\r\n"));
+            s.erase(s.find_last_not_of(" \t\r\n")+1);
+            return s;
+        };
+        req.stop_sequence.push_back(strip(user_start));
+        req.stop_sequence.push_back(strip(assistant_start));
+        req.trim_stop = true;
+    }
+
+    if(req.max_context_length > server_args.contextsize)
+    {
+        req.max_context_length = server_args.contextsize;
+    }
+    int min_remain = std::min(req.max_context_length-4, 16);
+    if(req.max_length >= (req.max_context_length-min_remain))
+    {
+        req.max_length = req.max_context_length-min_remain;
+        printf("\nWarning: You are trying to generate with max_length near or exceeding max_context_length. Most of the context will be removed, and your outputs will not be very coherent.\n");
+    }
+    if(req.mirostat!=1 && req.mirostat!=2)
+    {
+        req.mirostat = 0;
+        req.mirostat_tau = req.mirostat_eta = 0;
+    }
+    if(req.stop_sequence.size() > stop_token_max) { req.stop_sequence.resize(stop_token_max); }
+    if(req.banned_tokens.size() > ban_token_max) { req.banned_tokens.resize(ban_token_max); }
+    if(req.logit_biases.size() > logit_bias_max) { req.logit_biases.resize(logit_bias_max); }
+    if(req.dry_sequence_breakers.size() > dry_seq_break_max) { req.dry_sequence_breakers.resize(dry_seq_break_max); }
+    return req;
+}
+
+static void trim_at_stop_sequences(std::string & text, const std::vector<std::string> & stops)
+{
+    for(const auto & s : stops)
+    {
+        size_t found = (s.empty()?std::string::npos:text.find(s));
+        if(found != std::string::npos)
+        {
+            text = text.substr(0, found);
+        }
+    }
+}
+
+//true if a stop sequence is inside the text or could still complete at its end
+static bool overlaps_stop_sequence(const std::string & text, const std::vector<std::string> & stops)
+{
+    for(const auto & s : stops)
+    {
+        if(s.empty())
+        {
+            continue;
+        }
+        if(text.find(s) != std::string::npos)
+        {
+            return true;
+        }
+        for(size_t len = std::min(s.size()-1, text.size()); len > 0; --len)
+        {
+            if(text.compare(text.size()-len, len, s, 0, len) == 0)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool is_incomplete_utf8(const std::string & s)
+{
+    int i = (int)s.size() - 1;
+    int continuation = 0;
+    while(i >= 0 && ((unsigned char)s[i] & 0xC0) == 0x80 && continuation < 4)
+    {
+        --i;
+        ++continuation;
+    }
+    if(i < 0)
+    {
+        return continuation > 0;
+    }
+    unsigned char lead = s[i];
+    int needed = (lead >= 0xF0 ? 3 : (lead >= 0xE0 ? 2 : (lead >= 0xC0 ? 1 : 0)));
+    return continuation < needed;
+}
+
+static const char * finish_reason(int stopreason)
+{
+    return (stopreason != stop_reason::EOS_TOKEN_HIT ? "length" : "stop");
+}
+
+static bool check_password(const httplib::Request & req)
+{
+    if(server_args.password.empty())
+    {
+        return true;
+    }
+    std::string auth = req.get_header_value("Authorization");
+    if(auth.rfind("Bearer ",0)!=0)
+    {
+        return false;
+    }
+    auth = auth.substr(7);
+    auth.erase(auth.find_last_not_of(" \t")+1);
+    return auth == server_args.password;
+}
+
+//generated text can contain broken utf8, which is dropped like the python server does
+static std::string dump_json(const json & body)
+{
+    return body.dump(-1, ' ', false, json::error_handler_t::ignore);
+}
+
+static void send_json(httplib::Response & res, const json & body, int status = 200)
+{
+    res.status = status;
+    res.set_content(dump_json(body), "application/json");
+}
+
+//waits for the model like the python server, but rejects requests once the queue is full
+static std::unique_ptr<std::unique_lock<std::mutex>> acquire_model(httplib::Response & res)
+{
+    if(requests_in_queue.fetch_add(1) >= max_queued_requests)
+    {
+        requests_in_queue.fetch_sub(1);
+        send_json(res, {{"detail", {{"msg", "Server is busy; please try again later."}, {"type", "service_unavailable"}}}}, 503);
+        return nullptr;
+    }
+    auto lock = std::make_unique<std::unique_lock<std::mutex>>(generate_mutex);
+    requests_in_queue.fetch_sub(1);
+    return lock;
+}
+
+static void handle_generate(const httplib::Request & httpreq, httplib::Response & res, int api_format)
+{
+    if(!check_password(httpreq))
+    {
+        send_json(res, {{"detail", {{"error", "Unauthorized"}, {"msg", "Authentication key is missing or invalid."}, {"type", "unauthorized"}}}}, 401);
+        return;
+    }
+    json body = json::parse(httpreq.body, nullptr, false);
+    if(!body.is_object())
+    {
+        send_json(res, {{"detail", {{"msg", "Request body is not valid JSON."}, {"type", "bad_input"}}}}, 400);
+        return;
+    }
+    kcpp_gen_request req = parse_genparams(body, api_format);
+    auto lock = acquire_model(res);
+    if(!lock)
+    {
+        return;
+    }
+    if(!server_args.quiet)
+    {
+        printf("\nInput: %s\n", dump_json(body).c_str());
+    }
+
+    generation_outputs out = generate(make_generation_inputs(req, false));
+    std::string text = (out.status==1 && out.text)?out.text:"";
+    std::vector<std::pair<std::string,int>> extras;
+    if(out.status==1)
+    {
+        for(int i=0;i<get_extra_output_count();++i)
+        {
+            int reason = 0;
+            std::string extra = get_extra_output(i, &reason);
+            extras.push_back({extra, reason});
+        }
+    }
+    lock.reset();
+
+    if(req.trim_stop)
+    {
+        trim_at_stop_sequences(text, req.stop_sequence);
+        for(auto & e : extras)
+        {
+            trim_at_stop_sequences(e.first, req.stop_sequence);
+        }
+    }
+    if(!server_args.quiet)
+    {
+        printf("\nOutput: %s\n", text.c_str());
+    }
+
+    json resp;
+    if(api_format==4)
+    {
+        json choices = json::array();
+        json tool_calls = (req.using_openai_tools ? extract_tool_calls(text) : json::array());
+        json content = text;
+        if(!tool_calls.empty())
+        {
+            content = nullptr;
+        }
+        choices.push_back({{"index", 0}, {"message", {{"role", "assistant"}, {"content", content}, {"tool_calls", tool_calls}}}, {"finish_reason", finish_reason(out.stopreason)}, {"logprobs", nullptr}});
+        for(int i=0;i<extras.size();++i)
+        {
+            choices.push_back({{"index", i+1}, {"message", {{"role", "assistant"}, {"content", extras[i].first}, {"tool_calls", json::array()}}}, {"finish_reason", finish_reason(extras[i].second)}, {"logprobs", nullptr}});
+        }
+        resp = {{"id", "chatcmpl-A1"}, {"object", "chat.completion"}, {"created", (int64_t)time(nullptr)}, {"model", friendlymodelname},
+                {"usage", {{"prompt_tokens", out.prompt_tokens}, {"completion_tokens", out.completion_tokens}, {"total_tokens", out.prompt_tokens+out.completion_tokens}}},
+                {"choices", choices}};
+    }
+    else
+    {
+        json results = json::array();
+        results.push_back({{"text", text}, {"finish_reason", finish_reason(out.stopreason)}, {"logprobs", nullptr}, {"prompt_tokens", out.prompt_tokens}, {"completion_tokens", out.completion_tokens}});
+        for(const auto & e : extras)
+        {
+            results.push_back({{"text", e.first}, {"finish_reason", finish_reason(e.second)}, {"logprobs", nullptr}, {"prompt_tokens", out.prompt_tokens}, {"completion_tokens", 0}});
+        }
+        resp = {{"results", results}};
+    }
+    send_json(res, resp);
+}
+
+//state of one streamed generation, shared between the generation thread and the sse writer
+struct kcpp_stream_state
+{
+    kcpp_gen_request req;
+    std::unique_ptr<std::unique_lock<std::mutex>> lock;
+    std::thread worker;
+    std::atomic<bool> done{false};
+    generation_outputs out;
+    int api_format = 2;
+};
+
+static bool send_sse_event(httplib::DataSink & sink, int api_format, const std::string & token, const char * reason)
+{
+    std::string event;
+    if(api_format==4)
+    {
+        json data = {{"id", "koboldcpp"}, {"object", "chat.completion.chunk"}, {"created", (int64_t)time(nullptr)}, {"model", friendlymodelname},
+                     {"choices", json::array({{{"index", 0}, {"finish_reason", reason}, {"delta", {{"role", "assistant"}, {"content", token}}}}})}};
+        event = "data: " + dump_json(data) + "\n\n";
+    }
+    else
+    {
+        json data = {{"token", token}, {"finish_reason", reason}};
+        event = "event: message\ndata: " + dump_json(data) + "\n\n";
+    }
+    return sink.write(event.data(), event.size());
+}
+
+static void handle_generate_stream(const httplib::Request & httpreq, httplib::Response & res, int api_format)
+{
+    if(!check_password(httpreq))
+    {
+        send_json(res, {{"detail", {{"error", "Unauthorized"}, {"msg", "Authentication key is missing or invalid."}, {"type", "unauthorized"}}}}, 401);
+        return;
+    }
+    json body = json::parse(httpreq.body, nullptr, false);
+    if(!body.is_object())
+    {
+        send_json(res, {{"detail", {{"msg", "Request body is not valid JSON."}, {"type", "bad_input"}}}}, 400);
+        return;
+    }
+    auto state = std::make_shared<kcpp_stream_state>();
+    state->req = parse_genparams(body, api_format);
+    state->api_format = api_format;
+    state->lock = acquire_model(res);
+    if(!state->lock)
+    {
+        return;
+    }
+    if(!server_args.quiet)
+    {
+        printf("\nInput: %s\n", dump_json(body).c_str());
+    }
+    state->worker = std::thread([state]() {
+        state->out = generate(make_generation_inputs(state->req, true));
+        state->done = true;
+    });
+
+    res.set_header("X-Accel-Buffering", "no");
+    res.set_header("Cache-Control", "no-cache");
+    res.set_chunked_content_provider("text/event-stream", [state](size_t, httplib::DataSink & sink) {
+        const auto poll_interval = std::chrono::milliseconds(5);
+        //the previous generation's tokens stay visible until this one has started
+        while(has_finished() && !state->done)
+        {
+            std::this_thread::sleep_for(poll_interval);
+        }
+        int current_token = 0;
+        std::string incomplete; //bytes of a partial utf8 character
+        std::string reserve; //text held back while a stop sequence could still match
+        bool aborted = false;
+        while(true)
+        {
+            bool stream_done = state->done;
+            std::string token_str;
+            int stream_count = (stream_done && state->out.status!=1) ? 0 : get_stream_count();
+            while(current_token < stream_count)
+            {
+                const char * tok = new_token(current_token);
+                if(tok == nullptr)
+                {
+                    break;
+                }
+                ++current_token;
+                incomplete += tok;
+                if(!is_incomplete_utf8(incomplete))
+                {
+                    token_str += incomplete;
+                    incomplete.clear();
+                }
+            }
+            std::string pending = reserve + token_str;
+            if(!stream_done && (pending.empty() || (state->req.trim_stop && overlaps_stop_sequence(pending, state->req.stop_sequence))))
+            {
+                reserve = pending;
+                std::this_thread::sleep_for(poll_interval);
+                continue;
+            }
+            reserve.clear();
+            if(state->req.trim_stop)
+            {
+                trim_at_stop_sequences(pending, state->req.stop_sequence);
+            }
+            const char * reason = stream_done ? finish_reason(state->out.status==1?state->out.stopreason:get_last_stop_reason()) : "null";
+            if(!send_sse_event(sink, state->api_format, pending, reason))
+            {
+                aborted = true;
+                break;
+            }
+            if(stream_done)
+            {
+                break;
+            }
+        }
+        if(aborted)
+        {
+            printf("\nToken streaming was interrupted or aborted!\n");
+            abort_generate();
+        }
+        else if(state->api_format==4)
+        {
+            const std::string end = "data: [DONE]";
+            sink.write(end.data(), end.size());
+        }
+        if(state->worker.joinable())
+        {
+            state->worker.join();
+        }
+        state->lock.reset();
+        sink.done();
+        return true;
+    }, [state](bool) {
+        //make sure the model is released even if the writer never ran
+        if(state->worker.joinable())
+        {
+            abort_generate();
+            state->worker.join();
+        }
+        state->lock.reset();
+    });
+}
+
+static void print_usage(const char * exe)
+{
+    printf("usage: %s --model <model.gguf> [options]\n"
+    "  --port N                    port to listen on (default 5001)\n"
+    "  --host IP                   host to listen on (default all interfaces)\n"
+    "  --contextsize N             context size (default 4096)\n"
+    "  --threads N                 threads to use (default: based on cpu count)\n"
+    "  --blasthreads N             threads for prompt processing (default: same as --threads)\n"
+    "  --blasbatchsize N           prompt processing batch size (default 512)\n"
+    "  --gpulayers N               layers to offload to gpu (default 0)\n"
+    "  --rpc HOST:PORT,...         offload the gpu layers to these koboldcpp_rpc_server instances\n"
+    "  --mmproj FILE               multimodal projector for vision models\n"
+    "  --flashattention            enable flash attention\n"
+    "  --usemmap                   load the model with mmap\n"
+    "  --noshift                   disable context shifting\n"
+    "  --nofastforward             disable context fast forwarding\n"
+    "  --sinktokens N              keep the first N tokens and evict the oldest after them when the context overflows\n"
+    "  --asyncoutput               handle the text of each token on a worker thread while the next one decodes\n"
+    "  --pagedkv                   only back the cpu kv cache with memory as its cells are used\n"
+    "  --kvtier MB                 keep states of discarded contexts in up to this much ram, and restore them when a prompt matches again\n"
+    "  --kvtierdir DIR             spill states beyond the --kvtier budget to this directory instead of discarding them\n"
+    "  --password KEY              require this bearer key for generation endpoints\n"
+    "  --chatcompletionsadapter F  chat completions adapter json file with custom instruct tags\n"
+    "  --quiet                     hide generation inputs and outputs\n"
+    "  --debugmode                 show additional debug info\n", exe);
+}
+
+static bool parse_args(int argc, char ** argv)
+{
+    for(int i=1;i<argc;++i)
+    {
+        std::string arg = argv[i];
+        auto next = [&](std::string & target) {
+            if(i+1 >= argc) { throw std::invalid_argument("missing value for " + arg); }
+            target = argv[++i];
+        };
+        auto next_int = [&](int & target) {
+            std::string v;
+            next(v);
+            target = std::stoi(v);
+        };
+        if(arg=="--model" || arg=="-m") { next(server_args.model); }
+        else if(arg=="--mmproj") { next(server_args.mmproj); }
+        else if(arg=="--host") { next(server_args.host); }
+        else if(arg=="--port") { next_int(server_args.port); }
+        else if(arg=="--contextsize") { next_int(server_args.contextsize); }
+        else if(arg=="--threads") { next_int(server_args.threads); }
+        else if(arg=="--blasthreads") { next_int(server_args.blasthreads); }
+        else if(arg=="--blasbatchsize") { next_int(server_args.blasbatchsize); }
+        else if(arg=="--gpulayers") { next_int(server_args.gpulayers); }
+        else if(arg=="--rpc") { next(server_args.rpc); }
+        else if(arg=="--password") { next(server_args.password); }
+        else if(arg=="--chatcompletionsadapter") { next(server_args.chatcompletionsadapter); }
+        else if(arg=="--flashattention") { server_args.flashattention = true; }
+        else if(arg=="--usemmap") { server_args.usemmap = true; }
+        else if(arg=="--noshift") { server_args.noshift = true; }
+        else if(arg=="--nofastforward") { server_args.nofastforward = true; }
+        else if(arg=="--sinktokens") { next_int(server_args.sinktokens); }
+        else if(arg=="--asyncoutput") { server_args.asyncoutput = true; }
+        else if(arg=="--pagedkv") { server_args.pagedkv = true; }
+        else if(arg=="--kvtier") { next_int(server_args.kvtier); }
+        else if(arg=="--kvtierdir") { next(server_args.kvtierdir); }
+        else if(arg=="--quiet") { server_args.quiet = true; }
+        else if(arg=="--debugmode") { server_args.debugmode = 1; }
+        else if(arg=="--help" || arg=="-h") { return false; }
+        else
+        {
+            printf("Unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return server_args.model != "";
+}
+
+//stop listening on ctrl+c so main returns normally and the library cleans up (e.g. kv tier spill files)
+static httplib::Server * running_server = nullptr;
+static void shutdown_handler(int)
+{
+    static std::atomic<bool> stopping{false};
+    if(stopping.exchange(true) || running_server==nullptr)
+    {
+        std::_Exit(130);
+    }
+    running_server->stop();
+}
+
+int main(int argc, char ** argv)
+{
+    try
+    {
+        if(!parse_args(argc, argv))
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    catch(const std::exception & e)
+    {
+        printf("Error: %s\n", e.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if(server_args.threads <= 0)
+    {
+        //same default as the python launcher: leave one core free, avoid e-cores
+        int cores = std::max(1u, std::thread::hardware_concurrency() / 2);
+        server_args.threads = std::min(8, cores <= 3 ? cores : std::max(3, cores - 1));
+    }
+    if(server_args.blasthreads <= 0)
+    {
+        server_args.blasthreads = server_args.threads;
+    }
+    if(server_args.chatcompletionsadapter != "")
+    {
+        std::ifstream f(server_args.chatcompletionsadapter);
+        chatcompl_adapter = json::parse(f, nullptr, false);
+        if(!chatcompl_adapter.is_object())
+        {
+            printf("Error: could not parse chat completions adapter %s\n", server_args.chatcompletionsadapter.c_str());
+            return 1;
+        }
+    }
+
+    std::string exe = argv[0];
+    std::string exe_dir = (exe.find_last_of("/\\")==std::string::npos ? "./" : exe.substr(0, exe.find_last_of("/\\")+1));
+    load_model_inputs inputs = {};
+    inputs.threads = server_args.threads;
+    inputs.blasthreads = server_args.blasthreads;
+    inputs.max_context_length = server_args.contextsize;
+    inputs.executable_path = exe_dir.c_str();
+    inputs.model_filename = server_args.model.c_str();
+    inputs.lora_filename = "";
+    inputs.lora_base = "";
+    inputs.draftmodel_filename = "";
+    inputs.mmproj_filename = server_args.mmproj.c_str();
+    inputs.use_mmap = server_args.usemmap;
+    inputs.use_contextshift = !server_args.noshift;
+    inputs.use_fastforward = !server_args.nofastforward;
+    inputs.sink_tokens = server_args.sinktokens;
+    inputs.async_output = server_args.asyncoutput;
+    inputs.paged_kv = server_args.pagedkv;
+    inputs.vulkan_info = "";
+    inputs.blasbatchsize = server_args.blasbatchsize;
+    inputs.gpulayers = server_args.gpulayers;
+    inputs.rope_freq_scale = 0.0f;
+    inputs.kv_tier_ram_mb = server_args.kvtier;
+    inputs.kv_tier_dir = server_args.kvtierdir.c_str();
+    inputs.flash_attention = server_args.flashattention;
+    inputs.rpc_servers = server_args.rpc.c_str();
+    inputs.quiet = server_args.quiet;
+    inputs.debugmode = server_args.debugmode;
+    if(!load_model(inputs))
+    {
+        printf("Error: could not load model %s\n", server_args.model.c_str());
+        return 1;
+    }
+    std::string stem = server_args.model.substr(server_args.model.find_last_of("/\\")==std::string::npos?0:server_args.model.find_last_of("/\\")+1);
+    friendlymodelname = "koboldcpp/" + stem.substr(0, stem.find_last_of('.'));
+
+    httplib::Server svr;
+    svr.set_default_headers({{"Access-Control-Allow-Origin", "*"}, {"Access-Control-Allow-Headers", "*"}, {"Access-Control-Allow-Methods", "*"}});
+    svr.Options(R"(.*)", [](const httplib::Request &, httplib::Response & res) { res.status = 200; });
+
+    svr.Get("/api/v1/model", [](const httplib::Request & req, httplib::Response & res) {
+        send_json(res, {{"result", check_password(req)?friendlymodelname:"koboldcpp/protected-model"}});
+    });
+    svr.Get("/api/v1/config/max_context_length", [](const httplib::Request &, httplib::Response & res) {
+        send_json(res, {{"value", server_args.contextsize}});
+    });
+    svr.Get("/api/extra/true_max_context_length", [](const httplib::Request &, httplib::Response & res) {
+        send_json(res, {{"value", server_args.contextsize}});
+    });
+    svr.Get("/api/extra/version", [](const httplib::Request &, httplib::Response & res) {
+        send_json(res, {{"result", "KoboldCpp"}, {"version", kcpp_server_version}, {"protected", server_args.password!=""}, {"llm", true}, {"txt2img", false},
+                        {"vision", server_args.mmproj!=""}, {"transcribe", false}, {"multiplayer", false}, {"websearch", false}, {"tts", false}, {"admin", 0}});
+    });
+    svr.Get("/metrics", [](const httplib::Request &, httplib::Response & res) {
+        std::string metrics = get_metrics();
+        metrics += "# HELP kcpp_queue_requests Requests waiting or running.\n# TYPE kcpp_queue_requests gauge\n";
+        metrics += "kcpp_queue_requests " + std::to_string(requests_in_queue.load()) + "\n";
+        res.set_content(metrics, "text/plain; version=0.0.4");
+    });
+    svr.Get("/v1/models", [](const httplib::Request &, httplib::Response & res) {
+        send_json(res, {{"object", "list"}, {"data", json::array({{{"id", friendlymodelname}, {"object", "model"}, {"created", (int64_t)time(nullptr)}, {"owned_by", "koboldcpp"}, {"permission", json::array()}, {"root", "koboldcpp"}}})}});
+    });
+
+    svr.Post("/api/v1/generate", [](const httplib::Request & req, httplib::Response & res) {
+        handle_generate(req, res, 2);
+    });
+    svr.Post("/api/extra/generate/stream", [](const httplib::Request & req, httplib::Response & res) {
+        handle_generate_stream(req, res, 2);
+    });
+    svr.Post("/v1/chat/completions", [](const httplib::Request & req, httplib::Response & res) {
+        json body = json::parse(req.body, nullptr, false);
+        if(body.is_object() && json_get<bool>(body,"stream",false))
+        {
+            handle_generate_stream(req, res, 4);
+        }
+        else
+        {
+            handle_generate(req, res, 4);
+        }
+    });
+    svr.Post("/api/extra/abort", [](const httplib::Request & req, httplib::Response & res) {
+        if(!check_password(req))
+        {
+            send_json(res, {{"success", "false"}, {"done", "false"}}, 401);
+            return;
+        }
+        bool ok = abort_generate();
+        send_json(res, {{"success", ok?"true":"false"}, {"done", "true"}});
+    });
+
+    //generation is serialized, so a few extra workers are enough to queue requests and serve info endpoints
+    svr.new_task_queue = [] { return new httplib::ThreadPool(max_queued_requests + 4); };
+    printf("\nStarting native Kobold API server on %s:%d (model: %s)\n", server_args.host.c_str(), server_args.port, friendlymodelname.c_str());
+    running_server = &svr;
+    std::signal(SIGINT, shutdown_handler);
+    std::signal(SIGTERM, shutdown_handler);
+    if(!svr.listen(server_args.host, server_args.port))
+    {
+        printf("Error: could not listen on %s:%d\n", server_args.host.c_str(), server_args.port);
+        return 1;
+    }
+    return 0;
+}
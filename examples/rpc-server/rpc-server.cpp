@@ -0,0 +1,126 @@
+// serves this machine's CPU and RAM to a koboldcpp instance started with --rpc
+// usage: koboldcpp_rpc_server [--host 127.0.0.1] [--port 50052] [--threads N] [--mem MB] [--cache DIR] [--cache-size MB]
+
+#include "ggml.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "ggml-rpc.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  ifndef NOMINMAX
+#     define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+// the cpu device does not report memory, so ask the os directly
+static void get_system_memory(size_t * free_mem, size_t * total_mem) {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatusEx(&status);
+    *total_mem = status.ullTotalPhys;
+    *free_mem = status.ullAvailPhys;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    *total_mem = (pages > 0 && page_size > 0) ? (size_t) pages * page_size : 0;
+#ifdef _SC_AVPHYS_PAGES
+    long avail_pages = sysconf(_SC_AVPHYS_PAGES);
+    *free_mem = avail_pages > 0 ? (size_t) avail_pages * page_size : *total_mem;
+#else
+    *free_mem = *total_mem;
+#endif
+#endif
+}
+
+static void print_usage(const char * prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  --host HOST    address to bind to (default: 127.0.0.1)\n");
+    fprintf(stderr, "  --port PORT    port to listen on (default: 50052)\n");
+    fprintf(stderr, "  --threads N    CPU threads used for compute (default: all cores)\n");
+    fprintf(stderr, "  --mem MB       memory to advertise to clients (default: system RAM)\n");
+    fprintf(stderr, "  --cache DIR    keep large uploaded tensors in DIR so later loads skip the transfer\n");
+    fprintf(stderr, "  --cache-size MB  limit for the cache directory, oldest entries are evicted (default: 10240, 0 = unlimited)\n");
+}
+
+int main(int argc, char ** argv) {
+    std::string host = "127.0.0.1";
+    int port = 50052;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t mem_mb = 0;
+    std::string cache_dir;
+    size_t cache_size_mb = 10240;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--mem" && has_value) {
+            mem_mb = (size_t) std::max(0, atoi(argv[++i]));
+        } else if (arg == "--cache" && has_value) {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-size" && has_value) {
+            cache_size_mb = (size_t) std::max(0, atoi(argv[++i]));
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "error: invalid port %d\n", port);
+        return 1;
+    }
+    if (host != "127.0.0.1" && host != "localhost") {
+        fprintf(stderr, "WARNING: the RPC protocol is unauthenticated, only expose it on a trusted network!\n");
+    }
+
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_t backend = dev ? ggml_backend_dev_init(dev, nullptr) : nullptr;
+    if (backend == nullptr) {
+        fprintf(stderr, "error: failed to create the CPU backend\n");
+        return 1;
+    }
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+    size_t free_mem = 0;
+    size_t total_mem = 0;
+    get_system_memory(&free_mem, &total_mem);
+    if (mem_mb > 0) {
+        free_mem = mem_mb * 1024 * 1024;
+        total_mem = free_mem;
+    }
+
+    if (!cache_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(cache_dir, ec);
+        if (ec) {
+            fprintf(stderr, "error: cannot create cache directory %s: %s\n", cache_dir.c_str(), ec.message().c_str());
+            return 1;
+        }
+    }
+
+    const std::string endpoint = host + ":" + std::to_string(port);
+    printf("Starting RPC server on %s, %d threads, %zu MB advertised%s%s\n", endpoint.c_str(), n_threads, free_mem / (1024 * 1024),
+        cache_dir.empty() ? "" : ", tensor cache in ", cache_dir.c_str());
+    fflush(stdout);
+    ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir.empty() ? nullptr : cache_dir.c_str(), cache_size_mb * 1024 * 1024, free_mem, total_mem);
+    ggml_backend_free(backend);
+    return 0;
+}
@@ -0,0 +1,140 @@
+// measures tokenizer throughput of a gguf vocab over a local text corpus
+// usage: tokenize_bench <model.gguf> <corpus.txt> [repeats]
+//        tokenize_bench --selftest <model.gguf>   checks the cached bpe path against the direct one
+
+#include "llama.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int tokenize_all(const llama_vocab * vocab, const std::string & text, std::vector<llama_token> & tokens, bool add_special = true) {
+    tokens.resize(text.size() + 2);
+    int n = llama_tokenize(vocab, text.c_str(), (int32_t) text.size(), tokens.data(), (int32_t) tokens.size(), add_special, true);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text.c_str(), (int32_t) text.size(), tokens.data(), (int32_t) tokens.size(), add_special, true);
+    }
+    tokens.resize(n > 0 ? n : 0);
+    return n;
+}
+
+// inputs of many words go through the fragment cache, so tokenize them whole (cold, then warm) and compare with
+// the same text cut into lines short enough for the direct path. a newline between two non-space characters is a
+// pre-tokenized word of its own, so cutting after it does not change the split
+static bool selftest_text(const llama_vocab * vocab, const std::string & name, const std::string & text) {
+    std::vector<llama_token> direct;
+    std::vector<llama_token> line_tokens;
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\n' && i > 0 && i + 1 < text.size() && !isspace((unsigned char) text[i - 1]) && !isspace((unsigned char) text[i + 1])) {
+            tokenize_all(vocab, text.substr(start, i + 1 - start), line_tokens, false);
+            direct.insert(direct.end(), line_tokens.begin(), line_tokens.end());
+            start = i + 1;
+        }
+    }
+    tokenize_all(vocab, text.substr(start), line_tokens, false);
+    direct.insert(direct.end(), line_tokens.begin(), line_tokens.end());
+
+    bool ok = true;
+    std::vector<llama_token> cached;
+    for (const char * pass : { "cold", "warm" }) {
+        tokenize_all(vocab, text, cached, false);
+        if (cached != direct) {
+            printf("FAIL: %s, %s cache gives %zu tokens, direct path %zu\n", name.c_str(), pass, cached.size(), direct.size());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static int run_selftest(const llama_vocab * vocab) {
+    // every line stays under the direct path's word limit, the whole text is well over it
+    const std::string line =
+        "The quick brown fox's 12345 jumps, over 3.14 lazy dogs -- didn't it? \"Yes!\" she said:  well...\n"
+        "code:    indented(x) { return x->y[0] + 0x1F; }  // comment\t\ttabs\n"
+        "Ünïcödé façade naïve café, 日本語のテキスト, Здравствуй мир, emoji 🙂🙂 and     spaces   \n\n"
+        "I'm   you're we've they'll  HE'S ALL-CAPS 1,000,000 2024-10-19 a+b=c\n";
+    std::string text;
+    for (int r = 0; r < 8; ++r) {
+        text += line;
+    }
+
+    // more distinct words than the cache holds, so fragments get evicted and long runs of misses are merged in parallel
+    std::mt19937 rng(1234);
+    std::string many_words;
+    for (int w = 0; w < 80000; ++w) {
+        many_words += (w % 32 == 31 ? "\n" : " ");
+        const int len = 2 + rng() % 7;
+        for (int c = 0; c < len; ++c) {
+            many_words += (char) ('a' + rng() % 26);
+        }
+    }
+
+    const bool ok = selftest_text(vocab, "mixed text", text) && selftest_text(vocab, "80000 random words", many_words);
+    printf("selftest: %s\n", ok ? "all checks passed" : "checks failed");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    const bool selftest = argc == 3 && std::string(argv[1]) == "--selftest";
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <model.gguf> <corpus.txt> [repeats]\n"
+                        "       %s --selftest <model.gguf>\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (selftest) {
+        llama_backend_init();
+        llama_model_params mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+        llama_model * model = llama_model_load_from_file(argv[2], mparams);
+        if (model == nullptr) {
+            fprintf(stderr, "error: cannot load vocab from %s\n", argv[2]);
+            return 1;
+        }
+        const int ret = run_selftest(llama_model_get_vocab(model));
+        llama_model_free(model);
+        llama_backend_free();
+        return ret;
+    }
+    const int repeats = argc > 3 ? std::max(1, atoi(argv[3])) : 5;
+
+    std::ifstream file(argv[2], std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "error: cannot open corpus %s\n", argv[2]);
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string corpus = buffer.str();
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "error: cannot load vocab from %s\n", argv[1]);
+        return 1;
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const double mb = corpus.size() / (1024.0 * 1024.0);
+    printf("corpus: %.2f MB, vocab: %d tokens\n", mb, llama_vocab_n_tokens(vocab));
+
+    std::vector<llama_token> tokens;
+    for (int r = 0; r < repeats; ++r) {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        const int n = tokenize_all(vocab, corpus, tokens);
+        const double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        printf("pass %d%s: %d tokens in %.3f s, %.2f MB/s, %.0f tokens/s\n", r + 1, r == 0 ? " (cold)" : "", n, sec, mb / sec, n / sec);
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+    return 0;
+}
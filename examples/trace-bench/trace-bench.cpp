@@ -0,0 +1,658 @@
+// replays a jsonl trace of generation requests against a local gguf model and reports latency figures
+// usage: trace_bench --model <model.gguf> --trace <trace.jsonl> [--contextsize 4096] [--threads n] [--nowait] [--csv out.csv]
+//        trace_bench --selftest   runs deterministic checks of the engine helpers, no model needed
+//
+// every trace line is one request with the same sampler fields as /api/v1/generate, plus:
+//   "delay_ms"  time after the previous request arrived that this one arrives (default 0)
+//   "prompt"    full prompt text, or instead build it from the previous request with
+//   "base"      "output" (previous prompt followed by its generated text, default) or "prompt" (previous prompt only)
+//   "trim"      number of characters removed from the end of the base (edits and regenerations)
+//   "append"    text appended after trimming (the next user turn)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "expose.h"
+#include "utils.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+extern "C"
+{
+    bool load_model(const load_model_inputs inputs);
+    generation_outputs generate(const generation_inputs inputs);
+    int get_stream_count();
+}
+
+using bench_clock = std::chrono::steady_clock;
+
+struct trace_bench_args
+{
+    std::string model;
+    std::string trace;
+    std::string csv;
+    int contextsize = 4096;
+    int threads = 0;
+    int blasbatchsize = 512;
+    int gpulayers = 0;
+    bool flashattention = false;
+    bool noshift = false;
+    bool nofastforward = false;
+    bool nowait = false;
+    bool verbose = false;
+    bool selftest = false;
+};
+
+//one replayed request, owns every string the generation_inputs point into
+struct trace_request
+{
+    json params;
+    std::string prompt;
+    std::string memory;
+    std::vector<std::string> stop_sequence;
+    std::vector<const char *> stop_ptrs;
+    double delay_ms = 0;
+
+    //results
+    double arrival_s = 0;
+    double queue_s = 0;
+    double ttft_s = -1;
+    double total_s = 0;
+    std::vector<double> token_gaps_s;
+    int input_tokens = 0;
+    int fastforward_tokens = 0;
+    int gen_tokens = 0;
+    int context_shifts = 0;
+    float sampler_s = 0;
+    std::string output;
+};
+
+static trace_bench_args bench_args;
+
+template <typename T>
+static T json_get(const json & obj, const char * key, T fallback)
+{
+    auto it = obj.find(key);
+    if(it == obj.end() || it->is_null())
+    {
+        return fallback;
+    }
+    try
+    {
+        return it->get<T>();
+    }
+    catch(const std::exception &)
+    {
+        return fallback;
+    }
+}
+
+static double percentile(std::vector<double> vals, double pct)
+{
+    if(vals.empty())
+    {
+        return 0;
+    }
+    std::sort(vals.begin(), vals.end());
+    size_t idx = (size_t)std::min<double>(vals.size() - 1, pct / 100.0 * (vals.size() - 1) + 0.5);
+    return vals[idx];
+}
+
+static bool load_trace(const std::string & path, std::vector<trace_request> & requests)
+{
+    std::ifstream file(path);
+    if(!file)
+    {
+        printf("Error: cannot open trace %s\n", path.c_str());
+        return false;
+    }
+    std::string line;
+    int lineno = 0;
+    while(std::getline(file, line))
+    {
+        ++lineno;
+        if(line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+        json obj = json::parse(line, nullptr, false);
+        if(!obj.is_object())
+        {
+            printf("Error: trace line %d is not a json object\n", lineno);
+            return false;
+        }
+        trace_request req;
+        req.params = obj;
+        req.delay_ms = json_get<double>(obj, "delay_ms", 0.0);
+        req.memory = json_get<std::string>(obj, "memory", "");
+        if(obj.contains("stop_sequence") && obj["stop_sequence"].is_array())
+        {
+            for(const auto & s : obj["stop_sequence"])
+            {
+                if(s.is_string())
+                {
+                    req.stop_sequence.push_back(s.get<std::string>());
+                }
+            }
+        }
+        requests.push_back(req);
+    }
+    return !requests.empty();
+}
+
+//resolves prompt edits against the previous request, which must already have been replayed
+static void build_prompt(trace_request & req, const trace_request * prev)
+{
+    const json & p = req.params;
+    if(p.contains("prompt") || prev == nullptr)
+    {
+        req.prompt = json_get<std::string>(p, "prompt", "");
+        return;
+    }
+    std::string base = prev->prompt;
+    if(json_get<std::string>(p, "base", "output") != "prompt")
+    {
+        base += prev->output;
+    }
+    size_t trim = (size_t)std::max(0, json_get<int>(p, "trim", 0));
+    base.resize(base.size() - std::min(trim, base.size()));
+    req.prompt = base + json_get<std::string>(p, "append", "");
+}
+
+static generation_inputs make_inputs(trace_request & req)
+{
+    const json & p = req.params;
+    req.stop_ptrs.clear();
+    for(const auto & s : req.stop_sequence)
+    {
+        req.stop_ptrs.push_back(s.c_str());
+    }
+    generation_inputs in = {};
+    const int sampler_max = sizeof(in.sampler_order)/sizeof(in.sampler_order[0]);
+    const samplers default_order[] = {KCPP_SAMPLER_REP_PEN, KCPP_SAMPLER_TOP_K, KCPP_SAMPLER_TOP_A, KCPP_SAMPLER_TFS, KCPP_SAMPLER_TYP, KCPP_SAMPLER_TOP_P, KCPP_SAMPLER_TEMP};
+    for(samplers s : default_order)
+    {
+        if(in.sampler_len < sampler_max)
+        {
+            in.sampler_order[in.sampler_len++] = s;
+        }
+    }
+    if(p.contains("sampler_order") && p["sampler_order"].is_array())
+    {
+        in.sampler_len = 0;
+        for(const auto & v : p["sampler_order"])
+        {
+            if(v.is_number_integer() && in.sampler_len < sampler_max && v.get<int>() >= 0 && v.get<int>() < KCPP_SAMPLER_MAX)
+            {
+                in.sampler_order[in.sampler_len++] = (samplers)v.get<int>();
+            }
+        }
+    }
+    for(int i=0;i<images_max;++i)
+    {
+        in.images[i] = "";
+    }
+    in.seed = json_get<int>(p, "sampler_seed", 1);
+    in.prompt = req.prompt.c_str();
+    in.memory = req.memory.c_str();
+    in.max_context_length = std::min(bench_args.contextsize, json_get<int>(p, "max_context_length", bench_args.contextsize));
+    in.max_length = json_get<int>(p, "max_length", 100);
+    in.temperature = json_get<float>(p, "temperature", 0.75f);
+    in.top_k = json_get<int>(p, "top_k", 100);
+    in.top_a = json_get<float>(p, "top_a", 0.0f);
+    in.top_p = json_get<float>(p, "top_p", 0.92f);
+    in.min_p = json_get<float>(p, "min_p", 0.0f);
+    in.typical_p = json_get<float>(p, "typical", 1.0f);
+    in.tfs = json_get<float>(p, "tfs", 1.0f);
+    in.rep_pen = json_get<float>(p, "rep_pen", 1.0f);
+    in.rep_pen_range = json_get<int>(p, "rep_pen_range", 320);
+    in.rep_pen_slope = json_get<float>(p, "rep_pen_slope", 1.0f);
+    in.presence_penalty = json_get<float>(p, "presence_penalty", 0.0f);
+    in.mirostat = json_get<int>(p, "mirostat", 0);
+    in.mirostat_eta = json_get<float>(p, "mirostat_eta", 0.1f);
+    in.mirostat_tau = json_get<float>(p, "mirostat_tau", 5.0f);
+    in.xtc_threshold = json_get<float>(p, "xtc_threshold", 0.2f);
+    in.xtc_probability = json_get<float>(p, "xtc_probability", 0.0f);
+    in.allow_eos_token = !json_get<bool>(p, "ban_eos_token", false);
+    in.bypass_eos_token = json_get<bool>(p, "bypass_eos", false);
+    in.render_special = json_get<bool>(p, "render_special", false);
+    in.stream_sse = true;
+    in.grammar = "";
+    in.grammar_retain_state = false;
+    in.dynatemp_range = json_get<float>(p, "dynatemp_range", 0.0f);
+    in.dynatemp_exponent = json_get<float>(p, "dynatemp_exponent", 1.0f);
+    in.smoothing_factor = json_get<float>(p, "smoothing_factor", 0.0f);
+    in.dry_multiplier = json_get<float>(p, "dry_multiplier", 0.0f);
+    in.dry_base = json_get<float>(p, "dry_base", 1.75f);
+    in.dry_allowed_length = json_get<int>(p, "dry_allowed_length", 2);
+    in.dry_penalty_last_n = json_get<int>(p, "dry_penalty_last_n", 320);
+    in.dry_sequence_breakers_len = 0;
+    in.dry_sequence_breakers = nullptr;
+    in.stop_sequence_len = (int)req.stop_ptrs.size();
+    in.stop_sequence = req.stop_ptrs.data();
+    return in;
+}
+
+//runs one request on a worker thread while this thread timestamps every streamed token
+static void replay_request(trace_request & req, bench_clock::time_point bench_start)
+{
+    generation_inputs inputs = make_inputs(req);
+    const int shifts_before = total_context_shifts;
+    bench_clock::time_point start = bench_clock::now();
+    req.queue_s = std::chrono::duration<double>(start - bench_start).count() - req.arrival_s;
+
+    generation_outputs out;
+    std::atomic<bool> done{false};
+    generated_tokens.clear(); //the stream still holds the previous request until the engine resets it
+
+    std::thread worker([&]() {
+        out = generate(inputs);
+        done = true;
+    });
+
+    int seen = 0;
+    bench_clock::time_point last_token = start;
+    while(true)
+    {
+        bool finished = done;
+        int count = get_stream_count();
+        if(count > seen)
+        {
+            bench_clock::time_point now = bench_clock::now();
+            if(seen == 0)
+            {
+                req.ttft_s = std::chrono::duration<double>(now - start).count() + req.queue_s;
+            }
+            else
+            {
+                req.token_gaps_s.push_back(std::chrono::duration<double>(now - last_token).count() / (count - seen));
+            }
+            last_token = now;
+            seen = count;
+        }
+        if(finished)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    worker.join();
+
+    req.total_s = std::chrono::duration<double>(bench_clock::now() - start).count() + req.queue_s;
+    req.output = (out.status == 1 && out.text ? out.text : "");
+    req.input_tokens = last_input_count;
+    req.fastforward_tokens = last_fastforward_count;
+    req.gen_tokens = last_token_count;
+    req.context_shifts = total_context_shifts - shifts_before;
+    req.sampler_s = last_sampler_time;
+}
+
+//
+// selftest
+//
+
+static int selftest_failures = 0;
+
+static void selftest_check(bool ok, const std::string & what)
+{
+    if(!ok)
+    {
+        printf("FAIL: %s\n", what.c_str());
+        ++selftest_failures;
+    }
+}
+
+static void selftest_base64()
+{
+    //rfc 4648 test vectors, covering every padding length
+    const char * vectors[][2] = {{"",""},{"f","Zg=="},{"fo","Zm8="},{"foo","Zm9v"},{"foob","Zm9vYg=="},{"fooba","Zm9vYmE="},{"foobar","Zm9vYmFy"}};
+    for(const auto & v : vectors)
+    {
+        const std::string plain = v[0];
+        selftest_check(kcpp_base64_encode(plain) == v[1], "base64 encode \"" + plain + "\"");
+        const std::vector<uint8_t> dec = kcpp_base64_decode(std::string(v[1]));
+        selftest_check(std::string(dec.begin(), dec.end()) == plain, "base64 decode \"" + std::string(v[1]) + "\"");
+    }
+
+    //missing padding decodes the same, and decoding stops at the first non-base64 character
+    std::vector<uint8_t> dec = kcpp_base64_decode(std::string("Zm9vYmE"));
+    selftest_check(std::string(dec.begin(), dec.end()) == "fooba", "base64 decode without padding");
+    dec = kcpp_base64_decode(std::string("Zm9v\nYmFy"));
+    selftest_check(std::string(dec.begin(), dec.end()) == "foo", "base64 decode stops at newline");
+
+    //round trip of random binary buffers of every length up to 300
+    std::mt19937 rng(1234);
+    for(int len=0;len<=300;++len)
+    {
+        std::string data(len, '\0');
+        for(char & c : data)
+        {
+            c = (char)(rng() & 0xFF);
+        }
+        const std::string enc = kcpp_base64_encode(data);
+        dec = kcpp_base64_decode(enc);
+        selftest_check(enc.size() == (size_t)((len + 2) / 3) * 4 && std::string(dec.begin(), dec.end()) == data, "base64 round trip of " + std::to_string(len) + " bytes");
+    }
+}
+
+//every (end, phrase) pair a matcher reports over text fed in chunks of at most max_chunk bytes
+static std::vector<std::pair<size_t,int>> selftest_scan(const kcpp_phrase_matcher & m, const std::string & text, size_t max_chunk, std::mt19937 & rng)
+{
+    std::vector<std::pair<size_t,int>> found;
+    int state = 0;
+    for(size_t pos=0;pos<text.size();)
+    {
+        const size_t len = std::min(text.size() - pos, 1 + rng() % max_chunk);
+        state = m.scan(state, text.substr(pos, len), [&](int p, size_t end){ found.emplace_back(pos + end, p); });
+        pos += len;
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+static void selftest_phrase_matcher()
+{
+    kcpp_phrase_matcher m;
+    m.build({"he","she","his","hers"}, false);
+    std::mt19937 rng(1234);
+    const std::vector<std::pair<size_t,int>> ushers = {{4,0},{4,1},{6,3}};
+    selftest_check(selftest_scan(m, "ushers", 6, rng) == ushers, "phrase matcher overlapping matches in \"ushers\"");
+
+    m.build({}, false);
+    selftest_check(m.empty() && selftest_scan(m, "anything", 3, rng).empty(), "phrase matcher without phrases");
+
+    //against a naive search: a duplicated phrase reports its lowest index, ignore_case folds both sides
+    for(int ignore_case=0;ignore_case<2;++ignore_case)
+    {
+        const std::string alphabet = "abAB";
+        std::vector<std::string> phrases;
+        for(int p=0;p<12;++p)
+        {
+            std::string phrase(1 + rng() % 4, 'a');
+            for(char & c : phrase)
+            {
+                c = alphabet[rng() % alphabet.size()];
+            }
+            phrases.push_back(phrase);
+        }
+        phrases.push_back(phrases[3]);
+        std::string text(2000, 'a');
+        for(char & c : text)
+        {
+            c = alphabet[rng() % alphabet.size()];
+        }
+
+        auto fold = [&](std::string str) {
+            if(ignore_case)
+            {
+                std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+            }
+            return str;
+        };
+        std::vector<std::pair<size_t,int>> expected;
+        const std::string folded = fold(text);
+        for(size_t end=1;end<=text.size();++end)
+        {
+            std::vector<std::string> seen;
+            for(int p=0;p<phrases.size();++p)
+            {
+                const std::string fp = fold(phrases[p]);
+                if(fp.size() <= end && folded.compare(end - fp.size(), fp.size(), fp) == 0 && std::find(seen.begin(), seen.end(), fp) == seen.end())
+                {
+                    seen.push_back(fp);
+                    expected.emplace_back(end, p);
+                }
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        m.build(phrases, ignore_case);
+        const std::string mode = (ignore_case ? " ignoring case" : "");
+        selftest_check(selftest_scan(m, text, text.size(), rng) == expected, "phrase matcher against naive search" + mode);
+        selftest_check(selftest_scan(m, text, 7, rng) == expected, "phrase matcher fed in chunks" + mode);
+    }
+}
+
+static void selftest_metrics()
+{
+    //nothing else records metrics in a selftest run, so the whole exposition text is known
+    kcpp_metric_add("kcpp_selftest_total", "Counter help.", 2);
+    kcpp_metric_add("kcpp_selftest_total", "Ignored help.", 0.5);
+    kcpp_metric_add("kcpp_selftest_total", "Counter help.", 1, "kind=\"a\"");
+    kcpp_metric_observe("kcpp_selftest_tokens", "Histogram help.", 1, KCPP_METRIC_TOKENS, "kind=\"b\"");
+    kcpp_metric_observe("kcpp_selftest_tokens", "Histogram help.", 5, KCPP_METRIC_TOKENS, "kind=\"b\"");
+    kcpp_metric_observe("kcpp_selftest_tokens", "Histogram help.", 100000, KCPP_METRIC_TOKENS, "kind=\"b\"");
+    const std::string expected =
+    "# HELP kcpp_selftest_tokens Histogram help.\n"
+    "# TYPE kcpp_selftest_tokens histogram\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"1\"} 1\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"4\"} 1\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"16\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"64\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"256\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"1024\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"4096\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"16384\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"65536\"} 2\n"
+    "kcpp_selftest_tokens_bucket{kind=\"b\",le=\"+Inf\"} 3\n"
+    "kcpp_selftest_tokens_sum{kind=\"b\"} 100006\n"
+    "kcpp_selftest_tokens_count{kind=\"b\"} 3\n"
+    "# HELP kcpp_selftest_total Counter help.\n"
+    "# TYPE kcpp_selftest_total counter\n"
+    "kcpp_selftest_total 2.5\n"
+    "kcpp_selftest_total{kind=\"a\"} 1\n";
+    const std::string text = kcpp_metrics_text();
+    selftest_check(text == expected, "prometheus text output, got:\n" + text);
+}
+
+static int run_selftests()
+{
+    selftest_base64();
+    selftest_phrase_matcher();
+    selftest_metrics();
+    if(selftest_failures > 0)
+    {
+        printf("selftest: %d checks failed\n", selftest_failures);
+        return 1;
+    }
+    printf("selftest: all checks passed\n");
+    return 0;
+}
+
+static void print_usage(const char * exe)
+{
+    printf("usage: %s --model <model.gguf> --trace <trace.jsonl> [options]\n"
+    "       %s --selftest\n"
+    "  --contextsize N             context size (default 4096)\n"
+    "  --threads N                 generation threads\n"
+    "  --blasbatchsize N           prompt processing batch size (default 512)\n"
+    "  --gpulayers N               layers to offload\n"
+    "  --flashattention            use flash attention\n"
+    "  --noshift                   disable context shifting\n"
+    "  --nofastforward             disable fast forwarding\n"
+    "  --nowait                    ignore delay_ms and replay requests back to back\n"
+    "  --csv F                     write per request results to a csv file\n"
+    "  --verbose                   show the engine's generation logs\n", exe, exe);
+}
+
+static bool parse_args(int argc, char ** argv)
+{
+    for(int i=1;i<argc;++i)
+    {
+        std::string arg = argv[i];
+        auto next = [&](std::string & target) {
+            if(i+1 >= argc) { throw std::invalid_argument("missing value for " + arg); }
+            target = argv[++i];
+        };
+        auto next_int = [&](int & target) {
+            std::string v;
+            next(v);
+            target = std::stoi(v);
+        };
+        if(arg=="--model" || arg=="-m") { next(bench_args.model); }
+        else if(arg=="--trace") { next(bench_args.trace); }
+        else if(arg=="--csv") { next(bench_args.csv); }
+        else if(arg=="--contextsize") { next_int(bench_args.contextsize); }
+        else if(arg=="--threads") { next_int(bench_args.threads); }
+        else if(arg=="--blasbatchsize") { next_int(bench_args.blasbatchsize); }
+        else if(arg=="--gpulayers") { next_int(bench_args.gpulayers); }
+        else if(arg=="--flashattention") { bench_args.flashattention = true; }
+        else if(arg=="--noshift") { bench_args.noshift = true; }
+        else if(arg=="--nofastforward") { bench_args.nofastforward = true; }
+        else if(arg=="--nowait") { bench_args.nowait = true; }
+        else if(arg=="--verbose") { bench_args.verbose = true; }
+        else if(arg=="--selftest") { bench_args.selftest = true; }
+        else if(arg=="--help" || arg=="-h") { return false; }
+        else
+        {
+            printf("Unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return bench_args.selftest || (bench_args.model != "" && bench_args.trace != "");
+}
+
+int main(int argc, char ** argv)
+{
+    try
+    {
+        if(!parse_args(argc, argv))
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    catch(const std::exception & e)
+    {
+        printf("Error: %s\n", e.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(bench_args.selftest)
+    {
+        return run_selftests();
+    }
+
+    std::vector<trace_request> requests;
+    if(!load_trace(bench_args.trace, requests))
+    {
+        printf("Error: no requests in trace %s\n", bench_args.trace.c_str());
+        return 1;
+    }
+
+    if(bench_args.threads <= 0)
+    {
+        int cores = std::max(1u, std::thread::hardware_concurrency() / 2);
+        bench_args.threads = std::min(8, cores <= 3 ? cores : std::max(3, cores - 1));
+    }
+    std::string exe = argv[0];
+    std::string exe_dir = (exe.find_last_of("/\\")==std::string::npos ? "./" : exe.substr(0, exe.find_last_of("/\\")+1));
+    load_model_inputs inputs = {};
+    inputs.threads = bench_args.threads;
+    inputs.blasthreads = bench_args.threads;
+    inputs.max_context_length = bench_args.contextsize;
+    inputs.executable_path = exe_dir.c_str();
+    inputs.model_filename = bench_args.model.c_str();
+    inputs.lora_filename = "";
+    inputs.lora_base = "";
+    inputs.draftmodel_filename = "";
+    inputs.mmproj_filename = "";
+    inputs.use_mmap = false;
+    inputs.use_contextshift = !bench_args.noshift;
+    inputs.use_fastforward = !bench_args.nofastforward;
+    inputs.vulkan_info = "";
+    inputs.blasbatchsize = bench_args.blasbatchsize;
+    inputs.gpulayers = bench_args.gpulayers;
+    inputs.rope_freq_scale = 0.0f;
+    inputs.rope_freq_base = 10000.0f;
+    inputs.kv_tier_dir = "";
+    inputs.flash_attention = bench_args.flashattention;
+    inputs.quiet = !bench_args.verbose;
+    inputs.debugmode = (bench_args.verbose ? 0 : -1);
+    if(!load_model(inputs))
+    {
+        printf("Error: could not load model %s\n", bench_args.model.c_str());
+        return 1;
+    }
+
+    printf("\nReplaying %d requests from %s%s\n", (int)requests.size(), bench_args.trace.c_str(), (bench_args.nowait?" (ignoring delays)":""));
+    bench_clock::time_point bench_start = bench_clock::now();
+    double arrival_s = 0;
+    for(size_t i=0;i<requests.size();++i)
+    {
+        trace_request & req = requests[i];
+        build_prompt(req, i > 0 ? &requests[i-1] : nullptr);
+        if(bench_args.nowait)
+        {
+            arrival_s = std::chrono::duration<double>(bench_clock::now() - bench_start).count();
+        }
+        else
+        {
+            arrival_s += req.delay_ms / 1000.0;
+            std::this_thread::sleep_until(bench_start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(arrival_s)));
+        }
+        req.arrival_s = arrival_s;
+        replay_request(req, bench_start);
+        printf("\n[%d/%d] in:%d ff:%d out:%d ttft:%.3fs total:%.3fs", (int)(i+1), (int)requests.size(), req.input_tokens, req.fastforward_tokens, req.gen_tokens, req.ttft_s, req.total_s);
+        fflush(stdout);
+    }
+    double wall_s = std::chrono::duration<double>(bench_clock::now() - bench_start).count();
+
+    std::vector<double> ttfts, queues, gaps;
+    long long input_tokens = 0, ff_tokens = 0, gen_tokens = 0;
+    int ff_requests = 0, shifts = 0, shift_requests = 0;
+    double sampler_s = 0;
+    for(const auto & req : requests)
+    {
+        if(req.ttft_s >= 0)
+        {
+            ttfts.push_back(req.ttft_s);
+        }
+        queues.push_back(req.queue_s);
+        gaps.insert(gaps.end(), req.token_gaps_s.begin(), req.token_gaps_s.end());
+        input_tokens += req.input_tokens;
+        ff_tokens += req.fastforward_tokens;
+        gen_tokens += req.gen_tokens;
+        ff_requests += (req.fastforward_tokens > 0 ? 1 : 0);
+        shifts += req.context_shifts;
+        shift_requests += (req.context_shifts > 0 ? 1 : 0);
+        sampler_s += req.sampler_s;
+    }
+    int n = (int)requests.size();
+    printf("\n\nRequests:          %d in %.2fs, %lld generated tokens (%.2f T/s overall)\n", n, wall_s, gen_tokens, gen_tokens / wall_s);
+    printf("Queue wait (s):    p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", percentile(queues,50), percentile(queues,90), percentile(queues,99), percentile(queues,100));
+    printf("TTFT (s):          p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", percentile(ttfts,50), percentile(ttfts,90), percentile(ttfts,99), percentile(ttfts,100));
+    printf("Token latency(ms): p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n", percentile(gaps,50)*1000, percentile(gaps,90)*1000, percentile(gaps,99)*1000, percentile(gaps,100)*1000);
+    printf("Fast forward:      %.1f%% of %lld prompt tokens reused, %d/%d requests hit\n", (input_tokens > 0 ? 100.0 * ff_tokens / input_tokens : 0.0), input_tokens, ff_requests, n);
+    printf("Context shifts:    %d in %d/%d requests\n", shifts, shift_requests, n);
+    printf("Sampler time:      %.3fs total, %.3fms per token\n", sampler_s, (gen_tokens > 0 ? sampler_s * 1000 / gen_tokens : 0.0));
+
+    if(bench_args.csv != "")
+    {
+        FILE * f = fopen(bench_args.csv.c_str(), "w");
+        if(!f)
+        {
+            printf("Error: cannot write %s\n", bench_args.csv.c_str());
+            return 1;
+        }
+        fprintf(f, "index,arrival_s,queue_s,ttft_s,total_s,input_tokens,fastforward_tokens,gen_tokens,context_shifts,sampler_s,token_latency_p50_ms,token_latency_p99_ms\n");
+        for(int i=0;i<n;++i)
+        {
+            const auto & req = requests[i];
+            fprintf(f, "%d,%.4f,%.4f,%.4f,%.4f,%d,%d,%d,%d,%.4f,%.3f,%.3f\n", i, req.arrival_s, req.queue_s, req.ttft_s, req.total_s, req.input_tokens, req.fastforward_tokens,
+                req.gen_tokens, req.context_shifts, req.sampler_s, percentile(req.token_gaps_s,50)*1000, percentile(req.token_gaps_s,99)*1000);
+        }
+        fclose(f);
+        printf("Per request results written to %s\n", bench_args.csv.c_str());
+    }
+    return 0;
+}
@@ -19,6 +19,7 @@
 #include <cstdint>
 #include "expose.h"
 #include "model_adapter.cpp"
+#include "utils.h"
 
 extern "C"
 {
@@ -237,6 +238,10 @@ extern "C"
     {
         return whispertype_generate(inputs);
     }
+    whisper_stream_outputs whisper_stream(const whisper_stream_inputs inputs)
+    {
+        return whispertype_stream(inputs);
+    }
 
     bool tts_load_model(const tts_load_model_inputs inputs)
     {
@@ -295,10 +300,23 @@ extern "C"
        return gpttype_get_pending_output().c_str();
     }
 
+    int get_extra_output_count() {
+        return gpttype_get_extra_output_count();
+    }
+    const char* get_extra_output(int idx, int * stopreason) {
+        return gpttype_get_extra_output(idx, stopreason).c_str();
+    }
+
     bool abort_generate() {
         return gpttype_generate_abort();
     }
 
+    static std::string metrics_text = "";
+    const char* get_metrics() {
+        metrics_text = kcpp_metrics_text();
+        return metrics_text.c_str();
+    }
+
     static std::vector<int> toks; //just share a static object for token counting
     token_count_outputs token_count(const char * input, bool addbos)
     {
@@ -28,92 +28,113 @@ struct logit_bias {
     int32_t token_id;
     float bias;
 };
+struct lora_selection {
+    int32_t adapter_id;
+    float scale;
+};
 struct load_model_inputs
 {
-    const int threads = 0;
-    const int blasthreads = 0;
-    const int max_context_length = 0;
-    const bool low_vram = 0;
-    const bool use_mmq = 0;
-    const bool use_rowsplit = 0;
+    int threads = 0;
+    int blasthreads = 0;
+    int max_context_length = 0;
+    bool low_vram = 0;
+    bool use_mmq = 0;
+    bool use_rowsplit = 0;
     const char * executable_path = nullptr;
     const char * model_filename = nullptr;
     const char * lora_filename = nullptr;
     const char * lora_base = nullptr;
+    int lora_adapters_len = 0;
+    const char ** lora_adapters = nullptr;
     const char * draftmodel_filename = nullptr;
-    const int draft_amount = 8;
-    const int draft_gpulayers = 999;
-    const float draft_gpusplit[tensor_split_max] = {};
+    int draft_amount = 8;
+    int draft_gpulayers = 999;
+    float draft_gpusplit[tensor_split_max] = {};
     const char * mmproj_filename = nullptr;
-    const int visionmaxres = 2048;
-    const bool use_mmap = false;
-    const bool use_mlock = false;
-    const bool use_smartcontext = false;
-    const bool use_contextshift = false;
-    const bool use_fastforward = false;
-    const int clblast_info = 0;
-    const int cublas_info = 0;
+    int visionmaxres = 2048;
+    bool use_mmap = false;
+    bool use_mlock = false;
+    bool use_smartcontext = false;
+    bool use_contextshift = false;
+    bool use_fastforward = false;
+    int sink_tokens = 0;
+    bool async_output = false;
+    bool paged_kv = false;
+    int clblast_info = 0;
+    int cublas_info = 0;
     const char * vulkan_info = nullptr;
-    const int blasbatchsize = 512;
-    const int forceversion = 0;
-    const int gpulayers = 0;
-    const float rope_freq_scale = 1.0f;
-    const float rope_freq_base = 10000.0f;
-    const int moe_experts = -1;
-    const bool flash_attention = false;
-    const float tensor_split[tensor_split_max] = {};
-    const int quant_k = 0;
-    const int quant_v = 0;
-    const bool quiet = false;
-    const int debugmode = 0;
+    int blasbatchsize = 512;
+    int forceversion = 0;
+    int gpulayers = 0;
+    float rope_freq_scale = 1.0f;
+    float rope_freq_base = 10000.0f;
+    int moe_experts = -1;
+    int model_pool_len = 0;
+    const char ** model_pool = nullptr;
+    int model_pool_budget_mb = 0;
+    int kv_tier_ram_mb = 0;
+    const char * kv_tier_dir = nullptr;
+    bool flash_attention = false;
+    float tensor_split[tensor_split_max] = {};
+    const char * rpc_servers = nullptr;
+    int quant_k = 0;
+    int quant_v = 0;
+    bool quiet = false;
+    int debugmode = 0;
 };
 struct generation_inputs
 {
-    const int seed = 0;
+    int seed = 0;
     const char * prompt = nullptr;
     const char * memory = nullptr;
     const char * images[images_max] = {};
-    const int max_context_length = 0;
-    const int max_length = 0;
-    const float temperature = 0.0f;
-    const int top_k = 0;
-    const float top_a = 0.0f;
-    const float top_p = 0.0f;
-    const float min_p = 0.0f;
-    const float typical_p = 0;
-    const float tfs = 0;
-    const float rep_pen = 0;
-    const int rep_pen_range = 0;
-    const float rep_pen_slope = 1.0f;
-    const float presence_penalty = 0.0f;
-    const int mirostat = 0;
-    const float mirostat_eta = 0.0f;
-    const float mirostat_tau = 0.0f;
-    const float xtc_threshold = 0.0f;
-    const float xtc_probability = 0.0f;
-    const samplers sampler_order[KCPP_SAMPLER_MAX] = {};
-    const int sampler_len = 0;
-    const bool allow_eos_token = false;
-    const bool bypass_eos_token = false;
-    const bool render_special = false;
-    const bool stream_sse = false;
+    int max_context_length = 0;
+    int max_length = 0;
+    float temperature = 0.0f;
+    int top_k = 0;
+    float top_a = 0.0f;
+    float top_p = 0.0f;
+    float min_p = 0.0f;
+    float typical_p = 0;
+    float tfs = 0;
+    float rep_pen = 0;
+    int rep_pen_range = 0;
+    float rep_pen_slope = 1.0f;
+    float presence_penalty = 0.0f;
+    int mirostat = 0;
+    float mirostat_eta = 0.0f;
+    float mirostat_tau = 0.0f;
+    float xtc_threshold = 0.0f;
+    float xtc_probability = 0.0f;
+    samplers sampler_order[KCPP_SAMPLER_MAX] = {};
+    int sampler_len = 0;
+    bool allow_eos_token = false;
+    bool bypass_eos_token = false;
+    bool render_special = false;
+    bool stream_sse = false;
     const char * grammar = nullptr;
-    const bool grammar_retain_state = false;
-    const float dynatemp_range = 0.0f;
-    const float dynatemp_exponent = 1.0f;
-    const float smoothing_factor = 0.0f;
-    const float dry_multiplier = 0.0f;
-    const float dry_base = 0.0f;
-    const int dry_allowed_length = 0;
-    const int dry_penalty_last_n = 0;
-    const int dry_sequence_breakers_len = 0;
+    bool grammar_retain_state = false;
+    float dynatemp_range = 0.0f;
+    float dynatemp_exponent = 1.0f;
+    float smoothing_factor = 0.0f;
+    float dry_multiplier = 0.0f;
+    float dry_base = 0.0f;
+    int dry_allowed_length = 0;
+    int dry_penalty_last_n = 0;
+    int dry_sequence_breakers_len = 0;
     const char ** dry_sequence_breakers = nullptr;
-    const int stop_sequence_len = 0;
+    int stop_sequence_len = 0;
     const char ** stop_sequence = nullptr;
-    const int logit_biases_len = 0;
+    int logit_biases_len = 0;
     const logit_bias * logit_biases = nullptr;
-    const int banned_tokens_len = 0;
+    int banned_tokens_len = 0;
     const char ** banned_tokens = nullptr;
+    const char * model_name = nullptr;
+    int lora_selections_len = 0;
+    const lora_selection * lora_selections = nullptr;
+    int num_outputs = 1;
+    const unsigned char * image_buffers[images_max] = {}; //raw image bytes, used instead of images[] when length is set
+    int image_buffer_lens[images_max] = {};
 };
 struct generation_outputs
 {
@@ -150,6 +171,7 @@ struct sd_load_model_inputs
     const char * vulkan_info = nullptr;
     const int threads = 0;
     const int quant = 0;
+    const char * quant_cache_dir = nullptr;
     const bool taesd = false;
     const bool notile = false;
     const char * t5xxl_filename = nullptr;
@@ -174,11 +196,15 @@ struct sd_generation_inputs
     const int seed = 0;
     const char * sample_method = nullptr;
     const int clip_skip = -1;
+    const float step_cache_threshold = 0.0f; //reuse model outputs while the input changes less than this, 0 = off
+    const int step_cache_max_skip = 0;
 };
 struct sd_generation_outputs
 {
     int status = -1;
     const char * data = "";
+    const unsigned char * raw_data = nullptr; //png bytes of data
+    int raw_data_len = 0;
 };
 
 struct whisper_load_model_inputs
@@ -197,12 +223,32 @@ struct whisper_generation_inputs
     const char * audio_data = nullptr;
     const bool suppress_non_speech = false;
     const char * langcode = nullptr;
+    const unsigned char * audio_buffer = nullptr; //raw wav bytes, used instead of audio_data when set
+    const int audio_buffer_len = 0;
 };
 struct whisper_generation_outputs
 {
     int status = -1;
     const char * text = "";
 };
+struct whisper_stream_inputs
+{
+    const char * session_id = nullptr;
+    const char * prompt = nullptr;
+    const char * pcm_data = nullptr; //16-bit signed mono pcm
+    const int pcm_bytes = 0;
+    const int sample_rate = 16000;
+    const bool suppress_non_speech = false;
+    const char * langcode = nullptr;
+    const bool reset_session = false;
+    const bool final_chunk = false;
+};
+struct whisper_stream_outputs
+{
+    int status = -1;
+    const char * committed = "";
+    const char * partial = "";
+};
 
 struct tts_load_model_inputs
 {
@@ -229,6 +275,8 @@ struct tts_generation_outputs
 {
     int status = -1;
     const char * data = "";
+    const unsigned char * raw_data = nullptr; //wav bytes of data
+    int raw_data_len = 0;
 };
 
 extern std::string executable_path;
@@ -241,6 +289,10 @@ extern bool generation_finished;
 extern float last_eval_time;
 extern float last_process_time;
 extern int last_token_count;
+extern int last_input_count;
+extern int last_fastforward_count;
+extern float last_sampler_time;
+extern int total_context_shifts;
 extern int last_seed;
 extern int total_gens;
 extern int total_img_gens;
@@ -10935,6 +10935,54 @@ static void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+// the kernel works on tiles of q rows that share the same K/V rows: the query heads of a GQA group, and several query
+// positions during prompt processing. every K/V row is loaded once per tile instead of once per q row
+#define GGML_FA_TILE_HEADS 16
+#define GGML_FA_TILE_ROWS  16
+
+// split-KV (flash decoding): when there are fewer tiles than threads (single token decode), the KV sequence of each
+// tile is also split into chunks that are processed by different threads, and the partial results are merged afterwards
+#define GGML_FA_SPLIT_MIN_KV 256
+
+struct ggml_fa_tiling {
+    int64_t n_group;  // q heads sharing the same K/V heads
+    int64_t n_head_t; // q heads per tile
+    int64_t n_pos_t;  // q positions per tile
+    int64_t n_tiles;
+    int64_t n_split;  // kv chunks per tile
+};
+
+static struct ggml_fa_tiling ggml_flash_attn_ext_tiling(
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        int nth) {
+    struct ggml_fa_tiling t;
+
+    const int64_t rk2 = q->ne[2]/k->ne[2];
+    const int64_t rv2 = q->ne[2]/v->ne[2];
+
+    t.n_group  = rk2 == rv2 ? rk2 : 1;
+    t.n_head_t = t.n_group;
+    if (t.n_head_t > GGML_FA_TILE_HEADS) {
+        const int64_t n = (t.n_group + GGML_FA_TILE_HEADS - 1)/GGML_FA_TILE_HEADS;
+        t.n_head_t = (t.n_group + n - 1)/n;
+    }
+    t.n_pos_t  = MAX(1, MIN(q->ne[1], GGML_FA_TILE_ROWS/t.n_head_t));
+    t.n_tiles  = ((q->ne[1] + t.n_pos_t - 1)/t.n_pos_t) * (q->ne[2]/t.n_group) * ((t.n_group + t.n_head_t - 1)/t.n_head_t) * q->ne[3];
+    t.n_split  = 1;
+    if (t.n_tiles < nth) {
+        t.n_split = MAX(1, MIN((nth + t.n_tiles - 1)/t.n_tiles, k->ne[1]/GGML_FA_SPLIT_MIN_KV));
+    }
+
+    return t;
+}
+
+// per thread scratch: V row + (VKQ accumulator, converted Q, max, sum) for every row of a tile
+static size_t ggml_flash_attn_ext_scratch(int64_t D, const struct ggml_fa_tiling * t) {
+    return D + t->n_head_t*t->n_pos_t*(2*D + 2);
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -10986,17 +11034,36 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by tiles of q rows, and by chunks of the kv sequence if there are not enough tiles
 
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const struct ggml_fa_tiling tiling = ggml_flash_attn_ext_tiling(q, k, v, nth);
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    const int64_t n_group  = tiling.n_group;
+    const int64_t n_head_t = tiling.n_head_t;
+    const int64_t n_pos_t  = tiling.n_pos_t;
+    const int64_t n_split  = tiling.n_split;
+
+    const int64_t n_pos_tiles  = (N + n_pos_t - 1)/n_pos_t;
+    const int64_t n_head_tiles = (n_group + n_head_t - 1)/n_head_t;
+    const int64_t n_groups     = neq2/n_group;
+
+    const int64_t n_kv_chunk = (nek1 + n_split - 1)/n_split;
+
+    // (tile, kv chunk) pairs per thread
+    const int ni = tiling.n_tiles*n_split;
+    const int di = (ni + nth - 1)/nth;
+
+    // pair range for this thread
+    const int ii0 = di*ith;
+    const int ii1 = MIN(ii0 + di, ni);
+
+    const size_t scratch = ggml_flash_attn_ext_scratch(D, &tiling) + CACHE_LINE_SIZE_F32;
+
+    // partial results of the kv chunks: max, sum, unnormalized VKQ
+    float * partials = (float *) params->wdata + nth*scratch;
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -11024,126 +11091,235 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(q_to_vec_dot && "fattn: unsupported K-type");
     GGML_ASSERT(v_to_float   && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    float * V32  = (float *) params->wdata + ith*scratch; // (temporary) FP32 V buffer
+    float * rows = V32 + D;                                // per row: VKQ accumulator (FP32 or FP16), Q, M, S
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    float slopes[GGML_FA_TILE_HEADS];
+    float mvs[GGML_FA_TILE_ROWS];
+    const ggml_fp16_t * mps[GGML_FA_TILE_ROWS];
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    // loop over tiles of n_batch and n_head
+    for (int ii = ii0; ii < ii1; ++ii) {
+        const int64_t it = ii/n_split;
+        const int64_t ic0 = (ii%n_split)*n_kv_chunk;
+        const int64_t ic1 = MIN(ic0 + n_kv_chunk, nek1);
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
+        // tile indices
+        const int64_t ipt = it%n_pos_tiles;
+        const int64_t iht = (it/n_pos_tiles)%n_head_tiles;
+        const int64_t ig  = (it/(n_pos_tiles*n_head_tiles))%n_groups;
+        const int64_t iq3 = it/(n_pos_tiles*n_head_tiles*n_groups);
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, D*sizeof(float));
-        }
+        // q heads [h0, h1) and positions [p0, p1) of this tile
+        const int64_t h0 = ig*n_group + iht*n_head_t;
+        const int64_t h1 = MIN(h0 + n_head_t, (ig + 1)*n_group);
+        const int64_t p0 = ipt*n_pos_t;
+        const int64_t p1 = MIN(p0 + n_pos_t, N);
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+        const int64_t nh = h1 - h0;
+        const int64_t np = p1 - p0;
 
         // k indices
         const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+        const int ik2 = h0 / rk2;
 
         // v indices
         const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+        const int iv2 = h0 / rv2;
+
+        for (int64_t h = h0; h < h1; ++h) {
+            slopes[h - h0] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+        }
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
+        for (int64_t p = p0; p < p1; ++p) {
+            mps[p - p0] = mask ? (ggml_fp16_t *)((char *) mask->data + p*mask->nb[1]) : NULL;
+
+            for (int64_t h = h0; h < h1; ++h) {
+                float * row = rows + ((p - p0)*nh + (h - h0))*(2*D + 2);
+
+                if (v->type == GGML_TYPE_F16) {
+                    memset(row, 0, D*sizeof(ggml_fp16_t));
+                } else {
+                    memset(row, 0, D*sizeof(float));
+                }
+                row[2*D + 0] = -INFINITY; // maximum KQ value
+                row[2*D + 1] = 0.0f;      // sum
+
+                const float * pq = (const float *) ((char *) q->data + (p*nbq1 + h*nbq2 + iq3*nbq3));
+                q_to_vec_dot(pq, row + D, D);
+            }
+        }
 
         // online softmax / attention
         // loop over n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
+        for (int64_t ic = ic0; ic < ic1; ++ic) {
+            // skip the kv cell if it is masked for every position of the tile
+            bool any = false;
+            for (int64_t ip = 0; ip < np; ++ip) {
+                mvs[ip] = mps[ip] ? GGML_FP16_TO_FP32(mps[ip][ic]) : 0.0f;
+                any = any || mvs[ip] != -INFINITY;
+            }
+            if (!any) {
                 continue;
             }
 
-            float s; // KQ value
-
             const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
-
-            s = s*scale; // scale KQ value
+            const char * v_data = (const char *) v->data + ( ic*nbv1 + iv2*nbv2 + iv3*nbv3);
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
+            if (v->type != GGML_TYPE_F16) {
+                v_to_float(v_data, V32, D);
             }
 
-            s += mv; // apply mask
+            for (int64_t ip = 0; ip < np; ++ip) {
+                if (mvs[ip] == -INFINITY) {
+                    continue;
+                }
 
-            const float Mold = M;
+                for (int64_t ih = 0; ih < nh; ++ih) {
+                    float * row = rows + (ip*nh + ih)*(2*D + 2);
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                    float s; // KQ value
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                    kq_vec_dot(D, &s, 0, k_data, 0, row + D, 0, 1);
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                    s = s*scale; // scale KQ value
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
+
+                    s += slopes[ih]*mvs[ip]; // apply mask
+
+                    const float Mold = row[2*D + 0];
+                    float M = Mold;
+
+                    float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+                    float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+
+                    if (v->type == GGML_TYPE_F16) {
+                        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) row;
+
+                        if (s > M) {
+                            // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                            M = s;
+                            ms = expf(Mold - M);
+
+                            // V = V*expf(Mold - M)
+                            ggml_vec_scale_f16(D, VKQ16, ms);
+                        } else {
+                            // no new maximum, ms == 1.0f, vs != 1.0f
+                            vs = expf(s - M);
+                        }
+
+                        // V += v*expf(s - M)
+                        ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
+                    } else {
+                        if (s > M) {
+                            // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                            M = s;
+                            ms = expf(Mold - M);
+
+                            // V = V*expf(Mold - M)
+                            ggml_vec_scale_f32(D, row, ms);
+                        } else {
+                            // no new maximum, ms == 1.0f, vs != 1.0f
+                            vs = expf(s - M);
+                        }
+
+                        // V += v*expf(s - M)
+                        ggml_vec_mad_f32(D, row, V32, vs);
+                    }
+
+                    row[2*D + 0] = M;
+                    row[2*D + 1] = row[2*D + 1]*ms + vs; // scale and increment sum with partial sum
                 }
+            }
+        }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+        for (int64_t ip = 0; ip < np; ++ip) {
+            for (int64_t ih = 0; ih < nh; ++ih) {
+                float * row = rows + (ip*nh + ih)*(2*D + 2);
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                const float M = row[2*D + 0];
+                const float S = row[2*D + 1];
+
+                float * VKQ32 = row;
+                if (v->type == GGML_TYPE_F16) {
+                    const ggml_fp16_t * VKQ16 = (const ggml_fp16_t *) row;
+                    for (int64_t d = 0; d < D; ++d) {
+                        V32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+                    }
+                    VKQ32 = V32;
                 }
 
-                v_to_float(v_data, V32, D);
+                // dst indices
+                const int i1 = p0 + ip;
+                const int i2 = h0 + ih;
+                const int i3 = iq3;
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                if (n_split > 1) {
+                    // merged with the other chunks of this row below
+                    const int ir = (i3*neq2 + i2)*neq1 + i1;
+                    float * part = partials + (ir*n_split + ii%n_split)*(D + 2);
+                    part[0] = M;
+                    part[1] = S;
+                    memcpy(part + 2, VKQ32, D*sizeof(float));
+                    continue;
+                }
+
+                // V /= S
+                const float S_inv = 1.0f/S;
+                ggml_vec_scale_f32(D, VKQ32, S_inv);
+
+                // original
+                //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+                // permute(0, 2, 1, 3)
+                memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
             }
+        }
+    }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+    if (n_split == 1) {
+        return;
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // merge the kv chunks of each row, rescaling them to the common maximum
+    const int dr = (nr + nth - 1)/nth;
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    float * VKQ32 = V32;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * part = partials + ir*n_split*(D + 2);
+
+        float M = -INFINITY;
+        for (int64_t j = 0; j < n_split; ++j) {
+            M = MAX(M, part[j*(D + 2)]);
         }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < D; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+        float S = 0.0f;
+        memset(VKQ32, 0, D*sizeof(float));
+        for (int64_t j = 0; j < n_split; ++j) {
+            const float * pj = part + j*(D + 2);
+            if (pj[0] == -INFINITY) {
+                continue; // fully masked chunk
             }
+            const float ms = expf(pj[0] - M);
+            S += pj[1]*ms;
+            ggml_vec_mad_f32(D, VKQ32, pj + 2, ms);
         }
 
         // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(D, VKQ32, S_inv);
+        ggml_vec_scale_f32(D, VKQ32, 1.0f/S);
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
-
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+        const int i3 = ir/(neq2*neq1);
+        const int i2 = (ir - i3*neq2*neq1)/neq1;
+        const int i1 = (ir - i3*neq2*neq1 - i2*neq1);
 
         // permute(0, 2, 1, 3)
         memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
@@ -13921,7 +14097,14 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         const int64_t ne00 = node->src[0]->ne[0]; // D
 
-                        cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+                        const struct ggml_fa_tiling tiling = ggml_flash_attn_ext_tiling(node->src[0], node->src[1], node->src[2], n_tasks);
+
+                        cur = sizeof(float)*ggml_flash_attn_ext_scratch(ne00, &tiling)*n_tasks; // tile accumulators/thread
+
+                        // partial results of the split-KV chunks
+                        if (tiling.n_split > 1) {
+                            cur += sizeof(float)*(ne00 + 2)*ggml_nrows(node->src[0])*tiling.n_split;
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2,7 +2,11 @@
 #include "ggml-impl.h"
 #include "ggml-backend-impl.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <memory>
@@ -34,9 +38,15 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+namespace fs = std::filesystem;
+
+// tensor uploads at least this large are sent by content hash first, so a server with a cache can skip the transfer
+static const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+    bool tensor_cache = false; // the server announced a tensor cache in its hello
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -86,6 +96,8 @@ enum rpc_cmd {
     RPC_CMD_GET_DEVICE_MEMORY,
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
+    RPC_CMD_SET_TENSOR_HASH,
+    RPC_CMD_HELLO,
     RPC_CMD_COUNT,
 };
 
@@ -135,6 +147,27 @@ struct rpc_msg_buffer_clear_req {
     uint8_t value;
 };
 
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
+// flags reported in rpc_msg_hello_rsp
+#define RPC_HELLO_FLAG_TENSOR_CACHE 1
+
+struct rpc_msg_hello_rsp {
+    uint8_t major;
+    uint8_t minor;
+    uint8_t patch;
+    uint8_t flags;
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -187,6 +220,17 @@ struct ggml_backend_rpc_buffer_context {
 
 // RPC helper functions
 
+// FNV-1a, only used to name cached tensor data
+static uint64_t fnv_hash(const uint8_t * data, size_t len) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
 #ifdef _WIN32
     if (fd == INVALID_SOCKET) {
@@ -379,6 +423,7 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
     static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
+    static std::unordered_set<std::string> legacy_endpoints;
     static bool initialized = false;
 
     auto it = sockets.find(endpoint);
@@ -409,6 +454,26 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
         return nullptr;
     }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
+    rpc_msg_hello_rsp hello;
+    if (legacy_endpoints.count(endpoint)) {
+        // already known to lack the handshake
+    } else if (send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &hello, sizeof(hello))) {
+        if (hello.major != RPC_PROTO_MAJOR_VERSION) {
+            fprintf(stderr, "RPC server %s uses protocol version %d.%d.%d, expected %d.x.x\n", endpoint.c_str(),
+                    hello.major, hello.minor, hello.patch, RPC_PROTO_MAJOR_VERSION);
+            return nullptr;
+        }
+        sock->tensor_cache = (hello.flags & RPC_HELLO_FLAG_TENSOR_CACHE) != 0;
+    } else {
+        // servers without the handshake drop the connection on the unknown command,
+        // reconnect and talk to them with the base protocol only
+        GGML_PRINT_DEBUG("[%s] %s does not support hello, using the legacy protocol\n", __func__, endpoint.c_str());
+        legacy_endpoints.insert(endpoint);
+        sock = socket_connect(host.c_str(), port);
+        if (sock == nullptr) {
+            return nullptr;
+        }
+    }
     sockets[endpoint] = sock;
     return sock;
 }
@@ -482,10 +547,24 @@ static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t buffer, gg
 
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    if (ctx->sock->tensor_cache && size >= HASH_THRESHOLD) {
+        // try the server's cache first, the full upload is only needed on a miss
+        rpc_msg_set_tensor_hash_req request;
+        request.tensor = rpc_tensor;
+        request.offset = offset;
+        request.size = size;
+        request.hash = fnv_hash((const uint8_t *)data, size);
+        rpc_msg_set_tensor_hash_rsp response;
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_HASH, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.result) {
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
-    rpc_tensor rpc_tensor = serialize_tensor(tensor);
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
@@ -771,7 +850,8 @@ void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, si
 
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(ggml_backend_t backend, const char * cache_dir, size_t cache_max_size)
+        : backend(backend), cache_dir(cache_dir), cache_max_size(cache_max_size) {}
     ~rpc_server();
 
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
@@ -781,6 +861,7 @@ public:
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
@@ -793,9 +874,14 @@ private:
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
+    bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
+    void put_cached_file(uint64_t hash, const void * data, size_t size);
+    bool trim_cache(size_t incoming);
 
 
     ggml_backend_t backend;
+    const char * cache_dir;
+    size_t cache_max_size;
     std::unordered_set<ggml_backend_buffer_t> buffers;
 };
 
@@ -959,11 +1045,140 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     }
 
     const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    if (cache_dir && size >= HASH_THRESHOLD) {
+        put_cached_file(fnv_hash((const uint8_t *)data, size), data, size);
+    }
     ggml_backend_tensor_set(tensor, data, offset, size);
     ggml_free(ctx);
     return true;
 }
 
+static fs::path cached_file_path(const char * cache_dir, uint64_t hash) {
+    char hash_str[17];
+    snprintf(hash_str, sizeof(hash_str), "%016" PRIx64, hash);
+    return fs::path(cache_dir) / hash_str;
+}
+
+bool rpc_server::get_cached_file(uint64_t hash, std::vector<uint8_t> & data) {
+    if (!cache_dir) {
+        return false;
+    }
+    fs::path cache_file = cached_file_path(cache_dir, hash);
+    std::ifstream ifs(cache_file, std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        return false;
+    }
+    size_t size = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+    data.resize(size);
+    if (!ifs.read((char *)data.data(), size) || fnv_hash(data.data(), size) != hash) {
+        // damaged entry, drop it so the next upload replaces it
+        ifs.close();
+        std::error_code ec;
+        fs::remove(cache_file, ec);
+        return false;
+    }
+    // hits count as use for the eviction order
+    std::error_code ec;
+    fs::last_write_time(cache_file, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+// evict the least recently used entries until an incoming entry of the given size fits
+bool rpc_server::trim_cache(size_t incoming) {
+    if (cache_max_size == 0) {
+        return true;
+    }
+    if (incoming > cache_max_size) {
+        return false;
+    }
+    std::error_code ec;
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    size_t total = 0;
+    for (const auto & entry : fs::directory_iterator(cache_dir, ec)) {
+        if (!entry.is_regular_file(ec) || entry.path().extension() == ".tmp") {
+            continue;
+        }
+        total += entry.file_size(ec);
+        entries.emplace_back(entry.last_write_time(ec), entry.path());
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto & entry : entries) {
+        if (total + incoming <= cache_max_size) {
+            break;
+        }
+        size_t size = fs::file_size(entry.second, ec);
+        if (fs::remove(entry.second, ec)) {
+            total -= std::min(total, size);
+        }
+    }
+    return total + incoming <= cache_max_size;
+}
+
+void rpc_server::put_cached_file(uint64_t hash, const void * data, size_t size) {
+    std::error_code ec;
+    fs::path cache_file = cached_file_path(cache_dir, hash);
+    if (fs::exists(cache_file, ec)) {
+        return;
+    }
+    if (!trim_cache(size)) {
+        return;
+    }
+    // write under a temporary name so an interrupted upload never leaves a truncated entry
+    fs::path tmp_file = cache_file;
+    tmp_file += ".tmp";
+    {
+        std::ofstream ofs(tmp_file, std::ios::binary);
+        if (!ofs || !ofs.write((const char *)data, size)) {
+            fprintf(stderr, "[%s] failed to write '%s'\n", __func__, tmp_file.string().c_str());
+            fs::remove(tmp_file, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_file, cache_file, ec);
+    if (ec) {
+        fs::remove(tmp_file, ec);
+    }
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    response.result = 0;
+    std::vector<uint8_t> cached_file;
+    if (!get_cached_file(request.hash, cached_file) || cached_file.size() != request.size) {
+        return true;
+    }
+    const size_t size = cached_file.size();
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu, hash: %" PRIx64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, size, request.hash);
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 || request.tensor.data + request.offset >= p1 || size > (p1 - request.tensor.data - request.offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    ggml_backend_tensor_set(tensor, cached_file.data(), request.offset, size);
+    response.result = 1;
+    ggml_free(ctx);
+    return true;
+}
+
 bool rpc_server::init_tensor(const rpc_msg_init_tensor_req & request) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -1147,8 +1362,8 @@ rpc_server::~rpc_server() {
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir, size_t cache_max_size, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir, cache_max_size);
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1259,6 +1474,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_SET_TENSOR_HASH: {
+                rpc_msg_set_tensor_hash_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_hash_rsp response;
+                if (!server.set_tensor_hash(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_INIT_TENSOR: {
                 rpc_msg_init_tensor_req request;
                 if (!recv_msg(sockfd, &request,sizeof(request))) {
@@ -1326,6 +1555,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_HELLO: {
+                if (!recv_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                rpc_msg_hello_rsp response;
+                response.major = RPC_PROTO_MAJOR_VERSION;
+                response.minor = RPC_PROTO_MINOR_VERSION;
+                response.patch = RPC_PROTO_PATCH_VERSION;
+                response.flags = cache_dir ? RPC_HELLO_FLAG_TENSOR_CACHE : 0;
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             default: {
                 fprintf(stderr, "Unknown command: %d\n", cmd);
                 return;
@@ -1334,7 +1577,7 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t cache_max_size, size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1363,7 +1606,7 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        rpc_serve_client(backend, cache_dir, cache_max_size, client_socket->fd, free_mem, total_mem);
         printf("Client connection closed\n");
         fflush(stdout);
     }
@@ -10,6 +10,9 @@
 #include <cmath>
 #include <time.h>
 #include <mutex>
+#include <future>
+#include <thread>
+#include <condition_variable>
 #include <unordered_map>
 #include "model_adapter.h"
 #include "otherarch.h"
@@ -18,6 +21,7 @@
 #include <map>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <cctype>
 #include <locale>
 
@@ -59,6 +63,10 @@ bool generation_finished;
 float last_process_time = 0;
 float last_eval_time = 0;
 int last_token_count = 0;
+int last_input_count = 0; //prompt tokens of the last generation
+int last_fastforward_count = 0; //prompt tokens of the last generation that were reused from the previous context
+float last_sampler_time = 0; //seconds spent sampling during the last generation
+int total_context_shifts = 0;
 int last_seed = -1;
 int total_gens = 0;
 stop_reason last_stop_reason = stop_reason::INVALID;
@@ -95,6 +103,9 @@ static llama_v2_context * llama_ctx_v2 = nullptr;
 static llama_v3_context * llama_ctx_v3 = nullptr;
 static llama_context * llama_ctx_v4 = nullptr;
 static llama_context * draft_ctx = nullptr; //will remain null if speculative is unused
+static llama_adapter_lora * base_lora_adapter = nullptr; //from --lora, always applied
+static std::vector<llama_adapter_lora *> runtime_lora_adapters; //preloaded, enabled per request
+static std::vector<lora_selection> active_lora_selection;
 
 static clip_ctx * clp_ctx = nullptr; //for llava
 static clip_image_u8 * clp_img_data = nullptr; //most recent image
@@ -103,6 +114,7 @@ static std::vector<int> last_llava_mem; //for storing dummy tokens that will be
 static std::string llava_composite_image_signature = ""; //for identifying when the llava images change, we need to invalidate the cache
 static int current_llava_identifier = LLAVA_TOKEN_IDENTIFIER_A;
 static int vision_max_res = 2048;
+static std::future<void> llava_encode_job; //images being encoded while the prompt is tokenized
 
 static kcpp_params * kcpp_data = nullptr;
 static int max_context_limit_at_load = 0;
@@ -131,10 +143,47 @@ static std::string concat_output_reader_copy_poll = ""; //for streaming
 static std::string concat_output_reader_copy_res = ""; //for gen response
 static std::vector<logit_bias> logit_biases;
 
+//every ban and bias that stays fixed for a request, merged per token id so SampleLogits applies them in one sparse pass
+struct kcpp_logit_mask_entry
+{
+    int token_id = 0;
+    bool ban = false;
+    float bias = 0;
+};
+static std::vector<kcpp_logit_mask_entry> logit_mask;
+
 static int delayed_generated_tokens_limit = 0;
 std::deque<std::string> delayed_generated_tokens; //for use with antislop sampling
 static std::map<int,std::vector<int>> antislop_banned_token_ids; //first is the npast position, second is the array of banned ids at that index
 
+static kcpp_phrase_matcher stop_sequence_matcher;
+static int stop_sequence_state = 0; //after all of concat_output
+static int stop_sequence_hit = -1; //lowest index of a stop sequence found in concat_output
+static kcpp_phrase_matcher banned_phrase_matcher; //case folded
+static int banned_phrase_state = 0; //after all of delayed_generated_tokens
+
+//for num_outputs > 1, extra continuations forked from the shared prompt onto their own kv sequences
+const int num_outputs_max = 16;
+struct kcpp_extra_stream
+{
+    llama_seq_id seq_id = 0;
+    std::mt19937 rng;
+    std::vector<gpt_vocab::id> last_n_tokens;
+    std::vector<gpt_vocab::id> context_tokens; //prompt plus this output, for dry
+    llama_grammar * grammar = nullptr;
+    std::string text = "";
+    int stop_state = 0; //stop_sequence_matcher state after text
+    int next_token = -1; //sampled, waiting to be decoded
+    int n_past = 0;
+    int remaining = 0;
+    int batch_idx = -1; //output row in the last shared batch
+    bool finished = false;
+    stop_reason reason = stop_reason::OUT_OF_TOKENS;
+};
+static std::vector<kcpp_extra_stream> extra_streams;
+static std::vector<std::string> extra_outputs;
+static std::vector<int> extra_output_stopreasons;
+
 inline int kcpp_cpu_has_blas(void) {
 #if defined(GGML_USE_BLAS) || defined(GGML_USE_CUDA) || defined(GGML_USE_VULKAN) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_SYCL)
     return 1;
@@ -192,6 +241,126 @@ static std::string FileFormatTokenizeID(int id, FileFormat file_format, bool ret
     }
 }
 
+//appends a sampled token to the output text, flushing whatever antislop no longer needs to hold back
+static void OutputGeneratedToken(int id, bool hide, bool render_special)
+{
+    std::string tokenizedstr = (hide ? "" : FileFormatTokenizeID(id, file_format, render_special));
+    delayed_generated_tokens.push_back(tokenizedstr);
+    while(delayed_generated_tokens.size() > delayed_generated_tokens_limit && delayed_generated_tokens.size() > 0)
+    {
+        generated_tokens.push_back(delayed_generated_tokens[0]);
+        concat_output_mtx.lock();
+        concat_output += delayed_generated_tokens[0];
+        concat_output_mtx.unlock();
+        if(stop_sequence_hit < 0)
+        {
+            stop_sequence_state = stop_sequence_matcher.scan(stop_sequence_state, delayed_generated_tokens[0], [](int p, size_t){
+                stop_sequence_hit = (stop_sequence_hit < 0 || p < stop_sequence_hit ? p : stop_sequence_hit);
+            });
+        }
+        delayed_generated_tokens.pop_front();
+    }
+}
+
+static bool CheckStopSequences(bool allow_regular_prints)
+{
+    if(stop_sequence_hit < 0)
+    {
+        return false;
+    }
+    if(allow_regular_prints)
+    {
+        auto match_clean = stop_sequence[stop_sequence_hit];
+        replace_all(match_clean, "\n", "\\n");
+        printf("\n(Stop sequence triggered: %s)", match_clean.c_str());
+    }
+    return true;
+}
+
+//async output: the text side of each sampled token (detokenizing, streaming, stop sequences) runs on a worker while
+//the next token is decoded. only one token is ever in flight, the sampler waits for it before sampling the next one
+struct kcpp_output_job
+{
+    int id = 0;
+    bool hide = false;
+    bool render_special = false;
+    bool print_progress = false;
+    int generated = 0;
+    int n_predict = 0;
+};
+static bool async_output = false;
+static std::thread output_worker;
+static std::mutex output_worker_mtx;
+static std::condition_variable output_worker_cv;
+static kcpp_output_job output_job;
+static bool output_job_pending = false;
+static bool output_worker_quit = false;
+static bool output_stop_hit = false;
+
+static void output_worker_loop()
+{
+    std::unique_lock<std::mutex> lock(output_worker_mtx);
+    while(true)
+    {
+        output_worker_cv.wait(lock, []{ return output_job_pending || output_worker_quit; });
+        if(!output_job_pending)
+        {
+            return;
+        }
+        const kcpp_output_job job = output_job;
+        lock.unlock();
+        OutputGeneratedToken(job.id, job.hide, job.render_special);
+        if(job.print_progress)
+        {
+            printf("\rGenerating (%d / %d tokens)", job.generated, job.n_predict);
+        }
+        const bool stop = CheckStopSequences(job.print_progress);
+        lock.lock();
+        output_stop_hit = (output_stop_hit || stop);
+        output_job_pending = false;
+        output_worker_cv.notify_all();
+    }
+}
+
+static void output_worker_start()
+{
+    output_job_pending = false;
+    output_worker_quit = false;
+    output_stop_hit = false;
+    output_worker = std::thread(output_worker_loop);
+}
+
+static void output_worker_submit(const kcpp_output_job & job)
+{
+    std::unique_lock<std::mutex> lock(output_worker_mtx);
+    output_worker_cv.wait(lock, []{ return !output_job_pending; });
+    output_job = job;
+    output_job_pending = true;
+    output_worker_cv.notify_all();
+}
+
+//waits for the token in flight, returns true once any submitted token has completed a stop sequence
+static bool output_worker_wait()
+{
+    std::unique_lock<std::mutex> lock(output_worker_mtx);
+    output_worker_cv.wait(lock, []{ return !output_job_pending; });
+    return output_stop_hit;
+}
+
+static void output_worker_stop()
+{
+    if(!output_worker.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(output_worker_mtx);
+        output_worker_quit = true;
+    }
+    output_worker_cv.notify_all();
+    output_worker.join();
+}
+
 static void TokenizeString(const std::string & str_to_tokenize, std::vector<int> & output_tokens, FileFormat file_format, bool add_bos=true)
 {
     if (file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2  || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_GENERIC)
@@ -238,6 +407,116 @@ static void TokenizeString(const std::string & str_to_tokenize, std::vector<int>
         output_tokens = ::gpt_tokenize(vocab, str_to_tokenize);
     }
 }
+
+//incremental tokenization of resent prompts, for BPE gguf vocabs only.
+//the text is tokenized in chunks that end at split points (a newline followed by an alphanumeric char),
+//so a prompt that only changed near its end reuses the tokens of every unchanged chunk before the edit
+struct kcpp_token_cache_chunk
+{
+    size_t text_end = 0;
+    size_t token_end = 0;
+};
+struct kcpp_token_cache
+{
+    const llama_vocab * owner = nullptr;
+    std::string text;
+    std::vector<int> tokens; //raw tokens without bos/eos
+    std::vector<kcpp_token_cache_chunk> chunks;
+};
+static kcpp_token_cache prompt_token_cache;
+static kcpp_token_cache memory_token_cache;
+const size_t token_cache_chunk_chars = 4096;
+
+//splitting after a newline only gives the same tokens if the pre-tokenizer always ends a piece there.
+//llama3 style regexes do (\s*[\r\n]+ takes the whole newline run), as do those that isolate every newline.
+//gpt2 style \s+(?!\S) does not: "\n\nA" becomes "\n","\n","A" but a chunk ending in "\n\n" keeps them together
+static bool TokenCacheSplitSafe(const llama_vocab * vocab)
+{
+    switch(vocab->get_pre_type())
+    {
+        case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
+        case LLAMA_VOCAB_PRE_TYPE_DBRX:
+        case LLAMA_VOCAB_PRE_TYPE_SMAUG:
+        case LLAMA_VOCAB_PRE_TYPE_QWEN2:
+        case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
+        case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
+        case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static size_t FindTokenCacheSplit(const std::string & str, size_t from)
+{
+    for(size_t i=std::max(from,(size_t)1);i<str.size();++i)
+    {
+        unsigned char c = str[i];
+        if(str[i-1]=='\n' && c<128 && isalnum(c))
+        {
+            return i;
+        }
+    }
+    return str.size();
+}
+
+static void TokenizeStringCached(kcpp_token_cache & cache, const std::string & str_to_tokenize, std::vector<int> & output_tokens, FileFormat file_format, bool add_bos=true)
+{
+    const llama_vocab * tmpvocab = (file_format == FileFormat::GGUF_GENERIC && llama_ctx_v4)?llama_model_get_vocab(&(llama_ctx_v4->model)):nullptr;
+    if(tmpvocab==nullptr || llama_vocab_type(tmpvocab)!=LLAMA_VOCAB_TYPE_BPE || !TokenCacheSplitSafe(tmpvocab) || str_to_tokenize.size() < token_cache_chunk_chars)
+    {
+        TokenizeString(str_to_tokenize, output_tokens, file_format, add_bos);
+        return;
+    }
+    if(cache.owner!=tmpvocab)
+    {
+        cache = kcpp_token_cache();
+        cache.owner = tmpvocab;
+    }
+
+    //keep only chunks that end before the first changed char, so the char after each split is unchanged too
+    size_t common = std::mismatch(cache.text.begin(), cache.text.begin() + std::min(cache.text.size(), str_to_tokenize.size()), str_to_tokenize.begin()).first - cache.text.begin();
+    size_t keep = 0;
+    while(keep < cache.chunks.size() && cache.chunks[keep].text_end < common)
+    {
+        ++keep;
+    }
+    cache.chunks.resize(keep);
+    cache.tokens.resize(keep>0?cache.chunks.back().token_end:0);
+    size_t reused = cache.tokens.size();
+
+    size_t pos = (keep>0?cache.chunks.back().text_end:0);
+    while(pos < str_to_tokenize.size())
+    {
+        size_t end = FindTokenCacheSplit(str_to_tokenize, pos + token_cache_chunk_chars);
+        std::vector<int> part = ::common_tokenize(tmpvocab, str_to_tokenize.substr(pos, end - pos), false, true);
+        cache.tokens.insert(cache.tokens.end(), part.begin(), part.end());
+        cache.chunks.push_back({end, cache.tokens.size()});
+        pos = end;
+    }
+    cache.text = str_to_tokenize;
+
+    //apply the same special tokens a full tokenization would add
+    output_tokens.clear();
+    output_tokens.reserve(cache.tokens.size() + 2);
+    llama_token bostoadd = llama_vocab_bos(tmpvocab);
+    if(add_bos && bostoadd != LLAMA_TOKEN_NULL && (llama_vocab_get_add_bos(tmpvocab) || cache.tokens.size()==0 || cache.tokens[0]!=bostoadd))
+    {
+        output_tokens.push_back(bostoadd);
+    }
+    output_tokens.insert(output_tokens.end(), cache.tokens.begin(), cache.tokens.end());
+    if(add_bos && llama_vocab_get_add_eos(tmpvocab) && llama_vocab_eos(tmpvocab) != LLAMA_TOKEN_NULL)
+    {
+        output_tokens.push_back(llama_vocab_eos(tmpvocab));
+    }
+    if(debugmode==1)
+    {
+        printf("\n[Tokenizer cache: reused %zu of %zu tokens]",reused,cache.tokens.size());
+    }
+}
 static int GetEosID(FileFormat file_format, int32_t n_vocab)
 {
     unsigned int eosID = 0;
@@ -304,21 +583,9 @@ static int GetEotID(FileFormat file_format)
     return -1;
 }
 
-static float LowestLogit(const std::vector<float> & logits)
+static float LowestLogit(float min_logit)
 {
-    int topid = std::min_element(logits.begin(), logits.end()) - logits.begin();
-    float v = logits[topid];
-    return (v < 0 ? (v-8) : 0);
-}
-static float LowestLogit(const float *logits, size_t size)
-{
-    if (size == 0) {
-        // Handle the case of an empty array
-        return 0.0;
-    }
-    int topid = std::min_element(logits, logits + size) - logits;
-    float v = logits[topid];
-    return (v < 0 ? (v-8) : 0);
+    return (min_logit < 0 ? (min_logit-8) : 0);
 }
 
 static std::string RemoveBell(const std::string & input) //removes the bell character
@@ -543,6 +810,21 @@ const char * kcpp_print_system_info(void) {
 }
 
 //loads a model for speculative decoding.
+//main_gpu indexes the model's device list, where rpc servers come ahead of the local gpus
+static int rpc_device_count(const ggml_backend_dev_t * devices)
+{
+    int count = 0;
+    ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+    for(auto dev = devices; rpc_reg && dev && *dev; ++dev)
+    {
+        if(ggml_backend_dev_backend_reg(*dev)==rpc_reg)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
 static void speculative_decoding_setup(std::string spec_model_filename, const llama_model_params & base_model_params, const llama_context_params & base_ctx_params, int base_n_vocab, const float * draft_gpusplit, int draft_gpulayers)
 {
     llama_model_params draft_model_params = llama_model_default_params();
@@ -554,7 +836,8 @@ static void speculative_decoding_setup(std::string spec_model_filename, const ll
     draft_ctx_params.n_ctx = base_ctx_params.n_ctx;
     draft_ctx_params.logits_all = false;
     draft_ctx_params.offload_kqv = base_ctx_params.offload_kqv;
-    draft_model_params.main_gpu = base_model_params.main_gpu;
+    //the draft only uses the local devices, so it drops the rpc offset of the base model
+    draft_model_params.main_gpu = std::max(0, base_model_params.main_gpu - rpc_device_count(base_model_params.devices));
     draft_model_params.split_mode = llama_split_mode::LLAMA_SPLIT_MODE_LAYER;
     #if defined(GGML_USE_CUDA) || defined(GGML_USE_VULKAN)
     bool ts_all_zero = true;
@@ -1561,34 +1844,72 @@ void sample_grammar(FileFormat file_format, int32_t n_vocab, llama_token_data_ar
 
 }
 
+//time spent in each sampling stage during the current generation, flushed to the metrics when it ends.
+//the first stages share their index with the samplers enum
+enum sample_stage
+{
+    SAMPLE_STAGE_CANDIDATES = KCPP_SAMPLER_MAX,
+    SAMPLE_STAGE_GRAMMAR,
+    SAMPLE_STAGE_GRAMMAR_ACCEPT,
+    SAMPLE_STAGE_DRY,
+    SAMPLE_STAGE_PREFILTER,
+    SAMPLE_STAGE_MIROSTAT,
+    SAMPLE_STAGE_XTC,
+    SAMPLE_STAGE_PICK,
+    SAMPLE_STAGE_COUNT
+};
+static const char * sample_stage_names[SAMPLE_STAGE_COUNT] = {"top_k","top_a","top_p","tfs","typical","temperature","rep_pen",
+"candidates","grammar","grammar_accept","dry","prefilter","mirostat","xtc","pick"};
+static int64_t sample_stage_us[SAMPLE_STAGE_COUNT] = {};
+
 int SampleLogits(const float * logits, int n_ctx, int n_vocab, int rep_pen_range, float rep_pen, float rep_pen_slope, float presence_penalty, float top_k, float top_a, float top_p, float min_p, float typical_p, float tfs, float temp, std::mt19937 & rng,
 int mirostat, float mirostat_tau, float mirostat_eta, float dry_multiplier, float dry_base, int dry_allowed_length, int dry_penalty_last_n, float xtc_threshold, float xtc_probability,
-const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dynatemp_range, float dynatemp_exponent, float smoothing_factor)
+const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dynatemp_range, float dynatemp_exponent, float smoothing_factor,
+const std::vector<int> & temp_bans)
 {
     int id = 0;
+    int64_t stage_start_us = ggml_time_us();
+    auto end_stage = [&](int stage) {
+        int64_t now = ggml_time_us();
+        sample_stage_us[stage] += now - stage_start_us;
+        stage_start_us = now;
+    };
     std::vector<llama_token_data> candidates;
     candidates.reserve(n_vocab);
+    float min_logit = (n_vocab > 0 ? logits[0] : 0);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        const float logit = logits[token_id];
+        min_logit = (logit < min_logit ? logit : min_logit);
+        candidates.emplace_back(llama_token_data{token_id, logit, 0.0f});
     }
 
-    for(int i=0;i<logit_biases.size();++i)
+    //banned tokens sit below the lowest logit, any bias still applies on top
+    const float banned_logit = LowestLogit(min_logit);
+    for(int i=0;i<temp_bans.size();++i)
+    {
+        candidates[temp_bans[i]].logit = banned_logit;
+    }
+    for(int i=0;i<logit_mask.size();++i)
     {
-        auto & itm = logit_biases[i];
-        candidates[itm.token_id].logit += itm.bias;
+        auto & itm = logit_mask[i];
+        candidates[itm.token_id].logit = (itm.ban ? banned_logit : candidates[itm.token_id].logit) + itm.bias;
     }
 
     llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    end_stage(SAMPLE_STAGE_CANDIDATES);
 
     if (grammar != nullptr) {
         sample_grammar(file_format, n_vocab, &candidates_p, grammar);
+        end_stage(SAMPLE_STAGE_GRAMMAR);
     }
 
     //dry always first as logits cannot be resorted
     sample_dry(n_ctx, dry_penalty_last_n, dry_multiplier, dry_base, dry_allowed_length, dry_sequence_breakers, &candidates_p);
+    end_stage(SAMPLE_STAGE_DRY);
 
     //prefilter to top 3k tokens for improved speed
     sample_top_k(&candidates_p, 3000);
+    end_stage(SAMPLE_STAGE_PREFILTER);
 
     if (mirostat == 1 || mirostat == 2)
     {
@@ -1604,6 +1925,7 @@ const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dyna
         {
             id = sample_token_mirostat_v2(&candidates_p, rng, mirostat_tau, mirostat_eta, &mirostat_mu);
         }
+        end_stage(SAMPLE_STAGE_MIROSTAT);
     }
     else
     {
@@ -1650,10 +1972,16 @@ const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dyna
                     printf("\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
                     break;
             }
+            if (sampler_order[i] >= 0 && sampler_order[i] < KCPP_SAMPLER_MAX)
+            {
+                end_stage(sampler_order[i]);
+            }
         }
         //xtc always last
         sample_xtc(&candidates_p, xtc_threshold, xtc_probability, rng);
+        end_stage(SAMPLE_STAGE_XTC);
         id = sample_token(&candidates_p, rng);
+        end_stage(SAMPLE_STAGE_PICK);
     }
 
     return id;
@@ -1797,6 +2125,9 @@ void PurgeMissingTokens(llama_context * ctx, llama_context * draft_ctx, std::vec
             }
 
             printf("\n[Context Shifting: Erased %d tokens at position %d]", diff, trimstart + 1);
+            total_context_shifts += 1;
+            kcpp_metric_add("kcpp_context_shift_total", "Context shifts that erased tokens from the KV cache.", 1);
+            kcpp_metric_add("kcpp_context_shift_tokens_total", "Tokens erased from the KV cache by context shifting.", diff);
 
             current_context_tokens.resize(current_context_tokens.size() - diff);
         }
@@ -1804,6 +2135,71 @@ void PurgeMissingTokens(llama_context * ctx, llama_context * draft_ctx, std::vec
 
 }
 
+//attention sink rolling window, used instead of PurgeMissingTokens when enabled. if the new context does not fit in budget,
+//keep its first sink_len tokens and evict the oldest ones after them. when the kept tail continues the window already in
+//the KV, the eviction is done in place by shifting the cached positions, so an endless chat never reprocesses its history
+static void AttentionSinkWindow(llama_context * ctx, llama_context * draft_ctx, std::vector<int> &current_context_tokens, std::vector<int> &new_context_tokens, int sink_len, const int budget, const bool allow_shift)
+{
+    const int new_tokens_len = new_context_tokens.size();
+    if(new_tokens_len <= budget || budget <= 0)
+    {
+        return;
+    }
+    sink_len = std::min(sink_len, budget/2);
+    const int excess = new_tokens_len - budget;
+    int drop = excess; //tokens removed from the new context after the sink
+    int kv_evict = 0; //tokens removed from the cached window after the sink
+
+    //locate the start of the cached window in the new context. everything between the sink and it was already evicted earlier
+    const int curr_tokens_len = current_context_tokens.size();
+    const int probe_len = std::min(curr_tokens_len - sink_len, 32);
+    if(allow_shift && probe_len >= 4 && std::equal(current_context_tokens.begin(), current_context_tokens.begin() + sink_len, new_context_tokens.begin()))
+    {
+        auto probe = current_context_tokens.begin() + sink_len;
+        auto found = std::search(new_context_tokens.begin() + sink_len, new_context_tokens.end(), probe, probe + probe_len);
+        if(found != new_context_tokens.end())
+        {
+            const int gap = found - (new_context_tokens.begin() + sink_len);
+            if(gap >= excess)
+            {
+                drop = gap;
+            }
+            else
+            {
+                //evict a little more than needed, so that the next few short turns fit without another shift
+                kv_evict = std::max(excess - gap, budget/16);
+                kv_evict = std::min(kv_evict, new_tokens_len - sink_len - gap);
+                if(kv_evict >= curr_tokens_len - sink_len)
+                {
+                    kv_evict = 0; //nothing of the cached window survives, let fast forward handle it
+                }
+                else
+                {
+                    drop = gap + kv_evict;
+                }
+            }
+        }
+    }
+
+    if(kv_evict > 0)
+    {
+        llama_kv_cache_seq_rm(ctx, 0, sink_len, sink_len + kv_evict);
+        llama_kv_cache_seq_add(ctx, 0, sink_len + kv_evict, -1, -kv_evict);
+        if(draft_ctx)
+        {
+            llama_kv_cache_seq_rm(draft_ctx, 0, sink_len, sink_len + kv_evict);
+            llama_kv_cache_seq_add(draft_ctx, 0, sink_len + kv_evict, -1, -kv_evict);
+        }
+        current_context_tokens.erase(current_context_tokens.begin() + sink_len, current_context_tokens.begin() + sink_len + kv_evict);
+
+        printf("\n[Attention Sink: Evicted %d tokens after the first %d]", kv_evict, sink_len);
+        total_context_shifts += 1;
+        kcpp_metric_add("kcpp_context_shift_total", "Context shifts that erased tokens from the KV cache.", 1);
+        kcpp_metric_add("kcpp_context_shift_tokens_total", "Tokens erased from the KV cache by context shifting.", kv_evict);
+    }
+    new_context_tokens.erase(new_context_tokens.begin() + sink_len, new_context_tokens.begin() + sink_len + drop);
+}
+
 static int GetBatchSize(int desiredBlasBatchSize,FileFormat in_file_format)
 {
     //check if approved to use BLAS
@@ -1855,115 +2251,934 @@ static float CalcGradientAIRopeFreqBase(float original_rope_base, int n_ctx_trai
     }
 }
 
-ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta in_file_format_meta)
+//model pool: extra gguf models that requests can select by name. slot 0 is the main model and always stays loaded,
+//other slots are loaded on demand and the least recently used ones are freed when over the memory budget
+struct kcpp_pool_slot
 {
-    is_quiet = inputs.quiet;
-    ggml_time_init();
-    kcpp_data = new kcpp_params(); //allocate on heap to avoid linux segfault. yes this leaks memory.
-
-    file_format = in_file_format;
-    file_format_meta = in_file_format_meta;
-    kcpp_data->n_threads = inputs.threads;
-    kcpp_data->n_blasthreads = inputs.blasthreads;
-    bool isGguf = (file_format == FileFormat::GGUF_GENERIC);
-    kcpp_data->n_batch = GetBatchSize(inputs.blasbatchsize, in_file_format);
-    kcpp_data->n_ubatch = kcpp_data->n_batch;
-    kcpp_data->flash_attn = inputs.flash_attention;
-    kcpp_data->model_filename = inputs.model_filename;
-    kcpp_data->use_smartcontext = inputs.use_smartcontext;
-    kcpp_data->use_contextshift = inputs.use_contextshift;
-    kcpp_data->use_fastforward = inputs.use_fastforward;
-    debugmode = inputs.debugmode;
-    draft_ctx = nullptr;
-
-    auto clamped_max_context_length = inputs.max_context_length;
-
-    if(clamped_max_context_length>16384 &&
-    file_format != FileFormat::GGUF_GENERIC)
+    std::string name = "";
+    std::string filename = "";
+    FileFormatExtraMeta meta;
+    llama_context * ctx = nullptr; //null while not resident
+    clip_ctx * clip = nullptr;
+    llama_context * draft = nullptr;
+    std::vector<int> context_tokens; //kv cache contents while another model is active
+    bool use_contextshift = false;
+    size_t bytes = 0;
+    int64_t last_used = 0;
+};
+static std::vector<kcpp_pool_slot> model_pool;
+static int model_pool_active = 0;
+static size_t model_pool_budget = 0; //0 = unlimited
+static int64_t model_pool_clock = 0;
+static bool model_pool_overwrite_rope = false;
+static bool model_pool_contextshift = false; //as requested at load, before the main model could turn it off for itself
+static llama_model_params model_pool_mparams;
+static llama_context_params model_pool_cparams;
+static float model_pool_tensor_split[tensor_split_max] = {};
+
+static std::string model_pool_name_from_path(const std::string & path)
+{
+    std::string name = path;
+    size_t slash = name.find_last_of("/\\");
+    if(slash!=std::string::npos)
     {
-        printf("Warning: Only GGUF models can use max context above 16k. Max context lowered to 16k.\n");
-        clamped_max_context_length = 16384;
+        name = name.substr(slash+1);
     }
+    size_t dot = name.find_last_of('.');
+    if(dot!=std::string::npos && dot>0)
+    {
+        name = name.substr(0,dot);
+    }
+    return name;
+}
 
-    kcpp_data->n_ctx = clamped_max_context_length;
-    max_context_limit_at_load = clamped_max_context_length;
-
-    neox_ctx_v2.hparams.n_ctx  = neox_ctx_v3.hparams.n_ctx
-    = gptj_ctx_v1.hparams.n_ctx = gptj_ctx_v2.hparams.n_ctx = gptj_ctx_v3.hparams.n_ctx
-    = gpt2_ctx_v1.hparams.n_ctx = gpt2_ctx_v2.hparams.n_ctx = gpt2_ctx_v3.hparams.n_ctx
-    = mpt_ctx_v3.hparams.n_ctx = kcpp_data->n_ctx;
+static size_t model_pool_resident_bytes()
+{
+    size_t total = 0;
+    for(auto & slot : model_pool)
+    {
+        total += (slot.ctx?slot.bytes:0);
+    }
+    return total;
+}
 
-    vision_max_res = inputs.visionmaxres;
+static void model_pool_evict(int idx)
+{
+    kcpp_pool_slot & slot = model_pool[idx];
+    if(slot.ctx==nullptr)
+    {
+        return;
+    }
+    printf("\nModel Pool: Unloading %s\n",slot.name.c_str());
+    llama_model * mdl = (llama_model *)llama_get_model(slot.ctx);
+    llama_free(slot.ctx);
+    llama_model_free(mdl);
+    slot.ctx = nullptr;
+    slot.bytes = 0;
+    slot.context_tokens.clear();
+}
 
-    //determine rope scaling params
-    float rope_freq_scale = 1.0f;
-    float rope_freq_base = 10000.0f;
-    bool overwriteRope = false;
-    if(inputs.rope_freq_scale>0.0f)
+static bool model_pool_admit(int idx)
+{
+    kcpp_pool_slot & slot = model_pool[idx];
+    size_t estimate = 0;
+    FILE * fp = fopen(slot.filename.c_str(), "rb");
+    if(fp)
     {
-        rope_freq_scale = inputs.rope_freq_scale;
-        rope_freq_base = inputs.rope_freq_base;
-        overwriteRope = true;
-        printf("Using Custom RoPE scaling (scale:%.3f, base:%.1f).\n",rope_freq_scale,rope_freq_base);
+        fseek(fp, 0, SEEK_END);
+        estimate = (size_t)ftell(fp);
+        fclose(fp);
     }
-    else
+    while(model_pool_budget>0 && model_pool_resident_bytes() + estimate > model_pool_budget)
     {
-        //Set freq base for all, including non GGUF. If we are using GGUF, this will be overwritten with more accurate values later.
-        rope_freq_base = CalcGradientAIRopeFreqBase(10000.0f,2048,kcpp_data->n_ctx, GGUFArch::ARCH_DEFAULT);
-        if(file_format==FileFormat::GGUF_GENERIC)
+        int lru = -1;
+        for(int i=1;i<model_pool.size();++i)
         {
-            printf("Using automatic RoPE scaling for GGUF. If the model has custom RoPE settings, they'll be used directly instead!\n");
+            if(i!=model_pool_active && model_pool[i].ctx!=nullptr && (lru<0 || model_pool[i].last_used < model_pool[lru].last_used))
+            {
+                lru = i;
+            }
         }
-        else
+        if(lru<0)
         {
-            printf("Using Automatic RoPE scaling, Pre-GGUF (scale:%.3f, base:%.1f).\n",rope_freq_scale, rope_freq_base);
+            break; //nothing left to evict, load anyway
         }
+        model_pool_evict(lru);
     }
-    gptj_ctx_v3.hparams.rope_freq_scale = neox_ctx_v3.hparams.rope_freq_scale = rope_freq_scale;
-    gptj_ctx_v3.hparams.rope_freq_base = neox_ctx_v3.hparams.rope_freq_base = rope_freq_base;
-
-    //this is used for the mem_per_token eval, blas needs more RAM
-    bool v3_use_scratch = ggml_v3_cpu_has_gpublas();
 
-    int cu_parseinfo_maindevice = inputs.cublas_info<=0?0:inputs.cublas_info;
-
-    printf("System Info: %s\n", kcpp_print_system_info());
-    #if defined(GGML_USE_CUDA)
-    if(file_format!=FileFormat::GGUF_GENERIC)
+    printf("\nModel Pool: Loading %s\n",slot.name.c_str());
+    llama_model * mdl = llama_model_load_from_file(slot.filename.c_str(), model_pool_mparams);
+    if(mdl==nullptr)
     {
-        if(ggml_v3_cpu_has_gpublas() && cu_parseinfo_maindevice>0)
+        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, slot.filename.c_str());
+        return false;
+    }
+    llama_context_params cparams = model_pool_cparams;
+    if(!model_pool_overwrite_rope)
+    {
+        cparams.rope_freq_base = 0.0f; //use model values unless the automatic scaling below applies
+        cparams.rope_freq_scale = 0.0f;
+        if(!((mdl->hparams.rope_freq_base_train!=10000.0f && mdl->hparams.rope_freq_base_train!=500000.0f) ||
+        mdl->hparams.rope_freq_scale_train!=1.0f ||
+        mdl->hparams.rope_scaling_type_train==2))
         {
-            printf("CUBLAS v3: Set main device to %d\n",cu_parseinfo_maindevice);
-            ggml_v3_cuda_set_main_device(cu_parseinfo_maindevice);
+            cparams.rope_freq_base = CalcGradientAIRopeFreqBase(mdl->hparams.rope_freq_base_train, slot.meta.n_ctx_train, kcpp_data->n_ctx, slot.meta.model_architecture);
+            cparams.rope_freq_scale = 1.0f;
         }
     }
-
-    #endif
-    SetQuantsUnshuffled(false);
-    if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2)
+    if(slot.meta.model_architecture==GGUFArch::ARCH_RWKV)
     {
-        //newer format has bit unshuffling
-        SetQuantsUnshuffled(file_format == FileFormat::GGJT_2);
-        llama_v2_context_params llama_ctx_params_v2 = llama_v2_context_default_params();
-        llama_ctx_params_v2.n_ctx = clamped_max_context_length;
-        llama_ctx_params_v2.seed = -1;
-        llama_ctx_params_v2.f16_kv = true;
-        llama_ctx_params_v2.logits_all = false;
-        llama_ctx_params_v2.use_mmap = inputs.use_mmap;
-        llama_ctx_params_v2.use_mlock = inputs.use_mlock;
-        llama_ctx_params_v2.n_gpu_layers = inputs.gpulayers;
-
-        llama_ctx_v2 = llama_v2_init_from_file(kcpp_data->model_filename.c_str(), llama_ctx_params_v2);
+        mdl->vocab.set_eos_bos(0,0);
+    }
+    slot.ctx = llama_new_context_with_model(mdl, cparams);
+    if(slot.ctx==nullptr)
+    {
+        fprintf(stderr, "%s: error: failed to create context for '%s'\n", __func__, slot.filename.c_str());
+        llama_model_free(mdl);
+        return false;
+    }
+    slot.bytes = llama_model_size(mdl) + slot.ctx->kv_self.total_size();
+    slot.context_tokens.clear();
+    slot.use_contextshift = model_pool_contextshift && slot.meta.model_architecture!=GGUFArch::ARCH_QWEN2VL;
+    return true;
+}
 
-        if (llama_ctx_v2 == NULL)
+//make the requested model active, parking the kv state of the current one. unknown names select the main model
+static void model_pool_select(std::string name)
+{
+    if(model_pool.size()<=1)
+    {
+        return;
+    }
+    if(name.rfind("koboldcpp/",0)==0)
+    {
+        name = name.substr(10);
+    }
+    int target = 0;
+    for(int i=1;i<model_pool.size();++i)
+    {
+        if(model_pool[i].name==name)
         {
-            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, kcpp_data->model_filename.c_str());
-            return ModelLoadResult::FAIL;
+            target = i;
+            break;
         }
-
-        printf("\n---\nWarning: Your model may be an OUTDATED format (ver %d). Please reconvert it for better results!\n---\n", file_format);
-
-        if (lora_filename != "")
+    }
+    if(target!=model_pool_active)
+    {
+        kcpp_pool_slot & cur = model_pool[model_pool_active];
+        cur.context_tokens = current_context_tokens;
+        if(model_pool[target].ctx==nullptr && !model_pool_admit(target))
+        {
+            target = 0;
+        }
+    }
+    if(target!=model_pool_active)
+    {
+        kcpp_pool_slot & next = model_pool[target];
+        llama_ctx_v4 = next.ctx;
+        clp_ctx = next.clip;
+        draft_ctx = next.draft;
+        file_format_meta = next.meta;
+        current_context_tokens = next.context_tokens;
+        kcpp_data->use_contextshift = next.use_contextshift;
+        n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(llama_ctx_v4)));
+        llava_composite_image_signature = ""; //force images to be reevaluated
+        last_llava_mem.clear();
+        model_pool_active = target;
+        if(!is_quiet)
+        {
+            printf("\nModel Pool: Switched to %s\n",next.name.c_str());
+        }
+    }
+    model_pool[model_pool_active].last_used = ++model_pool_clock;
+}
+
+static void model_pool_setup(const load_model_inputs & inputs, llama_model_params model_params, llama_context_params ctx_params, bool overwrite_rope)
+{
+    model_pool.clear();
+    model_pool_active = 0;
+    kcpp_pool_slot mainslot;
+    mainslot.name = model_pool_name_from_path(kcpp_data->model_filename);
+    mainslot.filename = kcpp_data->model_filename;
+    mainslot.meta = file_format_meta;
+    mainslot.ctx = llama_ctx_v4;
+    mainslot.clip = clp_ctx;
+    mainslot.draft = draft_ctx;
+    mainslot.use_contextshift = kcpp_data->use_contextshift;
+    mainslot.bytes = llama_model_size(llama_get_model(llama_ctx_v4)) + llama_ctx_v4->kv_self.total_size();
+    model_pool.push_back(mainslot);
+
+    for(int i=0;i<inputs.model_pool_len;++i)
+    {
+        kcpp_pool_slot slot;
+        slot.filename = inputs.model_pool[i];
+        slot.name = model_pool_name_from_path(slot.filename);
+        if(check_file_format(slot.filename, &slot.meta)!=FileFormat::GGUF_GENERIC)
+        {
+            printf("\nModel Pool: Skipping %s, only GGUF models can be pooled.\n",slot.filename.c_str());
+            continue;
+        }
+        printf("\nModel Pool: Added %s (%s)\n",slot.name.c_str(),slot.filename.c_str());
+        model_pool.push_back(slot);
+    }
+    if(model_pool.size()<=1)
+    {
+        return;
+    }
+
+    model_pool_budget = (size_t)inputs.model_pool_budget_mb*1024*1024;
+    model_pool_overwrite_rope = overwrite_rope;
+    model_pool_contextshift = inputs.use_contextshift;
+    model_params.kv_overrides = nullptr; //expert overrides only apply to the main model
+    if(model_params.tensor_split)
+    {
+        memcpy(model_pool_tensor_split, model_params.tensor_split, sizeof(model_pool_tensor_split));
+        model_params.tensor_split = model_pool_tensor_split;
+    }
+    model_pool_mparams = model_params;
+    model_pool_cparams = ctx_params;
+}
+
+//switch to the runtime lora adapters requested for this generation. the kv cache was computed
+//with the previous adapter weights, so any change to the selection invalidates it
+static void apply_lora_selection(const generation_inputs & inputs)
+{
+    if(model_pool_active!=0 || llama_ctx_v4==nullptr)
+    {
+        return; //adapters belong to the main model
+    }
+    std::vector<lora_selection> wanted;
+    for(int i=0;i<inputs.lora_selections_len;++i)
+    {
+        lora_selection sel = inputs.lora_selections[i];
+        if(sel.adapter_id>=0 && sel.adapter_id<runtime_lora_adapters.size() && sel.scale!=0.0f)
+        {
+            wanted.push_back(sel);
+        }
+    }
+    bool unchanged = (wanted.size()==active_lora_selection.size());
+    for(int i=0;unchanged && i<wanted.size();++i)
+    {
+        unchanged = (wanted[i].adapter_id==active_lora_selection[i].adapter_id && wanted[i].scale==active_lora_selection[i].scale);
+    }
+    if(unchanged)
+    {
+        return;
+    }
+    llama_clear_adapter_lora(llama_ctx_v4);
+    if(base_lora_adapter)
+    {
+        llama_set_adapter_lora(llama_ctx_v4, base_lora_adapter, 1.0f);
+    }
+    for(auto & sel : wanted)
+    {
+        llama_set_adapter_lora(llama_ctx_v4, runtime_lora_adapters[sel.adapter_id], sel.scale);
+        if(debugmode==1 && !is_quiet)
+        {
+            printf("\nUsing LORA adapter %d (scale %.2f)",sel.adapter_id,sel.scale);
+        }
+    }
+    active_lora_selection = wanted;
+    current_context_tokens.clear();
+}
+
+//kv tiering: when a new prompt would throw away most of the current context, its seq state is kept as a
+//snapshot in ram, spilling least recently used snapshots to files. a later prompt that matches a snapshot
+//better than the live context restores it instead of reprocessing the whole prompt
+struct kcpp_kv_snapshot
+{
+    std::string variant; //model and adapters the state was computed with
+    std::vector<int> tokens;
+    std::vector<uint8_t> data; //empty when spilled
+    std::string spill_path = "";
+    size_t bytes = 0;
+    int64_t last_used = 0;
+};
+static std::vector<kcpp_kv_snapshot> kv_tier_snapshots;
+static size_t kv_tier_ram_budget = 0; //0 = tiering disabled
+static std::string kv_tier_dir = "";
+static int64_t kv_tier_clock = 0;
+static int kv_tier_file_counter = 0;
+const int kv_tier_min_tokens = 256; //smaller contexts are cheap enough to reprocess
+const int kv_tier_max_snapshots = 32;
+
+static std::string kv_tier_variant()
+{
+    std::string variant = std::to_string(model_pool_active);
+    for(auto & sel : active_lora_selection)
+    {
+        variant += "|" + std::to_string(sel.adapter_id) + ":" + std::to_string(sel.scale);
+    }
+    return variant;
+}
+
+static void kv_tier_drop(int idx)
+{
+    if(kv_tier_snapshots[idx].spill_path!="")
+    {
+        std::remove(kv_tier_snapshots[idx].spill_path.c_str());
+    }
+    kv_tier_snapshots.erase(kv_tier_snapshots.begin() + idx);
+}
+
+static void kv_tier_clear()
+{
+    while(!kv_tier_snapshots.empty())
+    {
+        kv_tier_drop(kv_tier_snapshots.size()-1);
+    }
+}
+
+//spill files must not outlive the library, whether it gets unloaded or the process exits
+static struct kv_tier_cleanup
+{
+    ~kv_tier_cleanup() { kv_tier_clear(); }
+} kv_tier_cleanup_at_unload;
+
+//move least recently used snapshots out of ram until the budget fits, dropping them if there is no spill dir
+static void kv_tier_enforce_budget()
+{
+    while(kv_tier_snapshots.size() > kv_tier_max_snapshots)
+    {
+        int oldest = 0;
+        for(int i=1;i<kv_tier_snapshots.size();++i)
+        {
+            oldest = (kv_tier_snapshots[i].last_used < kv_tier_snapshots[oldest].last_used ? i : oldest);
+        }
+        kv_tier_drop(oldest);
+    }
+    while(true)
+    {
+        size_t resident = 0;
+        int oldest = -1;
+        for(int i=0;i<kv_tier_snapshots.size();++i)
+        {
+            if(!kv_tier_snapshots[i].data.empty())
+            {
+                resident += kv_tier_snapshots[i].bytes;
+                oldest = ((oldest<0 || kv_tier_snapshots[i].last_used < kv_tier_snapshots[oldest].last_used) ? i : oldest);
+            }
+        }
+        if(resident <= kv_tier_ram_budget || oldest < 0)
+        {
+            return;
+        }
+        kcpp_kv_snapshot & snap = kv_tier_snapshots[oldest];
+        if(snap.spill_path!="")
+        {
+            //restored from its file earlier, which is still valid. only the ram copy has to go
+            snap.data.clear();
+            snap.data.shrink_to_fit();
+            continue;
+        }
+        bool spilled = false;
+        if(kv_tier_dir!="")
+        {
+            std::string path = kv_tier_dir + "/kcpp_kvtier_" + std::to_string(kv_tier_file_counter++) + ".bin";
+            FILE * f = fopen(path.c_str(), "wb");
+            if(f)
+            {
+                spilled = (fwrite(snap.data.data(), 1, snap.data.size(), f) == snap.data.size());
+                fclose(f);
+                if(spilled)
+                {
+                    snap.spill_path = path;
+                    snap.data.clear();
+                    snap.data.shrink_to_fit();
+                }
+                else
+                {
+                    std::remove(path.c_str());
+                }
+            }
+        }
+        if(!spilled)
+        {
+            kv_tier_drop(oldest);
+        }
+    }
+}
+
+static void kv_tier_save(llama_context * ctx)
+{
+    //the last sampled token is not in the kv yet, only keep what the state holds
+    std::vector<int> tokens = current_context_tokens;
+    const int kv_tokens = llama_kv_cache_seq_pos_max(ctx, 0) + 1;
+    tokens.resize(std::min((int)tokens.size(), std::max(kv_tokens, 0)));
+    if(tokens.size() < kv_tier_min_tokens)
+    {
+        return;
+    }
+    for(int tok : tokens)
+    {
+        if(tok==LLAVA_TOKEN_IDENTIFIER_A || tok==LLAVA_TOKEN_IDENTIFIER_B)
+        {
+            return; //image embeddings are tracked separately, do not keep them
+        }
+    }
+    const std::string variant = kv_tier_variant();
+    for(int i=kv_tier_snapshots.size()-1;i>=0;--i)
+    {
+        //snapshots that this context extends are superseded
+        const auto & old = kv_tier_snapshots[i].tokens;
+        if(kv_tier_snapshots[i].variant==variant && old.size() <= tokens.size() && std::equal(old.begin(), old.end(), tokens.begin()))
+        {
+            kv_tier_drop(i);
+        }
+    }
+    kcpp_kv_snapshot snap;
+    snap.variant = variant;
+    snap.tokens = tokens;
+    snap.data.resize(llama_state_seq_get_size(ctx, 0));
+    snap.bytes = llama_state_seq_get_data(ctx, snap.data.data(), snap.data.size(), 0);
+    if(snap.bytes==0)
+    {
+        return;
+    }
+    snap.data.resize(snap.bytes);
+    snap.last_used = ++kv_tier_clock;
+    kv_tier_snapshots.push_back(snap);
+    if(debugmode==1 && !is_quiet)
+    {
+        printf("\nKV Tier: Saved %zu tokens (%zu MB)\n", tokens.size(), snap.bytes/(1024*1024));
+    }
+    kv_tier_enforce_budget();
+}
+
+static bool kv_tier_restore(llama_context * ctx, int idx)
+{
+    kcpp_kv_snapshot & snap = kv_tier_snapshots[idx];
+    std::vector<uint8_t> filedata;
+    const std::vector<uint8_t> * src = &snap.data;
+    if(snap.data.empty())
+    {
+        FILE * f = fopen(snap.spill_path.c_str(), "rb");
+        if(f)
+        {
+            filedata.resize(snap.bytes);
+            if(fread(filedata.data(), 1, snap.bytes, f) != snap.bytes)
+            {
+                filedata.clear();
+            }
+            fclose(f);
+        }
+        if(filedata.empty())
+        {
+            kv_tier_drop(idx);
+            return false;
+        }
+        src = &filedata;
+    }
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    if(llama_state_seq_set_data(ctx, src->data(), src->size(), 0)==0)
+    {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+        current_context_tokens.clear();
+        kv_tier_drop(idx);
+        return false;
+    }
+    current_context_tokens = snap.tokens;
+    snap.last_used = ++kv_tier_clock;
+    if(!filedata.empty())
+    {
+        //promote back to ram, the file copy stays valid until dropped
+        snap.data.swap(filedata);
+        kv_tier_enforce_budget();
+    }
+    return true;
+}
+
+static int kv_tier_common_prefix(const std::vector<int> & a, const std::vector<int> & b)
+{
+    int n = std::min(a.size(), b.size());
+    int i = 0;
+    while(i < n && a[i]==b[i])
+    {
+        ++i;
+    }
+    return i;
+}
+
+//called before fast forwarding. keeps the live context if it is about to be lost,
+//and swaps in a stored snapshot if it shares a longer prefix with the new prompt
+static void kv_tier_prepare(llama_context * ctx, const std::vector<int> & embd_inp)
+{
+    if(kv_tier_ram_budget==0 || ctx==nullptr || draft_ctx!=nullptr || ctx->kv_self.recurrent)
+    {
+        return;
+    }
+    const int live_match = kv_tier_common_prefix(current_context_tokens, embd_inp);
+    const std::string variant = kv_tier_variant();
+    int best = -1;
+    int best_match = live_match;
+    for(int i=0;i<kv_tier_snapshots.size();++i)
+    {
+        if(kv_tier_snapshots[i].variant!=variant)
+        {
+            continue;
+        }
+        int match = kv_tier_common_prefix(kv_tier_snapshots[i].tokens, embd_inp);
+        if(match > best_match)
+        {
+            best = i;
+            best_match = match;
+        }
+    }
+    const bool restore = (best >= 0 && best_match >= live_match + kv_tier_min_tokens);
+    if((int)current_context_tokens.size() - live_match >= kv_tier_min_tokens)
+    {
+        kv_tier_save(ctx);
+        if(restore)
+        {
+            //saving may have superseded, spilled or dropped snapshots, find the best one again
+            best = -1;
+            for(int i=0;i<kv_tier_snapshots.size();++i)
+            {
+                if(kv_tier_snapshots[i].variant==variant && kv_tier_common_prefix(kv_tier_snapshots[i].tokens, embd_inp)==best_match)
+                {
+                    best = i;
+                    break;
+                }
+            }
+        }
+    }
+    if(restore && best >= 0)
+    {
+        int64_t t0 = ggml_time_us();
+        bool spilled = kv_tier_snapshots[best].data.empty();
+        if(kv_tier_restore(ctx, best) && debugmode==1 && !is_quiet)
+        {
+            printf("\nKV Tier: Restored %d matching tokens from %s in %.1fms\n", best_match, (spilled?"disk":"ram"), (ggml_time_us()-t0)/1000.0f);
+        }
+    }
+}
+
+//legacy rwkv checkpoints: the recurrent state cannot be rewound, so a prompt that diverges from the current context
+//used to be fed again from the first token. states are kept every rwkv_ckpt_interval tokens and near the end of each
+//prompt and turn, in a token trie, and a new prompt resumes from the deepest checkpoint that is a prefix of it
+struct rwkv_ckpt_node
+{
+    std::vector<int> edge; //tokens from the parent to this node, never empty except at the root
+    std::vector<std::unique_ptr<rwkv_ckpt_node>> children;
+    std::vector<float> state; //empty if no checkpoint ends here
+    int64_t last_used = 0;
+};
+static rwkv_ckpt_node rwkv_ckpt_root;
+static size_t rwkv_ckpt_budget = 0; //0 = disabled
+static size_t rwkv_ckpt_bytes = 0;
+static int64_t rwkv_ckpt_clock = 0;
+const int rwkv_ckpt_interval = 128;
+
+static float * rwkv_state_buffer(size_t & count)
+{
+    if(file_format == FileFormat::RWKV_1)
+    {
+        count = rwkv_v2_get_state_buffer_element_count(rwkv_ctx_v2);
+        return rwkv_ctx_v2->state_out;
+    }
+    count = rwkv_get_state_buffer_element_count(rwkv_ctx_v3);
+    return rwkv_ctx_v3->state_out;
+}
+
+static void rwkv_ckpt_clear()
+{
+    rwkv_ckpt_root.children.clear();
+    rwkv_ckpt_bytes = 0;
+}
+
+static rwkv_ckpt_node * rwkv_ckpt_oldest(rwkv_ckpt_node & node)
+{
+    rwkv_ckpt_node * oldest = (node.state.empty() ? nullptr : &node);
+    for(auto & child : node.children)
+    {
+        rwkv_ckpt_node * found = rwkv_ckpt_oldest(*child);
+        if(found && (!oldest || found->last_used < oldest->last_used))
+        {
+            oldest = found;
+        }
+    }
+    return oldest;
+}
+
+//removes branches without checkpoints and merges pass-through nodes into their only child. returns true if node is now unused
+static bool rwkv_ckpt_prune(rwkv_ckpt_node & node, bool is_root)
+{
+    for(size_t i=0;i<node.children.size();)
+    {
+        if(rwkv_ckpt_prune(*node.children[i], false))
+        {
+            node.children.erase(node.children.begin() + i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    if(is_root)
+    {
+        return false;
+    }
+    if(node.state.empty() && node.children.size()==1)
+    {
+        std::unique_ptr<rwkv_ckpt_node> child = std::move(node.children[0]);
+        node.edge.insert(node.edge.end(), child->edge.begin(), child->edge.end());
+        node.children = std::move(child->children);
+        node.state = std::move(child->state);
+        node.last_used = child->last_used;
+    }
+    return node.state.empty() && node.children.empty();
+}
+
+static void rwkv_ckpt_enforce_budget()
+{
+    bool dropped = false;
+    while(rwkv_ckpt_bytes > rwkv_ckpt_budget)
+    {
+        rwkv_ckpt_node * oldest = rwkv_ckpt_oldest(rwkv_ckpt_root);
+        if(oldest==nullptr)
+        {
+            break;
+        }
+        rwkv_ckpt_bytes -= oldest->state.size() * sizeof(float);
+        oldest->state.clear();
+        oldest->state.shrink_to_fit();
+        dropped = true;
+    }
+    if(dropped)
+    {
+        rwkv_ckpt_prune(rwkv_ckpt_root, true);
+    }
+}
+
+//stores the current state_out, which must be the state after exactly the first len tokens
+static void rwkv_ckpt_save(const std::vector<int> & tokens, int len)
+{
+    if(rwkv_ckpt_budget==0 || len<=0 || len>(int)tokens.size())
+    {
+        return;
+    }
+    size_t count = 0;
+    const float * state = rwkv_state_buffer(count);
+    if(count * sizeof(float) > rwkv_ckpt_budget)
+    {
+        return;
+    }
+    rwkv_ckpt_node * node = &rwkv_ckpt_root;
+    int pos = 0;
+    while(pos < len)
+    {
+        std::unique_ptr<rwkv_ckpt_node> * slot = nullptr;
+        for(auto & child : node->children)
+        {
+            if(child->edge[0]==tokens[pos])
+            {
+                slot = &child;
+                break;
+            }
+        }
+        if(slot==nullptr)
+        {
+            node->children.push_back(std::make_unique<rwkv_ckpt_node>());
+            node = node->children.back().get();
+            node->edge.assign(tokens.begin() + pos, tokens.begin() + len);
+            break;
+        }
+        const int edge_len = (*slot)->edge.size();
+        int common = 0;
+        while(common < edge_len && pos + common < len && (*slot)->edge[common]==tokens[pos + common])
+        {
+            ++common;
+        }
+        if(common < edge_len)
+        {
+            //split the edge so that a node ends exactly where the paths diverge
+            auto mid = std::make_unique<rwkv_ckpt_node>();
+            mid->edge.assign((*slot)->edge.begin(), (*slot)->edge.begin() + common);
+            (*slot)->edge.erase((*slot)->edge.begin(), (*slot)->edge.begin() + common);
+            mid->children.push_back(std::move(*slot));
+            *slot = std::move(mid);
+        }
+        node = slot->get();
+        pos += common;
+    }
+    if(node->state.empty())
+    {
+        rwkv_ckpt_bytes += count * sizeof(float);
+    }
+    node->state.assign(state, state + count);
+    node->last_used = ++rwkv_ckpt_clock;
+    rwkv_ckpt_enforce_budget();
+}
+
+//called before fast forwarding. if a checkpoint covers more of the new prompt than the live state, load it into
+//state_out and present its tokens as the current context, so the usual fast forward picks up from there
+static void rwkv_ckpt_resume(const std::vector<int> & embd_inp)
+{
+    if(rwkv_ckpt_budget==0 || embd_inp.size() < 2)
+    {
+        return;
+    }
+    const int max_depth = embd_inp.size() - 1; //at least one token must be evaluated to get logits
+    int live_match = 0;
+    if(current_context_tokens.size() <= max_depth && std::equal(current_context_tokens.begin(), current_context_tokens.end(), embd_inp.begin()))
+    {
+        live_match = current_context_tokens.size();
+    }
+    rwkv_ckpt_node * node = &rwkv_ckpt_root;
+    rwkv_ckpt_node * best = nullptr;
+    int pos = 0;
+    int best_depth = 0;
+    while(pos < max_depth)
+    {
+        rwkv_ckpt_node * next = nullptr;
+        for(auto & child : node->children)
+        {
+            if(child->edge[0]==embd_inp[pos])
+            {
+                next = child.get();
+                break;
+            }
+        }
+        if(next==nullptr || pos + next->edge.size() > max_depth || !std::equal(next->edge.begin(), next->edge.end(), embd_inp.begin() + pos))
+        {
+            break;
+        }
+        node = next;
+        pos += node->edge.size();
+        if(!node->state.empty())
+        {
+            best = node;
+            best_depth = pos;
+        }
+    }
+    if(best==nullptr || best_depth <= live_match)
+    {
+        return;
+    }
+    size_t count = 0;
+    float * state = rwkv_state_buffer(count);
+    memcpy(state, best->state.data(), count * sizeof(float));
+    best->last_used = ++rwkv_ckpt_clock;
+    current_context_tokens.assign(embd_inp.begin(), embd_inp.begin() + best_depth);
+    if(debugmode==1 && !is_quiet)
+    {
+        printf("\nRWKV Checkpoint: Resuming from %d matching tokens (live state matched %d)\n", best_depth, live_match);
+    }
+}
+
+//device list for offloading to remote rpc servers. it must outlive the model params, which the model pool keeps a copy of
+static std::vector<ggml_backend_dev_t> rpc_model_devices;
+static bool rpc_devices_setup(const char * rpc_servers)
+{
+    rpc_model_devices.clear();
+    if(rpc_servers==nullptr || rpc_servers[0]==0)
+    {
+        return false;
+    }
+    ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+    auto rpc_add_device = (rpc_reg ? (ggml_backend_dev_t (*)(const char *)) ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_add_device") : nullptr);
+    if(rpc_add_device==nullptr)
+    {
+        printf("\nWarning: RPC servers are not supported in this build, ignoring them.\n");
+        return false;
+    }
+    std::string servers = rpc_servers;
+    size_t start = 0;
+    while(start < servers.size())
+    {
+        size_t end = servers.find(',', start);
+        end = (end==std::string::npos ? servers.size() : end);
+        std::string endpoint = servers.substr(start, end - start);
+        start = end + 1;
+        endpoint.erase(0, endpoint.find_first_not_of(" \t"));
+        endpoint.erase(endpoint.find_last_not_of(" \t") + 1);
+        if(endpoint.empty())
+        {
+            continue;
+        }
+        ggml_backend_dev_t dev = rpc_add_device(endpoint.c_str());
+        size_t free_mem = 0, total_mem = 0;
+        if(dev)
+        {
+            ggml_backend_dev_memory(dev, &free_mem, &total_mem);
+        }
+        if(total_mem==0)
+        {
+            printf("\nWarning: Cannot reach RPC server %s, skipping it.\n", endpoint.c_str());
+            continue;
+        }
+        printf("\nRPC: Using server %s (%zu MB free)", endpoint.c_str(), free_mem/(1024*1024));
+        rpc_model_devices.push_back(dev);
+    }
+    if(rpc_model_devices.empty())
+    {
+        return false;
+    }
+    //local gpus come after the remote servers, the same order llama uses when picking devices itself
+    for(size_t i = 0; i < ggml_backend_dev_count(); ++i)
+    {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if(ggml_backend_dev_type(dev)==GGML_BACKEND_DEVICE_TYPE_GPU)
+        {
+            rpc_model_devices.push_back(dev);
+        }
+    }
+    printf("\n");
+    rpc_model_devices.push_back(nullptr);
+    return true;
+}
+
+ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta in_file_format_meta)
+{
+    is_quiet = inputs.quiet;
+    ggml_time_init();
+    kcpp_data = new kcpp_params(); //allocate on heap to avoid linux segfault. yes this leaks memory.
+
+    file_format = in_file_format;
+    file_format_meta = in_file_format_meta;
+    kcpp_data->n_threads = inputs.threads;
+    kcpp_data->n_blasthreads = inputs.blasthreads;
+    bool isGguf = (file_format == FileFormat::GGUF_GENERIC);
+    kcpp_data->n_batch = GetBatchSize(inputs.blasbatchsize, in_file_format);
+    kcpp_data->n_ubatch = kcpp_data->n_batch;
+    kcpp_data->flash_attn = inputs.flash_attention;
+    kcpp_data->model_filename = inputs.model_filename;
+    kcpp_data->use_smartcontext = inputs.use_smartcontext;
+    kcpp_data->use_contextshift = inputs.use_contextshift;
+    kcpp_data->use_fastforward = inputs.use_fastforward;
+    async_output = inputs.async_output;
+    kcpp_data->n_sink_tokens = inputs.sink_tokens;
+    debugmode = inputs.debugmode;
+    draft_ctx = nullptr;
+
+    auto clamped_max_context_length = inputs.max_context_length;
+
+    if(clamped_max_context_length>16384 &&
+    file_format != FileFormat::GGUF_GENERIC)
+    {
+        printf("Warning: Only GGUF models can use max context above 16k. Max context lowered to 16k.\n");
+        clamped_max_context_length = 16384;
+    }
+
+    kcpp_data->n_ctx = clamped_max_context_length;
+    max_context_limit_at_load = clamped_max_context_length;
+
+    neox_ctx_v2.hparams.n_ctx  = neox_ctx_v3.hparams.n_ctx
+    = gptj_ctx_v1.hparams.n_ctx = gptj_ctx_v2.hparams.n_ctx = gptj_ctx_v3.hparams.n_ctx
+    = gpt2_ctx_v1.hparams.n_ctx = gpt2_ctx_v2.hparams.n_ctx = gpt2_ctx_v3.hparams.n_ctx
+    = mpt_ctx_v3.hparams.n_ctx = kcpp_data->n_ctx;
+
+    vision_max_res = inputs.visionmaxres;
+
+    //determine rope scaling params
+    float rope_freq_scale = 1.0f;
+    float rope_freq_base = 10000.0f;
+    bool overwriteRope = false;
+    if(inputs.rope_freq_scale>0.0f)
+    {
+        rope_freq_scale = inputs.rope_freq_scale;
+        rope_freq_base = inputs.rope_freq_base;
+        overwriteRope = true;
+        printf("Using Custom RoPE scaling (scale:%.3f, base:%.1f).\n",rope_freq_scale,rope_freq_base);
+    }
+    else
+    {
+        //Set freq base for all, including non GGUF. If we are using GGUF, this will be overwritten with more accurate values later.
+        rope_freq_base = CalcGradientAIRopeFreqBase(10000.0f,2048,kcpp_data->n_ctx, GGUFArch::ARCH_DEFAULT);
+        if(file_format==FileFormat::GGUF_GENERIC)
+        {
+            printf("Using automatic RoPE scaling for GGUF. If the model has custom RoPE settings, they'll be used directly instead!\n");
+        }
+        else
+        {
+            printf("Using Automatic RoPE scaling, Pre-GGUF (scale:%.3f, base:%.1f).\n",rope_freq_scale, rope_freq_base);
+        }
+    }
+    gptj_ctx_v3.hparams.rope_freq_scale = neox_ctx_v3.hparams.rope_freq_scale = rope_freq_scale;
+    gptj_ctx_v3.hparams.rope_freq_base = neox_ctx_v3.hparams.rope_freq_base = rope_freq_base;
+
+    //this is used for the mem_per_token eval, blas needs more RAM
+    bool v3_use_scratch = ggml_v3_cpu_has_gpublas();
+
+    int cu_parseinfo_maindevice = inputs.cublas_info<=0?0:inputs.cublas_info;
+
+    printf("System Info: %s\n", kcpp_print_system_info());
+    #if defined(GGML_USE_CUDA)
+    if(file_format!=FileFormat::GGUF_GENERIC)
+    {
+        if(ggml_v3_cpu_has_gpublas() && cu_parseinfo_maindevice>0)
+        {
+            printf("CUBLAS v3: Set main device to %d\n",cu_parseinfo_maindevice);
+            ggml_v3_cuda_set_main_device(cu_parseinfo_maindevice);
+        }
+    }
+
+    #endif
+    SetQuantsUnshuffled(false);
+    if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2)
+    {
+        //newer format has bit unshuffling
+        SetQuantsUnshuffled(file_format == FileFormat::GGJT_2);
+        llama_v2_context_params llama_ctx_params_v2 = llama_v2_context_default_params();
+        llama_ctx_params_v2.n_ctx = clamped_max_context_length;
+        llama_ctx_params_v2.seed = -1;
+        llama_ctx_params_v2.f16_kv = true;
+        llama_ctx_params_v2.logits_all = false;
+        llama_ctx_params_v2.use_mmap = inputs.use_mmap;
+        llama_ctx_params_v2.use_mlock = inputs.use_mlock;
+        llama_ctx_params_v2.n_gpu_layers = inputs.gpulayers;
+
+        llama_ctx_v2 = llama_v2_init_from_file(kcpp_data->model_filename.c_str(), llama_ctx_params_v2);
+
+        if (llama_ctx_v2 == NULL)
+        {
+            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, kcpp_data->model_filename.c_str());
+            return ModelLoadResult::FAIL;
+        }
+
+        printf("\n---\nWarning: Your model may be an OUTDATED format (ver %d). Please reconvert it for better results!\n---\n", file_format);
+
+        if (lora_filename != "")
         {
             printf("\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
 
@@ -2124,20 +3339,33 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         llama_ctx_params.n_threads = kcpp_data->n_threads;
         llama_ctx_params.n_threads_batch = kcpp_data->n_blasthreads;
 
-        #if defined(GGML_USE_CUDA) || defined(GGML_USE_VULKAN)
-        bool ts_all_zero = true;
-        for (int i = 0; i < tensor_split_max; ++i) {
-            if (inputs.tensor_split[i] != 0.0f) {
-                ts_all_zero = false;
-                break;
-            }
-        }
-        if(!ts_all_zero)
+        bool use_rpc = rpc_devices_setup(inputs.rpc_servers);
+        if(use_rpc)
         {
-            printf("\nApplying Tensor Split...\n");
-            model_params.tensor_split = inputs.tensor_split;
+            model_params.devices = rpc_model_devices.data();
+            model_params.main_gpu = cu_parseinfo_maindevice + rpc_device_count(model_params.devices);
         }
+
+        #if defined(GGML_USE_CUDA) || defined(GGML_USE_VULKAN)
+        bool apply_tensor_split = true;
+        #else
+        bool apply_tensor_split = use_rpc; //rpc servers are the only devices to split between on other builds
         #endif
+        if(apply_tensor_split)
+        {
+            bool ts_all_zero = true;
+            for (int i = 0; i < tensor_split_max; ++i) {
+                if (inputs.tensor_split[i] != 0.0f) {
+                    ts_all_zero = false;
+                    break;
+                }
+            }
+            if(!ts_all_zero)
+            {
+                printf("\nApplying Tensor Split...\n");
+                model_params.tensor_split = inputs.tensor_split;
+            }
+        }
 
         //compat for old falcon
         if(file_format_meta.fileversion==1)
@@ -2201,6 +3429,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         }
 
         llama_ctx_params.flash_attn = kcpp_data->flash_attn;
+        llama_ctx_params.kv_paged = inputs.paged_kv;
         llama_ctx_params.type_k = (inputs.quant_k>1?GGML_TYPE_Q4_0:(inputs.quant_k==1?GGML_TYPE_Q8_0:GGML_TYPE_F16));
         llama_ctx_params.type_v = (inputs.quant_v>1?GGML_TYPE_Q4_0:(inputs.quant_v==1?GGML_TYPE_Q8_0:GGML_TYPE_F16));
         llama_ctx_v4 = llama_new_context_with_model(llamamodel, llama_ctx_params);
@@ -2226,6 +3455,19 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                 return ModelLoadResult::FAIL;
             }
             llama_set_adapter_lora(llama_ctx_v4, adapter, 1.0f);
+            base_lora_adapter = adapter;
+        }
+        runtime_lora_adapters.clear();
+        active_lora_selection.clear();
+        for(int i=0;i<inputs.lora_adapters_len;++i)
+        {
+            printf("\nLoading runtime LORA adapter %d: %s\n", i, inputs.lora_adapters[i]);
+            auto adapter = llama_adapter_lora_init(llamamodel, inputs.lora_adapters[i]);
+            if (adapter == nullptr) {
+                fprintf(stderr, "%s: error: failed to load lora adapter\n", __func__);
+                return ModelLoadResult::FAIL;
+            }
+            runtime_lora_adapters.push_back(adapter);
         }
 
         if(mmproj_filename != "" && file_format==FileFormat::GGUF_GENERIC)
@@ -2281,6 +3523,15 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         {
             printf("\nLLAMA EVAL returned nonzero: %d\n",er);
         }
+
+        model_pool_setup(inputs, model_params, llama_ctx_params, overwriteRope);
+        kv_tier_clear();
+        kv_tier_ram_budget = (inputs.kv_tier_ram_mb > 0 ? (size_t)inputs.kv_tier_ram_mb*1024*1024 : 0);
+        kv_tier_dir = (inputs.kv_tier_dir ? inputs.kv_tier_dir : "");
+        if(kv_tier_ram_budget > 0)
+        {
+            printf("\nKV Tiering: %d MB ram%s%s\n", inputs.kv_tier_ram_mb, (kv_tier_dir!=""?", spilling to ":""), kv_tier_dir.c_str());
+        }
         return ModelLoadResult::SUCCESS;
     }
     else if (file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
@@ -2333,6 +3584,13 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
         n_vocab = vocab.id_to_token.size(); //handled seperately
 
+        rwkv_ckpt_clear();
+        rwkv_ckpt_budget = (inputs.kv_tier_ram_mb > 0 ? (size_t)inputs.kv_tier_ram_mb*1024*1024 : 0);
+        if(rwkv_ckpt_budget > 0)
+        {
+            printf("\nRWKV Checkpoints: %d MB ram, every %d tokens\n", inputs.kv_tier_ram_mb, rwkv_ckpt_interval);
+        }
+
         if (file_format == FileFormat::RWKV_1)
         {
 
@@ -2701,46 +3959,142 @@ std::vector<int> gpttype_get_token_arr(const std::string & input, bool addbos)
     {
         printf("\nTokens Counted: %d\n",tokcount);
     }
-    return toks;
+    return toks;
+}
+
+std::string gpttype_detokenize(const std::vector<int> & inputids, bool render_special)
+{
+    if(kcpp_data==nullptr)
+    {
+        printf("\nWarning: KCPP text generation not initialized!\n");
+        return "";
+    }
+
+    std::string output = "";
+    for (auto eid : inputids)
+    {
+        if(eid<0 || eid>=n_vocab)
+        {
+            continue;
+        }
+        std::string tokenizedstr = FileFormatTokenizeID(eid, file_format, render_special);
+        output += tokenizedstr;
+    }
+    return output;
+}
+
+const std::string & gpttype_get_pending_output()
+{
+    if(kcpp_data==nullptr)
+    {
+        printf("\nWarning: KCPP text generation not initialized!\n");
+        return concat_output_reader_copy_poll;
+    }
+    concat_output_mtx.lock();
+    concat_output_reader_copy_poll = concat_output;
+    concat_output_mtx.unlock();
+    return concat_output_reader_copy_poll;
+}
+
+const std::vector<TopPicksData> gpttype_get_top_picks_data()
+{
+    return top_picks_history;
+}
+
+int gpttype_get_extra_output_count()
+{
+    return extra_outputs.size();
+}
+const std::string & gpttype_get_extra_output(int idx, int * stopreason)
+{
+    static std::string empty_output = "";
+    if(idx < 0 || idx >= extra_outputs.size())
+    {
+        return empty_output;
+    }
+    if(stopreason)
+    {
+        *stopreason = extra_output_stopreasons[idx];
+    }
+    return extra_outputs[idx];
+}
+
+static void finish_extra_stream(kcpp_extra_stream & es, stop_reason reason)
+{
+    es.finished = true;
+    es.reason = reason;
+    if(es.grammar)
+    {
+        llama_grammar_free_impl(es.grammar);
+        es.grammar = nullptr;
+    }
+    llama_kv_cache_seq_rm(llama_ctx_v4, es.seq_id, -1, -1);
+}
+
+static int live_extra_streams()
+{
+    int live = 0;
+    for(auto & es : extra_streams)
+    {
+        live += (es.finished?0:1);
+    }
+    return live;
+}
+
+//released sequences leave holes between the kept cells, and attention always spans up to the highest used cell.
+//move the kept cells down so the attended span and per token cost follow the tokens actually in use
+static void compact_kv_cache(llama_context * ctx)
+{
+    if(ctx==nullptr || ctx->kv_self.recurrent)
+    {
+        return;
+    }
+    const uint32_t span = llama_kv_cache_cell_max(ctx->kv_self);
+    const uint32_t used = ctx->kv_self.used;
+    if(span < 256 || used + 64 >= span)
+    {
+        return;
+    }
+    //each defrag pass is limited by the graph size, so large caches may need a few
+    for(int pass=0;pass<8 && llama_kv_cache_cell_max(ctx->kv_self) > ctx->kv_self.used;++pass)
+    {
+        llama_kv_cache_defrag(ctx);
+        llama_kv_cache_update(ctx);
+    }
+    if(debugmode==1 && !is_quiet)
+    {
+        printf("\nCompacted KV cache: span %u -> %u cells for %u used, %.1f MB resident\n", span, llama_kv_cache_cell_max(ctx->kv_self), ctx->kv_self.used, llama_kv_cache_resident_size(ctx->kv_self)/1048576.0);
+    }
 }
 
-std::string gpttype_detokenize(const std::vector<int> & inputids, bool render_special)
+//decode the pending token of every live extra stream in one batch, together with the main sequence token if given
+static bool decode_extra_streams(int main_token, int main_npast)
 {
-    if(kcpp_data==nullptr)
+    llama_batch batch = llama_batch_init(live_extra_streams() + 1, 0, 1);
+    auto batch_add = [&](int tok, int pos, llama_seq_id seq) {
+        batch.token[batch.n_tokens] = tok;
+        batch.pos[batch.n_tokens] = pos;
+        batch.n_seq_id[batch.n_tokens] = 1;
+        batch.seq_id[batch.n_tokens][0] = seq;
+        batch.logits[batch.n_tokens] = true;
+        batch.n_tokens += 1;
+    };
+    if(main_token >= 0)
     {
-        printf("\nWarning: KCPP text generation not initialized!\n");
-        return "";
+        batch_add(main_token, main_npast, 0);
     }
-
-    std::string output = "";
-    for (auto eid : inputids)
+    for(auto & es : extra_streams)
     {
-        if(eid<0 || eid>=n_vocab)
+        if(!es.finished)
         {
-            continue;
+            es.batch_idx = batch.n_tokens;
+            batch_add(es.next_token, es.n_past, es.seq_id);
+            es.n_past += 1;
         }
-        std::string tokenizedstr = FileFormatTokenizeID(eid, file_format, render_special);
-        output += tokenizedstr;
-    }
-    return output;
-}
-
-const std::string & gpttype_get_pending_output()
-{
-    if(kcpp_data==nullptr)
-    {
-        printf("\nWarning: KCPP text generation not initialized!\n");
-        return concat_output_reader_copy_poll;
     }
-    concat_output_mtx.lock();
-    concat_output_reader_copy_poll = concat_output;
-    concat_output_mtx.unlock();
-    return concat_output_reader_copy_poll;
-}
-
-const std::vector<TopPicksData> gpttype_get_top_picks_data()
-{
-    return top_picks_history;
+    bool evalres = (llama_decode(llama_ctx_v4, batch)==0);
+    llama_batch_free(batch);
+    return evalres;
 }
 
 bool VecContainsIntVal(const std::vector<int> & vec, const int val)
@@ -2768,50 +4122,93 @@ int GetThreadsToUse(bool blasmode)
     return kcpp_data->n_threads;
 }
 
-//this function prepares the clip embds for llava. it's only needed when images change
+//encodes every image with clip. decoding and resizing an image is single threaded, so each image is
+//decoded on its own thread while the images before it are being encoded
+static void EncodeLlavaImages(const int n_threads)
+{
+    const int n_images = llava_images.size();
+    std::vector<clip_image_u8 *> decoded(n_images, nullptr);
+    std::vector<std::thread> decoders;
+    for(int i=0;i<n_images;++i)
+    {
+        decoders.emplace_back([&decoded,i]() {
+            const std::vector<uint8_t> & image_buffer = llava_images[i].data;
+            clip_image_u8 * img = clip_image_u8_init();
+            if (clip_image_load_from_bytes(image_buffer.data(), image_buffer.size(), img, vision_max_res))
+            {
+                decoded[i] = img;
+            }
+            else
+            {
+                clip_image_u8_free(img);
+            }
+        });
+    }
+    for(int i=0;i<n_images;++i)
+    {
+        decoders[i].join();
+        llava_images[i].clp_image_tokens = 0;
+        if(decoded[i]==nullptr)
+        {
+            //failed to load image
+            printf("\nError: Clip image %d failed to load!",i);
+            continue;
+        }
+        if(debugmode==1 && !is_quiet)
+        {
+            printf("\nCreating clip image embed...");
+        }
+        int64_t encode_start_us = ggml_time_us();
+        if (!llava_image_embed_make_with_clip_img(clp_ctx, n_threads, decoded[i], &llava_images[i].clp_img_embd, &llava_images[i].clp_image_tokens)) {
+            printf("\nError: Clip image %d failed to create embd!",i);
+        }
+        kcpp_metric_observe("kcpp_vision_encode_seconds", "Time to encode an image with the vision projector.", (ggml_time_us() - encode_start_us) / 1000000.0, KCPP_METRIC_SECONDS);
+        if(debugmode==1 && !is_quiet)
+        {
+            printf("\nLLAVA Clip Embed %i used Tokens: %d",i,llava_images[i].clp_image_tokens);
+        }
+        clip_image_u8_free(decoded[i]);
+    }
+}
+
+//starts encoding the images in the background, so it overlaps with tokenizing the prompt. only needed when images change
+static void BeginLlavaEmbds()
+{
+    if(clp_ctx!=nullptr && clp_img_data!=nullptr && !llava_encode_job.valid())
+    {
+        llava_encode_job = std::async(std::launch::async, EncodeLlavaImages, kcpp_data->n_threads);
+    }
+}
+
+//waits for the background encode, then reserves the dummy tokens for the images that made it
 static void PrepareLlavaEmbds(const int nctx, const std::vector<int> & llava_sep)
 {
     if(clp_ctx!=nullptr && clp_img_data!=nullptr)
     {
+        BeginLlavaEmbds();
+        llava_encode_job.get();
+
         int sepsize = llava_sep.size();
         last_llava_mem.clear();
 
         for(int i=0;i<llava_images.size();++i)
         {
-            std::string llava_image = llava_images[i].b64data;
-            const std::vector<uint8_t> image_buffer = kcpp_base64_decode(llava_image);
-            if (!clip_image_load_from_bytes(image_buffer.data(), image_buffer.size(), clp_img_data, vision_max_res))
+            if(llava_images[i].clp_img_embd==nullptr)
             {
-                //failed to load image
-                printf("\nError: Clip image %d failed to load!",i);
+                continue;
             }
-            else
+            if(llava_images[i].clp_image_tokens>0 && llava_images[i].clp_image_tokens < nctx)
             {
-                if(debugmode==1 && !is_quiet)
-                {
-                    printf("\nCreating clip image embed...");
-                }
-                llava_images[i].clp_image_tokens = 0;
-                if (!llava_image_embed_make_with_clip_img(clp_ctx, kcpp_data->n_threads, clp_img_data, &llava_images[i].clp_img_embd, &llava_images[i].clp_image_tokens)) {
-                    printf("\nError: Clip image %d failed to create embd!",i);
-                }
-                if(debugmode==1 && !is_quiet)
-                {
-                    printf("\nLLAVA Clip Embed %i used Tokens: %d",i,llava_images[i].clp_image_tokens);
-                }
-                if(llava_images[i].clp_image_tokens>0 && llava_images[i].clp_image_tokens < nctx)
-                {
-                    int tokcnt = (i==0?(llava_images[i].clp_image_tokens):(llava_images[i].clp_image_tokens+sepsize));
-                    for(int n=0;n<tokcnt;++n)
-                    {
-                        last_llava_mem.push_back(current_llava_identifier);
-                    }
-                }
-                else
+                int tokcnt = (i==0?(llava_images[i].clp_image_tokens):(llava_images[i].clp_image_tokens+sepsize));
+                for(int n=0;n<tokcnt;++n)
                 {
-                    printf("\nWarning: LLAVA Image excluded - Context size too low or not enough clip tokens!\n");
+                    last_llava_mem.push_back(current_llava_identifier);
                 }
             }
+            else
+            {
+                printf("\nWarning: LLAVA Image excluded - Context size too low or not enough clip tokens!\n");
+            }
         }
     }
 }
@@ -2831,13 +4228,19 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         return output;
     }
 
+    if(file_format == FileFormat::GGUF_GENERIC)
+    {
+        model_pool_select(inputs.model_name?inputs.model_name:"");
+        apply_lora_selection(inputs);
+    }
+
     if(debugmode==1 && file_format == FileFormat::GGUF_GENERIC)
     {
         llama_perf_context_reset(llama_ctx_v4);
     }
 
-    generation_finished = false; // Set current generation status
     generated_tokens.clear(); // New Generation, new tokens
+    generation_finished = false; // Set current generation status, after the old tokens are gone
     delayed_generated_tokens.clear();
 
     concat_output_mtx.lock();
@@ -2853,6 +4256,16 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     dry_max_token_repeat.clear();
     top_picks_history.clear();
     early_abort = false;
+    for(auto & es : extra_streams)
+    {
+        if(es.grammar)
+        {
+            llama_grammar_free_impl(es.grammar);
+        }
+    }
+    extra_streams.clear();
+    extra_outputs.clear();
+    extra_output_stopreasons.clear();
 
     double time0 = 0, time1 = 0, time2 = 0;
     timer_start();
@@ -2882,6 +4295,10 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
+    stop_sequence_matcher.build(stop_sequence, false);
+    stop_sequence_state = 0;
+    stop_sequence_hit = -1;
+
     //handle custom token bans and antislop phrase banning
     banned_phrases.clear();
     delayed_generated_tokens_limit = 0;
@@ -2943,6 +4360,8 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     {
         printf("\nBanned a total of %zu phrases, with max token count of %d.\n",banned_phrases.size(),delayed_generated_tokens_limit);
     }
+    banned_phrase_matcher.build(banned_phrases, true);
+    banned_phrase_state = 0;
 
     logit_biases.clear();
     for(int x=0;x<inputs.logit_biases_len;++x)
@@ -2955,28 +4374,71 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
+    std::map<int,kcpp_logit_mask_entry> merged_mask;
+    if (!inputs.allow_eos_token && !inputs.bypass_eos_token)
+    {
+        //suppress eos and eot so they are never sampled
+        const int eos = GetEosID(file_format, n_vocab);
+        const int eot = GetEotID(file_format);
+        if(eos>=0 && eos<n_vocab)
+        {
+            merged_mask[eos].ban = true;
+        }
+        if(eot>=0 && eot<n_vocab)
+        {
+            merged_mask[eot].ban = true;
+        }
+    }
+    for(int i=0;i<banned_token_ids.size();++i)
+    {
+        merged_mask[banned_token_ids[i]].ban = true;
+    }
+    for(int i=0;i<logit_biases.size();++i)
+    {
+        merged_mask[logit_biases[i].token_id].bias += logit_biases[i].bias;
+    }
+    logit_mask.clear();
+    for(auto & itm : merged_mask)
+    {
+        itm.second.token_id = itm.first;
+        logit_mask.push_back(itm.second);
+    }
+
     std::string addedmemory = inputs.memory;
 
     //clear previous run llava embd memory, just-in-time free
+    if(llava_encode_job.valid())
+    {
+        llava_encode_job.wait();
+        llava_encode_job = std::future<void>();
+    }
     for(int i=0;i<llava_images.size();++i)
     {
-        if(llava_images[i].b64data!="" && llava_images[i].clp_img_embd!=nullptr)
+        if(!llava_images[i].data.empty() && llava_images[i].clp_img_embd!=nullptr)
         {
             free(llava_images[i].clp_img_embd);
             llava_images[i].clp_img_embd = nullptr;
         }
     }
     llava_images.clear();
+    //images arrive as raw bytes or base64, the signature only needs a size and hash of each image
     std::string new_llava_composite = "";
     for(int x=0;x<images_max;++x)
     {
-        std::string item = inputs.images[x];
-        if(item!="")
+        llava_image lv;
+        if(inputs.image_buffers[x]!=nullptr && inputs.image_buffer_lens[x]>0)
+        {
+            lv.data.assign(inputs.image_buffers[x], inputs.image_buffers[x] + inputs.image_buffer_lens[x]);
+        }
+        else if(inputs.images[x]!=nullptr && inputs.images[x][0]!='\0')
+        {
+            lv.data = kcpp_base64_decode(inputs.images[x], strlen(inputs.images[x]));
+        }
+        if(!lv.data.empty())
         {
-            llava_image lv;
-            lv.b64data = item;
+            size_t imghash = std::hash<std::string_view>{}(std::string_view((const char *)lv.data.data(), lv.data.size()));
+            new_llava_composite += std::to_string(lv.data.size()) + ":" + std::to_string(imghash) + ";";
             llava_images.push_back(lv);
-            new_llava_composite += item;
         }
     }
     if(llava_composite_image_signature!=new_llava_composite)
@@ -2989,6 +4451,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             printf("\nLLAVA images changed, existing cache invalidated");
         }
         llava_images_changed = true;
+        BeginLlavaEmbds();
     }
 
     kcpp_data->prompt = inputs.prompt;
@@ -3120,9 +4583,20 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     int32_t nctx = kcpp_data->n_ctx;
 
-    TokenizeString(kcpp_data->prompt, embd_inp, file_format);
+    int64_t tokenize_start_us = ggml_time_us();
+    TokenizeStringCached(prompt_token_cache, kcpp_data->prompt, embd_inp, file_format);
     TokenizeString("\n\n", llava_sep, file_format,false);
+    int64_t tokenize_us = ggml_time_us() - tokenize_start_us;
 
+    if(addedmemory!="")
+    {
+        tokenize_start_us = ggml_time_us();
+        TokenizeStringCached(memory_token_cache, addedmemory, embd_inp_mem, file_format);
+        tokenize_us += ggml_time_us() - tokenize_start_us;
+    }
+    kcpp_metric_observe("kcpp_tokenize_seconds", "Time to tokenize the prompt and memory of a request.", tokenize_us / 1000000.0, KCPP_METRIC_SECONDS);
+
+    //only wait for the background image encode once everything else is tokenized
     if(llava_composite_image_signature=="")
     {
         last_llava_mem.clear();
@@ -3133,13 +4607,13 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         llava_embds_built = true;
     }
 
-    if(addedmemory!="")
-    {
-        TokenizeString(addedmemory, embd_inp_mem, file_format);
-    }
+    //the attention sink window trims the middle of an overlong prompt later, once the memory is attached
+    const bool use_sink_window = (kcpp_data->n_sink_tokens > 0 && kcpp_data->use_contextshift && file_format == FileFormat::GGUF_GENERIC
+    && !llama_model_is_recurrent(llama_get_model(llama_ctx_v4)));
+    int sink_len = kcpp_data->n_sink_tokens;
 
     //truncate to front of the prompt if its too long
-    if (embd_inp.size() + kcpp_data->n_predict > nctx)
+    if (!use_sink_window && embd_inp.size() + kcpp_data->n_predict > nctx)
     {
         //get bos token
         std::vector<int> bos;
@@ -3213,7 +4687,8 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         //shorten main prompt by trimming the front if needed
         int addmemtokens = embd_inp_mem.size();
         int totalsize = (addmemtokens + embd_inp.size() + kcpp_data->n_predict);
-        if(totalsize > nctx)
+        sink_len = std::max(sink_len, addmemtokens);
+        if(totalsize > nctx && !use_sink_window)
         {
             int excess = totalsize - nctx;
             if (embd_inp.size() >= excess) {
@@ -3254,6 +4729,10 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         {
             if(kcpp_data->use_fastforward)
             {
+                if(file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
+                {
+                    rwkv_ckpt_resume(embd_inp);
+                }
                 ContextFastForward(current_context_tokens, embd_inp, n_past, last_n_tokens, nctx, smartcontext, false, true);
             }
         }
@@ -3277,13 +4756,22 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     else
     {
         bool triggersc = kcpp_data->use_smartcontext;
+        if(use_sink_window)
+        {
+            AttentionSinkWindow(llama_ctx_v4, draft_ctx, current_context_tokens, embd_inp, sink_len, nctx - kcpp_data->n_predict, kcpp_data->use_fastforward && !blank_prompt);
+            triggersc = false;
+        }
         if(!blank_prompt) //special case for blank prompts, no fast forward or shifts
         {
-            if(kcpp_data->use_fastforward && kcpp_data->use_contextshift && (file_format == FileFormat::GGUF_GENERIC))
+            if(kcpp_data->use_fastforward && kcpp_data->use_contextshift && (file_format == FileFormat::GGUF_GENERIC) && !use_sink_window)
             {
                 PurgeMissingTokens(llama_ctx_v4, draft_ctx, current_context_tokens, embd_inp, inputs.max_length, nctx);
                 triggersc = false;
             }
+            if(kcpp_data->use_fastforward && file_format == FileFormat::GGUF_GENERIC)
+            {
+                kv_tier_prepare(llama_ctx_v4, embd_inp);
+            }
             if(kcpp_data->use_fastforward)
             {
                 ContextFastForward(current_context_tokens, embd_inp, n_past, last_n_tokens, nctx, smartcontext, triggersc, false);
@@ -3301,10 +4789,20 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     bool blasmode = (embd_inp.size() >= 32 && kcpp_cpu_has_blas() && kcpp_data->n_batch>=32);
 
+    if((int)current_context_tokens.size() > n_past)
+    {
+        kcpp_metric_add("kcpp_kv_purge_total", "Requests that discarded diverged tokens from the KV cache.", 1);
+        kcpp_metric_add("kcpp_kv_purge_tokens_total", "Diverged tokens discarded from the KV cache.", current_context_tokens.size() - n_past);
+    }
     current_context_tokens.resize(n_past);
+    last_fastforward_count = n_past;
+    last_input_count = n_past + embd_inp.size();
+    kcpp_metric_observe("kcpp_prompt_tokens", "Prompt length of a request in tokens.", last_input_count, KCPP_METRIC_TOKENS);
+    kcpp_metric_observe("kcpp_fastforward_tokens", "Prompt tokens of a request reused from the previous context.", last_fastforward_count, KCPP_METRIC_TOKENS);
 
     remaining_tokens = kcpp_data->n_predict;
     int input_consumed = 0;
+    int64_t sampler_time_us = 0;
     std::mt19937 rng(kcpp_data->seed);
 
     //prepare sampler order
@@ -3335,6 +4833,91 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     speculative_draft_result draft_results; //only use if drafting was used
     bool draft_used = false;
 
+    //num_outputs > 1 forks the processed prompt into extra kv sequences when sampling starts, then decodes them together
+    int extra_output_count = 0;
+    if(inputs.num_outputs > 1)
+    {
+        bool can_fork = (file_format == FileFormat::GGUF_GENERIC && !llama_model_is_recurrent(llama_get_model(llama_ctx_v4))
+        && file_format_meta.model_architecture != GGUFArch::ARCH_QWEN2VL && draft_ctx == nullptr
+        && banned_phrases.size() == 0 && kcpp_data->mirostat == 0);
+        if(!can_fork)
+        {
+            printf("\nWarning: num_outputs is not supported with this model or sampler configuration, only 1 output will be generated.\n");
+        }
+        else
+        {
+            extra_output_count = std::min(inputs.num_outputs, num_outputs_max) - 1;
+            const int prompt_total = n_past + embd_inp.size();
+            const int kv_total = llama_n_ctx(llama_ctx_v4);
+            while(extra_output_count > 0 && prompt_total + (extra_output_count + 1) * kcpp_data->n_predict > kv_total)
+            {
+                --extra_output_count;
+            }
+            if(extra_output_count + 1 < inputs.num_outputs)
+            {
+                printf("\nWarning: num_outputs reduced to %d to fit in the context.\n", extra_output_count + 1);
+            }
+        }
+    }
+
+    //samples one token for an extra output, with its own rng, penalty window and grammar state
+    auto sample_extra_stream = [&](kcpp_extra_stream & es, float * logitsPtr)
+    {
+        unsigned int eosID = GetEosID(file_format, n_vocab);
+        unsigned int eotID = GetEotID(file_format);
+        static const std::vector<int> no_temp_bans;
+
+        size_t picks_before = top_picks_history.size();
+        std::swap(last_n_tokens, es.last_n_tokens);
+        std::swap(current_context_tokens, es.context_tokens);
+        int id = SampleLogits(logitsPtr, nctx, n_vocab, last_n_size, kcpp_data->repeat_penalty, kcpp_data->rep_pen_slope, kcpp_data->presence_penalty,
+        kcpp_data->top_k, inputs.top_a, kcpp_data->top_p, kcpp_data->min_p, kcpp_data->typical_p, kcpp_data->tfs_z, kcpp_data->temp, es.rng,
+        kcpp_data->mirostat, kcpp_data->mirostat_tau, kcpp_data->mirostat_eta,
+        kcpp_data->dry_multiplier, kcpp_data->dry_base,
+        kcpp_data->dry_allowed_length, kcpp_data->dry_penalty_last_n, kcpp_data->xtc_threshold, kcpp_data->xtc_probability,
+        sampler_order, es.grammar, kcpp_data->dynatemp_range, kcpp_data->dynatemp_exponent, kcpp_data->smoothing_factor, no_temp_bans);
+        std::swap(current_context_tokens, es.context_tokens);
+        std::swap(last_n_tokens, es.last_n_tokens);
+        top_picks_history.resize(picks_before); //logprobs are only reported for the first output
+
+        if (es.grammar != nullptr) {
+            grammar_accept_token(file_format, n_vocab, es.grammar, id);
+        }
+        if (!es.last_n_tokens.empty())
+        {
+            es.last_n_tokens.erase(es.last_n_tokens.begin());
+        }
+        es.last_n_tokens.push_back(id);
+        es.context_tokens.push_back(id);
+        es.next_token = id;
+        es.remaining -= 1;
+
+        bool is_special_stop = VecContainsIntVal(special_stop_sequence,id);
+        std::string tokenizedstr = FileFormatTokenizeID(id, file_format, inputs.render_special);
+        if(!inputs.render_special && (id==eosID || (id==eotID && id!=-1) || is_special_stop))
+        {
+            tokenizedstr = "";
+        }
+        es.text += tokenizedstr;
+        bool stop_hit = false;
+        es.stop_state = stop_sequence_matcher.scan(es.stop_state, tokenizedstr, [&](int, size_t){ stop_hit = true; });
+
+        if((!inputs.bypass_eos_token && inputs.allow_eos_token && (id==eosID || (id==eotID && id!=-1))) || is_special_stop)
+        {
+            finish_extra_stream(es, stop_reason::EOS_TOKEN_HIT);
+            return;
+        }
+        if(stop_hit)
+        {
+            finish_extra_stream(es, stop_reason::CUSTOM_STOPPER);
+            return;
+        }
+        if(es.remaining <= 0)
+        {
+            finish_extra_stream(es, stop_reason::OUT_OF_TOKENS);
+        }
+    };
+
     time0 = timer_check();
     timer_start();
 
@@ -3391,6 +4974,18 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         printf("%s\n\n", RemoveBell(outstr).c_str());
     }
 
+    //antislop rewinds the output text as it goes, so it keeps the text handling in line with sampling
+    const bool use_async_output = (async_output && banned_phrases.size()==0);
+    struct output_worker_scope
+    {
+        bool active;
+        ~output_worker_scope() { if(active) { output_worker_stop(); } }
+    } async_output_scope = {use_async_output};
+    if(use_async_output)
+    {
+        output_worker_start();
+    }
+
     while (remaining_tokens > 0 && !early_abort)
     {
         gpt_vocab::id id = 0;
@@ -3406,6 +5001,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         if (embdsize > 0)
         {
             bool evalres = false;
+            int64_t eval_start_us = ggml_time_us();
             if (file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2)
             {
                 evalres = (llama_v2_eval(llama_ctx_v2, embd.data(), embdsize, n_past, GetThreadsToUse(blasmode))==0);
@@ -3420,11 +5016,26 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 {
                     draft_used = false;
                     bool use_mrope = (file_format==FileFormat::GGUF_GENERIC && file_format_meta.model_architecture == GGUFArch::ARCH_QWEN2VL);
-                    kcpp_embd_batch batch = kcpp_embd_batch(embd, n_past, use_mrope, false);
-                    evalres = (llama_decode(llama_ctx_v4, batch.batch)==0);
-                    if(draft_ctx)
+                    if(embd.size()==1 && startedsampling && live_extra_streams() > 0)
+                    {
+                        //main sequence is always the first row, so llama_get_logits below still reads its logits
+                        evalres = decode_extra_streams(embd[0], n_past);
+                        for(auto & es : extra_streams)
+                        {
+                            if(evalres && !es.finished)
+                            {
+                                sample_extra_stream(es, llama_get_logits_ith(llama_ctx_v4, es.batch_idx));
+                            }
+                        }
+                    }
+                    else
                     {
-                        evalres = (evalres && (llama_decode(draft_ctx, batch.batch)==0));
+                        kcpp_embd_batch batch = kcpp_embd_batch(embd, n_past, use_mrope, false);
+                        evalres = (llama_decode(llama_ctx_v4, batch.batch)==0);
+                        if(draft_ctx)
+                        {
+                            evalres = (evalres && (llama_decode(draft_ctx, batch.batch)==0));
+                        }
                     }
                 } else { //individual tokens AND speculative is used (generation)
                     draft_used = true;
@@ -3512,11 +5123,31 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 generation_finished = true;
                 return output;
             }
+            double eval_sec = (ggml_time_us() - eval_start_us) / 1000000.0;
+            if(startedsampling)
+            {
+                kcpp_metric_observe("kcpp_decode_seconds", "Time of a decode step during generation.", eval_sec, KCPP_METRIC_SECONDS);
+            }
+            else
+            {
+                kcpp_metric_observe("kcpp_prompt_eval_batch_seconds", "Time of a prompt processing batch.", eval_sec, KCPP_METRIC_SECONDS);
+                kcpp_metric_add("kcpp_prompt_eval_tokens_total", "Prompt tokens processed.", embdsize);
+            }
         }
 
         n_past += embd.size();
         embd.clear();
 
+        if((file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2) && embdsize > 0 && n_past==(int)current_context_tokens.size())
+        {
+            //one token before the end of the prompt, so that sending the same prompt again only evaluates its last token
+            const bool prompt_end = (!startedsampling && (int)embd_inp.size() - input_consumed == 1);
+            if(prompt_end || n_past % rwkv_ckpt_interval == 0)
+            {
+                rwkv_ckpt_save(current_context_tokens, n_past);
+            }
+        }
+
         if (!early_abort && (int)embd_inp.size() <= input_consumed) //if decoding was aborted, DO NOT perform any sampling
         {
             // out of user input, sample next token
@@ -3547,8 +5178,6 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             unsigned int eosID = GetEosID(file_format, n_vocab);
             unsigned int eotID = GetEotID(file_format);
             float * logitsPtr;
-            float lowestLogit = 0;
-            int btsize = banned_token_ids.size();
 
             //sample pending logits. usually only 1, unless speculative decoding
             int logits_to_sample = 1;
@@ -3560,6 +5189,13 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             }
             while(logits_sampled<logits_to_sample && remaining_tokens>0 && !abort_draft && !early_abort)
             {
+                //the previous token's text was handled while this one decoded, stop here if it completed a stop sequence
+                if(use_async_output && output_worker_wait())
+                {
+                    early_abort = true;
+                    last_stop_reason = stop_reason::CUSTOM_STOPPER;
+                    break;
+                }
                 if(logits_sampled>0)
                 {
                     //this is not the first loop, so we need to increment some things
@@ -3586,49 +5222,48 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     {
                         logitsPtr = llama_v2_get_logits(llama_ctx_v2);
                     }
-                    lowestLogit = LowestLogit(logitsPtr,n_vocab);
                 }
                 else
                 {
                     logitsPtr = logits.data(); //legacy rwkv, neox, gptj etc
-                    lowestLogit = LowestLogit(logits);
                 }
 
-                if (!inputs.allow_eos_token && !inputs.bypass_eos_token)
-                {
-                    // set the logit of the eos token to very low to avoid sampling it
-                    if(eosID!=LLAMA_TOKEN_NULL)
-                    {
-                        logitsPtr[eosID] = lowestLogit;
-                    }
-                    if(eotID!=-1)
-                    {
-                        logitsPtr[eotID] = lowestLogit;
-                    }
-                }
-                if(btsize>0)
+                //handle temp bans from antislop, the eos and banned token suppression is in logit_mask
+                static const std::vector<int> no_temp_bans;
+                auto antislop_bans = antislop_banned_token_ids.find(n_past);
+                const std::vector<int> & temp_bans = (antislop_bans != antislop_banned_token_ids.end() ? antislop_bans->second : no_temp_bans);
+
+                if(extra_output_count > 0 && extra_streams.empty())
                 {
-                    for(int t=0;t<btsize;++t)
+                    //fork the prompt for the extra outputs before the main sequence consumes these logits
+                    for(int k=1;k<=extra_output_count;++k)
                     {
-                        logitsPtr[banned_token_ids[t]]=lowestLogit;
+                        kcpp_extra_stream es;
+                        es.seq_id = k;
+                        es.rng = std::mt19937(kcpp_data->seed + k);
+                        es.last_n_tokens = last_n_tokens;
+                        es.context_tokens = current_context_tokens;
+                        es.grammar = (grammar ? llama_grammar_clone_impl(*grammar) : nullptr);
+                        es.n_past = n_past;
+                        es.remaining = remaining_tokens;
+                        llama_kv_cache_seq_rm(llama_ctx_v4, k, -1, -1);
+                        llama_kv_cache_seq_cp(llama_ctx_v4, 0, k, -1, -1);
+                        extra_streams.push_back(es);
                     }
-                }
-
-                //handle temp bans from antislop
-                if (antislop_banned_token_ids.find(n_past) != antislop_banned_token_ids.end()) {
-                    std::vector<int>& bans = antislop_banned_token_ids[n_past];
-                    for(int t=0;t<bans.size();++t)
+                    for(auto & es : extra_streams)
                     {
-                        logitsPtr[bans[t]]=lowestLogit;
+                        sample_extra_stream(es, logitsPtr);
                     }
                 }
 
+                int64_t sample_start_us = ggml_time_us();
                 id = SampleLogits(logitsPtr, nctx, n_vocab, last_n_size, repeat_penalty, kcpp_data->rep_pen_slope, presence_penalty,
                 top_k, top_a, top_p, min_p, typical_p, tfs_z, temp, rng,
                 kcpp_data->mirostat, kcpp_data->mirostat_tau, kcpp_data->mirostat_eta,
                 kcpp_data->dry_multiplier, kcpp_data->dry_base,
                 kcpp_data->dry_allowed_length, kcpp_data->dry_penalty_last_n, kcpp_data->xtc_threshold, kcpp_data->xtc_probability,
-                sampler_order, grammar, dynatemp_range, dynatemp_exponent, smoothing_factor);
+                sampler_order, grammar, dynatemp_range, dynatemp_exponent, smoothing_factor, temp_bans);
+                sampler_time_us += ggml_time_us() - sample_start_us;
 
                 if(draft_used)
                 {
@@ -3639,14 +5274,21 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                         std::string realtok = FileFormatTokenizeID(id, file_format, true);
                         printf("(Draft %d/%d): Predicted=%d (%s), Actual=%d (%s) [%s]\n",(logits_sampled+1),logits_to_sample,draftedid,drafttok.c_str(),id,realtok.c_str(),(draftedid==id?"PASS":"FAIL"));
                     }
+                    kcpp_metric_add("kcpp_draft_tokens_total", "Drafted tokens checked against the main model.", 1);
                     if(draftedid!=id) //draft mismatch, abort
                     {
                         abort_draft = true;
                     }
+                    else
+                    {
+                        kcpp_metric_add("kcpp_draft_accepted_tokens_total", "Drafted tokens accepted by the main model.", 1);
+                    }
                 }
 
                 if (grammar != nullptr) {
+                    int64_t accept_start_us = ggml_time_us();
                     grammar_accept_token(file_format, n_vocab, grammar, id);
+                    sample_stage_us[SAMPLE_STAGE_GRAMMAR_ACCEPT] += ggml_time_us() - accept_start_us;
                 }
 
                 if (!last_n_tokens.empty())
@@ -3663,28 +5305,26 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 // decrement remaining sampling budget
                 --remaining_tokens;
 
-                for (auto eid : embd)
+                //extra filter to avoid unwanted special tokens
+                const bool hide_token = (!inputs.render_special && (id==eosID || (id==eotID && id!=-1) || VecContainsIntVal(special_stop_sequence,id)));
+                if(use_async_output)
                 {
-                    std::string tokenizedstr = FileFormatTokenizeID(eid, file_format, inputs.render_special);
-                    if(!inputs.render_special && (eid==eosID || (eid==eotID && eid!=-1) || VecContainsIntVal(special_stop_sequence,id))) //extra filter to avoid unwanted special tokens
-                    {
-                        tokenizedstr = ""; //prevent render
-                    }
-
-                    delayed_generated_tokens.push_back(tokenizedstr);
-                    while(delayed_generated_tokens.size() > delayed_generated_tokens_limit && delayed_generated_tokens.size() > 0)
-                    {
-                        generated_tokens.push_back(delayed_generated_tokens[0]);
-                        concat_output_mtx.lock();
-                        concat_output += delayed_generated_tokens[0];
-                        concat_output_mtx.unlock();
-                        delayed_generated_tokens.pop_front();
-                    }
+                    kcpp_output_job job;
+                    job.id = id;
+                    job.hide = hide_token;
+                    job.render_special = inputs.render_special;
+                    job.print_progress = (startedsampling && allow_regular_prints);
+                    job.generated = kcpp_data->n_predict - remaining_tokens;
+                    job.n_predict = kcpp_data->n_predict;
+                    output_worker_submit(job);
                 }
-
-                if (startedsampling && allow_regular_prints)
+                else
                 {
-                    printf("\rGenerating (%d / %d tokens)", (kcpp_data->n_predict - remaining_tokens), kcpp_data->n_predict);
+                    OutputGeneratedToken(id, hide_token, inputs.render_special);
+                    if (startedsampling && allow_regular_prints)
+                    {
+                        printf("\rGenerating (%d / %d tokens)", (kcpp_data->n_predict - remaining_tokens), kcpp_data->n_predict);
+                    }
                 }
                 if(debugmode==1 && !is_quiet && top_picks_history.size()>0)
                 {
@@ -3710,56 +5350,68 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 }
 
                 //anti slop detection
-                if (banned_phrases.size() > 0)
+                if (banned_phrases.size() > 0 && delayed_generated_tokens.size() > 0)
                 {
-                    std::string scanstr = "";
+                    //the text before this token was already clean, so a banned phrase can only end inside the newest token.
+                    //prefer the first listed phrase, and its latest start within the window so the fewest tokens are rewound
+                    size_t window_len = 0;
                     for (int i = 0; i < delayed_generated_tokens.size(); ++i)
                     {
-                        scanstr += delayed_generated_tokens[i];
+                        window_len += delayed_generated_tokens[i].size();
                     }
-                    scanstr = toLowerCase(scanstr);
-                    for (const auto &matched : banned_phrases)
-                    {
-                        std::string matched_lower = toLowerCase(matched);
-                        if (scanstr.find(matched_lower) != std::string::npos)
+                    const std::string & newtext = delayed_generated_tokens.back();
+                    const size_t newtext_begin = window_len - newtext.size();
+                    int found = -1;
+                    size_t found_start = 0;
+                    banned_phrase_state = banned_phrase_matcher.scan(banned_phrase_state, newtext, [&](int p, size_t end){
+                        size_t len = banned_phrase_matcher.phrase_len[p];
+                        if (newtext_begin + end >= len)
                         {
-                            //find the position in the string that contains all necessary tokens
-                            std::string checkstr = "";
-                            int rewind_amt = 0;
-                            for (int i = delayed_generated_tokens.size() - 1; i >= 0; --i)
+                            size_t start = newtext_begin + end - len;
+                            if (found < 0 || p < found || (p == found && start > found_start))
                             {
-                                checkstr = delayed_generated_tokens[i] + checkstr;
-                                ++rewind_amt;
-                                if (toLowerCase(checkstr).find(matched_lower) != std::string::npos)
-                                {
-                                    break;
-                                }
+                                found = p;
+                                found_start = start;
                             }
-                            if (rewind_amt > 0 && (current_context_tokens.size() - rewind_amt) > 0)
+                        }
+                    });
+                    if (found >= 0)
+                    {
+                        //find the position in the string that contains all necessary tokens
+                        size_t tokstart = window_len;
+                        int rewind_amt = 0;
+                        for (int i = delayed_generated_tokens.size() - 1; i >= 0 && tokstart > found_start; --i)
+                        {
+                            tokstart -= delayed_generated_tokens[i].size();
+                            ++rewind_amt;
+                        }
+                        if (rewind_amt > 0 && (current_context_tokens.size() - rewind_amt) > 0)
+                        {
+                            int last_tok = current_context_tokens[current_context_tokens.size() - rewind_amt];
+                            delayed_generated_tokens.resize(delayed_generated_tokens.size() - rewind_amt);
+                            ContextRewind(embd, current_context_tokens, n_past, last_n_tokens, rewind_amt);
+                            banned_phrase_state = 0;
+                            for (int i = 0; i < delayed_generated_tokens.size(); ++i)
                             {
-                                int last_tok = current_context_tokens[current_context_tokens.size() - rewind_amt];
-                                delayed_generated_tokens.resize(delayed_generated_tokens.size() - rewind_amt);
-                                ContextRewind(embd, current_context_tokens, n_past, last_n_tokens, rewind_amt);
-
-                                //immediately terminate drafting if used
-                                abort_draft = true;
+                                banned_phrase_state = banned_phrase_matcher.scan(banned_phrase_state, delayed_generated_tokens[i], [](int, size_t){});
+                            }
 
-                                // Check if the key exists
-                                int banindex = n_past+1;
-                                if (antislop_banned_token_ids.find(banindex) == antislop_banned_token_ids.end()) {
-                                    antislop_banned_token_ids[banindex] = std::vector<int>();
-                                }
-                                std::vector<int>& current_ids = antislop_banned_token_ids[banindex];
-                                current_ids.push_back(last_tok);
+                            //immediately terminate drafting if used
+                            abort_draft = true;
 
-                                if (allow_regular_prints && debugmode == 1)
-                                {
-                                    auto match_clean = matched;
-                                    replace_all(match_clean, "\n", "\\n");
-                                    printf("\n(Banned Phrase Detected: %s - Add ID %d to banlist at index %d, and rewinding %d tokens)\n", match_clean.c_str(), last_tok, banindex, rewind_amt);
-                                }
+                            // Check if the key exists
+                            int banindex = n_past+1;
+                            if (antislop_banned_token_ids.find(banindex) == antislop_banned_token_ids.end()) {
+                                antislop_banned_token_ids[banindex] = std::vector<int>();
+                            }
+                            std::vector<int>& current_ids = antislop_banned_token_ids[banindex];
+                            current_ids.push_back(last_tok);
 
-                                break;
+                            if (allow_regular_prints && debugmode == 1)
+                            {
+                                auto match_clean = banned_phrases[found];
+                                replace_all(match_clean, "\n", "\\n");
+                                printf("\n(Banned Phrase Detected: %s - Add ID %d to banlist at index %d, and rewinding %d tokens)\n", match_clean.c_str(), last_tok, banindex, rewind_amt);
                             }
                         }
                     }
@@ -3795,23 +5447,10 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     }
                 }
 
-                if(!early_abort)
+                if(!early_abort && !use_async_output && CheckStopSequences(allow_regular_prints))
                 {
-                    for (const auto &matched : stop_sequence)
-                    {
-                        if (concat_output.find(matched) != std::string::npos)
-                        {
-                            early_abort = true;
-                            if(allow_regular_prints)
-                            {
-                                auto match_clean = matched;
-                                replace_all(match_clean, "\n", "\\n");
-                                printf("\n(Stop sequence triggered: %s)", match_clean.c_str());
-                            }
-                            last_stop_reason = stop_reason::CUSTOM_STOPPER;
-                            break;
-                        }
-                    }
+                    early_abort = true;
+                    last_stop_reason = stop_reason::CUSTOM_STOPPER;
                 }
 
                 logits_sampled += 1;
@@ -3935,6 +5574,55 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
+    if(use_async_output)
+    {
+        if(output_worker_wait() && last_stop_reason==stop_reason::OUT_OF_TOKENS)
+        {
+            last_stop_reason = stop_reason::CUSTOM_STOPPER;
+        }
+        output_worker_stop();
+    }
+
+    //main output is done, let the other outputs run to their own stop unless the generation was aborted
+    if(live_extra_streams() > 0)
+    {
+        if(!early_abort || last_stop_reason != stop_reason::OUT_OF_TOKENS)
+        {
+            early_abort = false;
+            while(live_extra_streams() > 0 && !early_abort)
+            {
+                if(!decode_extra_streams(-1, 0))
+                {
+                    fprintf(stderr, "\nFailed to predict extra outputs!\n");
+                    break;
+                }
+                for(auto & es : extra_streams)
+                {
+                    if(!es.finished)
+                    {
+                        sample_extra_stream(es, llama_get_logits_ith(llama_ctx_v4, es.batch_idx));
+                    }
+                }
+            }
+        }
+        for(auto & es : extra_streams)
+        {
+            if(!es.finished)
+            {
+                finish_extra_stream(es, stop_reason::OUT_OF_TOKENS);
+            }
+        }
+    }
+    for(auto & es : extra_streams)
+    {
+        extra_outputs.push_back(es.text);
+        extra_output_stopreasons.push_back((int)es.reason);
+    }
+    if(!extra_streams.empty())
+    {
+        compact_kv_cache(llama_ctx_v4);
+    }
+
     //flush any remaining delayed tokens
     while(delayed_generated_tokens.size() > 0)
     {
@@ -3945,6 +5633,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         delayed_generated_tokens.pop_front();
     }
 
+    if(file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
+    {
+        //the last sampled token was never evaluated, the state ends at n_past. this is where the next turn continues
+        rwkv_ckpt_save(current_context_tokens, n_past);
+    }
+
     if(debugmode==1 && !is_quiet && file_format == FileFormat::GGUF_GENERIC)
     {
         printf("\n");
@@ -3968,6 +5662,17 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     last_eval_time = pt2;
     last_process_time = pt1;
     last_token_count = realnpredict;
+    last_sampler_time = sampler_time_us / 1000000.0f;
+    for(int i=0;i<SAMPLE_STAGE_COUNT;++i)
+    {
+        if(sample_stage_us[i] > 0)
+        {
+            kcpp_metric_add("kcpp_sampler_seconds_total", "Time spent in each sampling stage.", sample_stage_us[i] / 1000000.0, std::string("sampler=\"") + sample_stage_names[i] + "\"");
+            sample_stage_us[i] = 0;
+        }
+    }
+    kcpp_metric_add("kcpp_generations_total", "Completed text generations.", 1);
+    kcpp_metric_add("kcpp_generated_tokens_total", "Tokens generated.", realnpredict);
     last_seed = kcpp_data->seed;
     total_gens += 1;
     concat_output_mtx.lock();
@@ -345,6 +345,7 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool kv_paged;    // back the CPU KV cache with memory only as its cells are used
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
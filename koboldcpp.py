@@ -127,6 +127,10 @@ class logit_bias(ctypes.Structure):
     _fields_ = [("token_id", ctypes.c_int32),
                 ("bias", ctypes.c_float)]
 
+class lora_selection(ctypes.Structure):
+    _fields_ = [("adapter_id", ctypes.c_int32),
+                ("scale", ctypes.c_float)]
+
 class token_count_outputs(ctypes.Structure):
     _fields_ = [("count", ctypes.c_int),
                 ("ids", ctypes.POINTER(ctypes.c_int))]
@@ -153,6 +157,8 @@ class load_model_inputs(ctypes.Structure):
                 ("model_filename", ctypes.c_char_p),
                 ("lora_filename", ctypes.c_char_p),
                 ("lora_base", ctypes.c_char_p),
+                ("lora_adapters_len", ctypes.c_int),
+                ("lora_adapters", ctypes.POINTER(ctypes.c_char_p)),
                 ("draftmodel_filename", ctypes.c_char_p),
                 ("draft_amount", ctypes.c_int),
                 ("draft_gpulayers", ctypes.c_int),
@@ -164,6 +170,9 @@ class load_model_inputs(ctypes.Structure):
                 ("use_smartcontext", ctypes.c_bool),
                 ("use_contextshift", ctypes.c_bool),
                 ("use_fastforward", ctypes.c_bool),
+                ("sink_tokens", ctypes.c_int),
+                ("async_output", ctypes.c_bool),
+                ("paged_kv", ctypes.c_bool),
                 ("clblast_info", ctypes.c_int),
                 ("cublas_info", ctypes.c_int),
                 ("vulkan_info", ctypes.c_char_p),
@@ -173,8 +182,14 @@ class load_model_inputs(ctypes.Structure):
                 ("rope_freq_scale", ctypes.c_float),
                 ("rope_freq_base", ctypes.c_float),
                 ("moe_experts", ctypes.c_int),
+                ("model_pool_len", ctypes.c_int),
+                ("model_pool", ctypes.POINTER(ctypes.c_char_p)),
+                ("model_pool_budget_mb", ctypes.c_int),
+                ("kv_tier_ram_mb", ctypes.c_int),
+                ("kv_tier_dir", ctypes.c_char_p),
                 ("flash_attention", ctypes.c_bool),
                 ("tensor_split", ctypes.c_float * tensor_split_max),
+                ("rpc_servers", ctypes.c_char_p),
                 ("quant_k", ctypes.c_int),
                 ("quant_v", ctypes.c_int),
                 ("quiet", ctypes.c_bool),
@@ -225,7 +240,13 @@ class generation_inputs(ctypes.Structure):
                 ("logit_biases_len", ctypes.c_int),
                 ("logit_biases", ctypes.POINTER(logit_bias)),
                 ("banned_tokens_len", ctypes.c_int),
-                ("banned_tokens", ctypes.POINTER(ctypes.c_char_p))]
+                ("banned_tokens", ctypes.POINTER(ctypes.c_char_p)),
+                ("model_name", ctypes.c_char_p),
+                ("lora_selections_len", ctypes.c_int),
+                ("lora_selections", ctypes.POINTER(lora_selection)),
+                ("num_outputs", ctypes.c_int),
+                ("image_buffers", ctypes.c_char_p * images_max),
+                ("image_buffer_lens", ctypes.c_int * images_max)]
 
 class generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
@@ -242,6 +263,7 @@ class sd_load_model_inputs(ctypes.Structure):
                 ("vulkan_info", ctypes.c_char_p),
                 ("threads", ctypes.c_int),
                 ("quant", ctypes.c_int),
+                ("quant_cache_dir", ctypes.c_char_p),
                 ("taesd", ctypes.c_bool),
                 ("notile", ctypes.c_bool),
                 ("t5xxl_filename", ctypes.c_char_p),
@@ -264,11 +286,15 @@ class sd_generation_inputs(ctypes.Structure):
                 ("height", ctypes.c_int),
                 ("seed", ctypes.c_int),
                 ("sample_method", ctypes.c_char_p),
-                ("clip_skip", ctypes.c_int)]
+                ("clip_skip", ctypes.c_int),
+                ("step_cache_threshold", ctypes.c_float),
+                ("step_cache_max_skip", ctypes.c_int)]
 
 class sd_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
-                ("data", ctypes.c_char_p)]
+                ("data", ctypes.c_char_p),
+                ("raw_data", ctypes.POINTER(ctypes.c_ubyte)),
+                ("raw_data_len", ctypes.c_int)]
 
 class whisper_load_model_inputs(ctypes.Structure):
     _fields_ = [("model_filename", ctypes.c_char_p),
@@ -283,12 +309,30 @@ class whisper_generation_inputs(ctypes.Structure):
     _fields_ = [("prompt", ctypes.c_char_p),
                 ("audio_data", ctypes.c_char_p),
                 ("suppress_non_speech", ctypes.c_bool),
-                ("langcode", ctypes.c_char_p)]
+                ("langcode", ctypes.c_char_p),
+                ("audio_buffer", ctypes.c_char_p),
+                ("audio_buffer_len", ctypes.c_int)]
 
 class whisper_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
                 ("data", ctypes.c_char_p)]
 
+class whisper_stream_inputs(ctypes.Structure):
+    _fields_ = [("session_id", ctypes.c_char_p),
+                ("prompt", ctypes.c_char_p),
+                ("pcm_data", ctypes.c_char_p),
+                ("pcm_bytes", ctypes.c_int),
+                ("sample_rate", ctypes.c_int),
+                ("suppress_non_speech", ctypes.c_bool),
+                ("langcode", ctypes.c_char_p),
+                ("reset_session", ctypes.c_bool),
+                ("final_chunk", ctypes.c_bool)]
+
+class whisper_stream_outputs(ctypes.Structure):
+    _fields_ = [("status", ctypes.c_int),
+                ("committed", ctypes.c_char_p),
+                ("partial", ctypes.c_char_p)]
+
 class tts_load_model_inputs(ctypes.Structure):
     _fields_ = [("threads", ctypes.c_int),
                 ("ttc_model_filename", ctypes.c_char_p),
@@ -310,7 +354,9 @@ class tts_generation_inputs(ctypes.Structure):
 
 class tts_generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
-                ("data", ctypes.c_char_p)]
+                ("data", ctypes.c_char_p),
+                ("raw_data", ctypes.POINTER(ctypes.c_ubyte)),
+                ("raw_data_len", ctypes.c_int)]
 
 def getdirpath():
     return os.path.dirname(os.path.realpath(__file__))
@@ -465,8 +511,12 @@ def init_library():
     handle.get_total_gens.restype = ctypes.c_int
     handle.get_last_stop_reason.restype = ctypes.c_int
     handle.abort_generate.restype = ctypes.c_bool
+    handle.get_metrics.restype = ctypes.c_char_p
     handle.token_count.restype = token_count_outputs
     handle.get_pending_output.restype = ctypes.c_char_p
+    handle.get_extra_output_count.restype = ctypes.c_int
+    handle.get_extra_output.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+    handle.get_extra_output.restype = ctypes.c_char_p
     handle.get_chat_template.restype = ctypes.c_char_p
     handle.sd_load_model.argtypes = [sd_load_model_inputs]
     handle.sd_load_model.restype = ctypes.c_bool
@@ -476,6 +526,8 @@ def init_library():
     handle.whisper_load_model.restype = ctypes.c_bool
     handle.whisper_generate.argtypes = [whisper_generation_inputs]
     handle.whisper_generate.restype = whisper_generation_outputs
+    handle.whisper_stream.argtypes = [whisper_stream_inputs]
+    handle.whisper_stream.restype = whisper_stream_outputs
     handle.tts_load_model.argtypes = [tts_load_model_inputs]
     handle.tts_load_model.restype = ctypes.c_bool
     handle.tts_generate.argtypes = [tts_generation_inputs]
@@ -545,6 +597,12 @@ def end_trim_to_sentence(input_text):
         return input_text[:last + 1].strip()
     return input_text.strip()
 
+def try_b64decode(b64str): #decode base64 payloads at the http edge, so raw bytes cross into the library
+    try:
+        return base64.b64decode(b64str, validate=True) if b64str else b''
+    except Exception:
+        return b''
+
 def tryparseint(value):
     try:
         return int(value)
@@ -1060,6 +1118,11 @@ def load_model(model_filename):
         inputs.use_mmap = False
         if len(args.lora) > 1:
             inputs.lora_base = args.lora[1].encode("UTF-8")
+    loraadapters = args.loraadapter if args.loraadapter else []
+    inputs.lora_adapters_len = len(loraadapters)
+    inputs.lora_adapters = (ctypes.c_char_p * inputs.lora_adapters_len)()
+    for n, lorafile in enumerate(loraadapters):
+        inputs.lora_adapters[n] = lorafile.encode("UTF-8")
 
     inputs.draftmodel_filename = args.draftmodel.encode("UTF-8") if args.draftmodel else "".encode("UTF-8")
     inputs.draft_amount = args.draftamount
@@ -1074,6 +1137,9 @@ def load_model(model_filename):
     inputs.use_smartcontext = args.smartcontext
     inputs.use_contextshift = (0 if args.noshift else 1)
     inputs.use_fastforward = (0 if args.nofastforward else 1)
+    inputs.sink_tokens = (0 if args.sinktokens < 0 else args.sinktokens)
+    inputs.async_output = args.asyncoutput
+    inputs.paged_kv = args.pagedkv
     inputs.flash_attention = args.flashattention
     if args.quantkv>0:
         inputs.quant_k = inputs.quant_v = args.quantkv
@@ -1095,8 +1161,17 @@ def load_model(model_filename):
             inputs.tensor_split[n] = float(args.tensor_split[n])
         else:
             inputs.tensor_split[n] = 0
+    inputs.rpc_servers = (args.rpc if args.rpc else "").encode("UTF-8")
 
     inputs.moe_experts = args.moeexperts
+    modelpool = args.modelpool if args.modelpool else []
+    inputs.model_pool_len = len(modelpool)
+    inputs.model_pool = (ctypes.c_char_p * inputs.model_pool_len)()
+    for n, mdl in enumerate(modelpool):
+        inputs.model_pool[n] = os.path.abspath(mdl).encode("UTF-8")
+    inputs.model_pool_budget_mb = args.modelpoolbudget
+    inputs.kv_tier_ram_mb = args.kvtier
+    inputs.kv_tier_dir = (os.path.abspath(args.kvtierdir) if args.kvtierdir else "").encode("UTF-8")
     inputs = set_backend_props(inputs)
     ret = handle.load_model(inputs)
     return ret
@@ -1158,10 +1233,15 @@ def generate(genparams, stream_flag=False):
     inputs.prompt = prompt.encode("UTF-8")
     inputs.memory = memory.encode("UTF-8")
     for n in range(images_max):
-        if not images or n >= len(images):
-            inputs.images[n] = "".encode("UTF-8")
-        else:
-            inputs.images[n] = images[n].encode("UTF-8")
+        inputs.images[n] = "".encode("UTF-8")
+        inputs.image_buffer_lens[n] = 0
+        if images and n < len(images):
+            imgbytes = try_b64decode(images[n])
+            if imgbytes:
+                inputs.image_buffers[n] = imgbytes
+                inputs.image_buffer_lens[n] = len(imgbytes)
+            else:
+                inputs.images[n] = images[n].encode("UTF-8")
     global showmaxctxwarning
     if max_context_length > maxctx:
         if showmaxctxwarning:
@@ -1280,6 +1360,25 @@ def generate(genparams, stream_flag=False):
     inputs.banned_tokens = (ctypes.c_char_p * inputs.banned_tokens_len)()
     for n, tok in enumerate(banned_tokens):
         inputs.banned_tokens[n] = tok.encode("UTF-8")
+    inputs.model_name = str(genparams.get('model', "")).encode("UTF-8")
+
+    # runtime lora adapters, given as a list of {"name" or "id", "scale"}
+    lora_list = genparams.get('lora', [])
+    if not isinstance(lora_list, list):
+        lora_list = []
+    loranames = [os.path.splitext(os.path.basename(lf))[0] for lf in (args.loraadapter if args.loraadapter else [])]
+    selections = []
+    for sel in lora_list:
+        try:
+            if "name" in sel and sel["name"] in loranames:
+                selections.append(lora_selection(loranames.index(sel["name"]), float(sel.get("scale", 1.0))))
+            elif "id" in sel:
+                selections.append(lora_selection(int(sel["id"]), float(sel.get("scale", 1.0))))
+        except Exception as ex:
+            print(f"Skipped unparsable lora selection:{ex}")
+    inputs.lora_selections_len = len(selections)
+    inputs.lora_selections = (lora_selection * inputs.lora_selections_len)(*selections)
+    inputs.num_outputs = 1 if stream_flag else max(1, int(genparams.get('num_outputs', genparams.get('n', 1))))
 
     currentusergenkey = genkey
     totalgens += 1
@@ -1294,12 +1393,22 @@ def generate(genparams, stream_flag=False):
         outstr = ""
         if ret.status==1:
             outstr = ret.text.decode("UTF-8","ignore")
+        extra_outputs = []
+        if ret.status==1:
+            for i in range(handle.get_extra_output_count()):
+                extrareason = ctypes.c_int(0)
+                extrastr = handle.get_extra_output(i, ctypes.byref(extrareason)).decode("UTF-8","ignore")
+                extra_outputs.append({"text":extrastr,"stopreason":extrareason.value})
         if trimstop:
             for trim_str in stop_sequence:
                 sindex = outstr.find(trim_str)
                 if sindex != -1 and trim_str!="":
                     outstr = outstr[:sindex]
-        return {"text":outstr,"status":ret.status,"stopreason":ret.stopreason,"prompt_tokens":ret.prompt_tokens, "completion_tokens": ret.completion_tokens}
+                for eo in extra_outputs:
+                    sindex = eo["text"].find(trim_str)
+                    if sindex != -1 and trim_str!="":
+                        eo["text"] = eo["text"][:sindex]
+        return {"text":outstr,"status":ret.status,"stopreason":ret.stopreason,"prompt_tokens":ret.prompt_tokens, "completion_tokens": ret.completion_tokens, "extra_outputs": extra_outputs}
 
 
 def sd_load_model(model_filename,vae_filename,lora_filename,t5xxl_filename,clipl_filename,clipg_filename):
@@ -1316,8 +1425,18 @@ def sd_load_model(model_filename,vae_filename,lora_filename,t5xxl_filename,clipl
     if args.sdquant:
         quant = 1
 
+    quant_cache_dir = ""
+    if quant and args.sdquantcache is not None:
+        quant_cache_dir = args.sdquantcache if args.sdquantcache else os.path.dirname(os.path.abspath(model_filename))
+        try:
+            os.makedirs(quant_cache_dir, exist_ok=True)
+        except Exception as e:
+            print(f"Cannot create SD quantized weights cache directory {quant_cache_dir}: {e}")
+            quant_cache_dir = ""
+
     inputs.threads = thds
     inputs.quant = quant
+    inputs.quant_cache_dir = quant_cache_dir.encode("UTF-8")
     inputs.taesd = True if args.sdvaeauto else False
     inputs.notile = True if args.sdnotile else False
     inputs.vae_filename = vae_filename.encode("UTF-8")
@@ -1353,7 +1472,7 @@ def sd_comfyui_tranform_params(genparams):
         print("Warning: ComfyUI Payload Missing!")
     return genparams
 
-def sd_generate(genparams):
+def sd_generate(genparams, raw_output=False):
     global maxctx, args, currentusergenkey, totalgens, pendingabortkey, chatcompl_adapter
 
     default_adapter = {} if chatcompl_adapter is None else chatcompl_adapter
@@ -1383,12 +1502,16 @@ def sd_generate(genparams):
     seed = tryparseint(genparams.get("seed", -1))
     sample_method = genparams.get("sampler_name", "k_euler_a")
     clip_skip = tryparseint(genparams.get("clip_skip", -1))
+    step_cache_threshold = float(genparams.get("step_cache_threshold", 0))
+    step_cache_max_skip = tryparseint(genparams.get("step_cache_max_skip", 2))
 
     #clean vars
     width = width - (width%64)
     height = height - (height%64)
     cfg_scale = (1 if cfg_scale < 1 else (25 if cfg_scale > 25 else cfg_scale))
     sample_steps = (1 if sample_steps < 1 else (80 if sample_steps > 80 else sample_steps))
+    step_cache_threshold = (0 if step_cache_threshold < 0 else (1 if step_cache_threshold > 1 else step_cache_threshold))
+    step_cache_max_skip = (0 if step_cache_max_skip < 0 else (8 if step_cache_max_skip > 8 else step_cache_max_skip))
     reslimit = 1024
     width = (64 if width < 64 else width)
     height = (64 if height < 64 else height)
@@ -1419,9 +1542,13 @@ def sd_generate(genparams):
     inputs.seed = seed
     inputs.sample_method = sample_method.lower().encode("UTF-8")
     inputs.clip_skip = clip_skip
+    inputs.step_cache_threshold = step_cache_threshold
+    inputs.step_cache_max_skip = step_cache_max_skip
     ret = handle.sd_generate(inputs)
     outstr = ""
     if ret.status==1:
+        if raw_output and ret.raw_data_len > 0:
+            return ctypes.string_at(ret.raw_data, ret.raw_data_len)
         outstr = ret.data.decode("UTF-8","ignore")
     return outstr
 
@@ -1442,7 +1569,13 @@ def whisper_generate(genparams):
         audio_data = audio_data.split(",", 1)[1]
     inputs = whisper_generation_inputs()
     inputs.prompt = prompt.encode("UTF-8")
-    inputs.audio_data = audio_data.encode("UTF-8")
+    wavbytes = try_b64decode(audio_data)
+    if wavbytes:
+        inputs.audio_buffer = wavbytes
+        inputs.audio_buffer_len = len(wavbytes)
+        inputs.audio_data = "".encode("UTF-8")
+    else:
+        inputs.audio_data = audio_data.encode("UTF-8")
     lc = genparams.get("langcode", genparams.get("language", "auto"))
     lc = lc.strip().lower() if (lc and lc.strip().lower()!="") else "auto"
     inputs.langcode = lc.encode("UTF-8")
@@ -1453,6 +1586,37 @@ def whisper_generate(genparams):
         outstr = ret.data.decode("UTF-8","ignore")
     return outstr
 
+def whisper_stream(genparams): #returns None if the request is malformed
+    global args
+    audio_data = genparams.get("audio_data", "")
+    if not isinstance(audio_data, str):
+        return None
+    if audio_data.startswith("data:audio"):
+        audio_data = audio_data.split(",", 1)[1]
+    pcm = try_b64decode(audio_data)
+    sample_rate = genparams.get("sample_rate", 16000)
+    sample_rate = tryparseint(sample_rate) if isinstance(sample_rate, (int, float, str)) else None
+    if (audio_data and not pcm) or not isinstance(sample_rate, int) or sample_rate <= 0:
+        return None
+    inputs = whisper_stream_inputs()
+    inputs.session_id = str(genparams.get("session", "")).encode("UTF-8")
+    inputs.prompt = genparams.get("prompt", "").encode("UTF-8")
+    inputs.pcm_data = pcm
+    inputs.pcm_bytes = len(pcm)
+    inputs.sample_rate = sample_rate
+    lc = genparams.get("langcode", genparams.get("language", "auto"))
+    lc = lc.strip().lower() if (lc and lc.strip().lower()!="") else "auto"
+    inputs.langcode = lc.encode("UTF-8")
+    inputs.suppress_non_speech = genparams.get("suppress_non_speech", False)
+    inputs.reset_session = genparams.get("reset", False)
+    inputs.final_chunk = genparams.get("final", False)
+    ret = handle.whisper_stream(inputs)
+    outdict = {"committed":"", "partial":""}
+    if ret.status==1:
+        outdict["committed"] = ret.committed.decode("UTF-8","ignore")
+        outdict["partial"] = ret.partial.decode("UTF-8","ignore")
+    return outdict
+
 def tts_load_model(ttc_model_filename,cts_model_filename):
     global args
     inputs = tts_load_model_inputs()
@@ -1471,7 +1635,7 @@ def tts_load_model(ttc_model_filename,cts_model_filename):
     ret = handle.tts_load_model(inputs)
     return ret
 
-def tts_generate(genparams):
+def tts_generate(genparams, raw_output=False):
     global args
     prompt = genparams.get("input", genparams.get("text", ""))
     prompt = prompt.strip()
@@ -1495,6 +1659,8 @@ def tts_generate(genparams):
     ret = handle.tts_generate(inputs)
     outstr = ""
     if ret.status==1:
+        if raw_output:
+            return ctypes.string_at(ret.raw_data, ret.raw_data_len) if ret.raw_data_len > 0 else b''
         outstr = ret.data.decode("UTF-8","ignore")
     return outstr
 
@@ -1502,7 +1668,7 @@ def tokenize_ids(countprompt,tcaddspecial):
     rawcountdata = handle.token_count(countprompt.encode("UTF-8"),tcaddspecial)
     countlimit = rawcountdata.count if (rawcountdata.count>=0 and rawcountdata.count<50000) else 0
     # the above protects the server in case the count limit got corrupted
-    countdata = [rawcountdata.ids[i] for i in range(countlimit)]
+    countdata = rawcountdata.ids[:countlimit] if countlimit > 0 else [] #slicing the pointer copies the ids in one pass
     return countdata
 
 def detokenize_ids(tokids):
@@ -2071,6 +2237,7 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         prompttokens = genout['prompt_tokens']
         comptokens = genout['completion_tokens']
         currfinishreason = ("length" if (genout['stopreason'] != 1) else "stop")
+        extraoutputs = genout.get('extra_outputs', [])
 
         # grab logprobs if not streaming
         logprobsdict = None
@@ -2087,11 +2254,13 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         utfprint("\nOutput: " + recvtxt,1)
 
         if api_format == 1:
-            res = {"data": {"seqs": [recvtxt]}}
+            res = {"data": {"seqs": [recvtxt]+[eo["text"] for eo in extraoutputs]}}
         elif api_format == 3:
             res = {"id": "cmpl-A1", "object": "text_completion", "created": int(time.time()), "model": friendlymodelname,
                    "usage": {"prompt_tokens": prompttokens, "completion_tokens": comptokens, "total_tokens": (prompttokens+comptokens)},
                    "choices": [{"text": recvtxt, "index": 0, "finish_reason": currfinishreason, "logprobs":logprobsdict}]}
+            for i, eo in enumerate(extraoutputs):
+                res["choices"].append({"text": eo["text"], "index": i+1, "finish_reason": ("length" if (eo["stopreason"] != 1) else "stop"), "logprobs":None})
         elif api_format == 4:
             using_openai_tools = genparams.get('using_openai_tools', False)
             tool_calls = []
@@ -2102,6 +2271,8 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
             res = {"id": "chatcmpl-A1", "object": "chat.completion", "created": int(time.time()), "model": friendlymodelname,
                    "usage": {"prompt_tokens": prompttokens, "completion_tokens": comptokens, "total_tokens": (prompttokens+comptokens)},
                    "choices": [{"index": 0, "message": {"role": "assistant", "content": recvtxt, "tool_calls": tool_calls}, "finish_reason": currfinishreason, "logprobs":logprobsdict}]}
+            for i, eo in enumerate(extraoutputs):
+                res["choices"].append({"index": i+1, "message": {"role": "assistant", "content": eo["text"], "tool_calls": []}, "finish_reason": ("length" if (eo["stopreason"] != 1) else "stop"), "logprobs":None})
         elif api_format == 5:
             res = {"caption": end_trim_to_sentence(recvtxt)}
         elif api_format == 6:
@@ -2112,6 +2283,8 @@ class KcppServerRequestHandler(http.server.SimpleHTTPRequestHandler):
             res = {"model": friendlymodelname,"created_at": str(datetime.now(timezone.utc).isoformat()),"message":{"role":"assistant","content":recvtxt},"done": True,"done_reason":currfinishreason,"total_duration": 1,"load_duration": 1,"prompt_eval_count": prompttokens,"prompt_eval_duration": 1,"eval_count": comptokens,"eval_duration": 1}
         else:
             res = {"results": [{"text": recvtxt, "finish_reason": currfinishreason, "logprobs":logprobsdict, "prompt_tokens": prompttokens, "completion_tokens": comptokens}]}
+            for eo in extraoutputs:
+                res["results"].append({"text": eo["text"], "finish_reason": ("length" if (eo["stopreason"] != 1) else "stop"), "logprobs":None, "prompt_tokens": prompttokens, "completion_tokens": 0})
 
         try:
             return res
@@ -2411,6 +2584,17 @@ Enter Prompt:<br>
                 opts = [f for f in sorted(os.listdir(dirpath)) if (f.endswith(".kcpps") or f.endswith(".kcppt")) and os.path.isfile(os.path.join(dirpath, f))]
             response_body = (json.dumps(opts).encode())
 
+        elif self.path=="/metrics" or self.path.startswith("/metrics?"): #prometheus text format
+            content_type = 'text/plain; version=0.0.4'
+            metrics = ctypes.string_at(handle.get_metrics()).decode("UTF-8","ignore")
+            metrics += "# HELP kcpp_queue_requests Requests waiting or running.\n# TYPE kcpp_queue_requests gauge\n"
+            metrics += f"kcpp_queue_requests {requestsinqueue}\n"
+            metrics += "# HELP kcpp_busy Whether a generation is in progress.\n# TYPE kcpp_busy gauge\n"
+            metrics += f"kcpp_busy {1 if modelbusy.locked() else 0}\n"
+            metrics += "# HELP kcpp_uptime_seconds Time since the server started.\n# TYPE kcpp_uptime_seconds gauge\n"
+            metrics += f"kcpp_uptime_seconds {time.time() - start_time:.3f}\n"
+            response_body = metrics.encode()
+
         elif self.path.endswith(('/api/extra/perf')):
             lastp = handle.get_last_process_time()
             laste = handle.get_last_eval_time()
@@ -2443,7 +2627,10 @@ Enter Prompt:<br>
             response_body = (json.dumps({"logprobs":logprobsdict}).encode())
 
         elif self.path.endswith('/v1/models'):
-            response_body = (json.dumps({"object":"list","data":[{"id":friendlymodelname,"object":"model","created":int(time.time()),"owned_by":"koboldcpp","permission":[],"root":"koboldcpp"}]}).encode())
+            modellist = [friendlymodelname]
+            if args.modelpool:
+                modellist += ["koboldcpp/" + os.path.splitext(os.path.basename(mdl))[0] for mdl in args.modelpool]
+            response_body = (json.dumps({"object":"list","data":[{"id":mdlname,"object":"model","created":int(time.time()),"owned_by":"koboldcpp","permission":[],"root":"koboldcpp"} for mdlname in modellist]}).encode())
 
         elif self.path.endswith('/sdapi/v1/sd-models'):
             if friendlysdmodelname=="inactive" or fullsdmodelpath=="":
@@ -2824,6 +3011,7 @@ Enter Prompt:<br>
             is_imggen = False
             is_comfyui_imggen = False
             is_transcribe = False
+            is_transcribe_stream = False
             is_tts = False
 
             if self.path.endswith('/request'):
@@ -2867,6 +3055,10 @@ Enter Prompt:<br>
             if self.path.endswith('/api/extra/transcribe') or self.path.endswith('/v1/audio/transcriptions'):
                 is_transcribe = True
 
+            if self.path.endswith('/api/extra/transcribe/stream'):
+                is_transcribe = True
+                is_transcribe_stream = True
+
             if self.path.endswith('/api/extra/tts') or self.path.endswith('/v1/audio/speech') or self.path.endswith('/tts_to_audio'):
                 is_tts = True
 
@@ -2935,13 +3127,10 @@ Enter Prompt:<br>
                         if is_comfyui_imggen:
                             lastgeneratedcomfyimg = b''
                             genparams = sd_comfyui_tranform_params(genparams)
-                        gen = sd_generate(genparams)
+                        gen = sd_generate(genparams, raw_output=is_comfyui_imggen)
                         genresp = None
                         if is_comfyui_imggen:
-                            if gen:
-                                lastgeneratedcomfyimg = base64.b64decode(gen)
-                            else:
-                                lastgeneratedcomfyimg = b''
+                            lastgeneratedcomfyimg = gen if gen else b''
                             genresp = (json.dumps({"prompt_id": "12345678-0000-0000-0000-000000000001","number": 0,"node_errors":{}}).encode())
                         else:
                             genresp = (json.dumps({"images":[gen],"parameters":{},"info":""}).encode())
@@ -2956,8 +3145,20 @@ Enter Prompt:<br>
                     return
                 elif is_transcribe:
                     try:
-                        gen = whisper_generate(genparams)
-                        genresp = (json.dumps({"text":gen}).encode())
+                        if is_transcribe_stream:
+                            streamresp = whisper_stream(genparams)
+                            if streamresp is None:
+                                self.send_response(400)
+                                self.end_headers(content_type='application/json')
+                                self.wfile.write(json.dumps({"detail": {
+                                    "msg": "Invalid audio_data or sample_rate.",
+                                    "type": "bad_input",
+                                }}).encode())
+                                return
+                            genresp = (json.dumps(streamresp).encode())
+                        else:
+                            gen = whisper_generate(genparams)
+                            genresp = (json.dumps({"text":gen}).encode())
                         self.send_response(200)
                         self.send_header('content-length', str(len(genresp)))
                         self.end_headers(content_type='application/json')
@@ -2969,10 +3170,9 @@ Enter Prompt:<br>
                     return
                 elif is_tts:
                     try:
-                        gen = tts_generate(genparams)
-                        wav_data = b''
-                        if gen:
-                            wav_data = base64.b64decode(gen) # Decode the Base64 string into binary data
+                        wav_data = tts_generate(genparams, raw_output=True)
+                        if not wav_data:
+                            wav_data = b''
                         self.send_response(200)
                         self.send_header('content-length', str(len(wav_data)))  # Set content length
                         self.send_header('Content-Disposition', 'attachment; filename="output.wav"')
@@ -4791,8 +4991,11 @@ def unload_libs():
         del handle.get_total_gens
         del handle.get_last_stop_reason
         del handle.abort_generate
+        del handle.get_metrics
         del handle.token_count
         del handle.get_pending_output
+        del handle.get_extra_output_count
+        del handle.get_extra_output
         del handle
         handle = None
 
@@ -5318,9 +5521,14 @@ def kcpp_main_process(launch_args, g_memory=None, gui_launcher=False):
         shouldavoidgpu = False
         if args.usecpu and sys.platform!="darwin":
             shouldavoidgpu = True
-            if args.gpulayers and args.gpulayers>0:
-                print("WARNING: GPU layers is set, but a GPU backend was not selected! GPU will not be used!")
-            args.gpulayers = 0
+            if args.rpc: #offloaded layers go to the rpc servers instead
+                if args.gpulayers==-1:
+                    print("RPC servers set: Auto GPU layers set to maximum")
+                    args.gpulayers = 999
+            else:
+                if args.gpulayers and args.gpulayers>0:
+                    print("WARNING: GPU layers is set, but a GPU backend was not selected! GPU will not be used!")
+                args.gpulayers = 0
         elif args.gpulayers==-1 and sys.platform=="darwin" and args.model_param and os.path.exists(args.model_param):
             print("MacOS detected: Auto GPU layers set to maximum")
             args.gpulayers = 200
@@ -5765,7 +5973,8 @@ if __name__ == '__main__':
     compatgroup.add_argument("--usecpu", help="Do not use any GPU acceleration (CPU Only)", action='store_true')
     parser.add_argument("--contextsize", help="Controls the memory allocated for maximum context size, only change if you need more RAM for big contexts. (default 4096). Supported values are [256,512,1024,2048,3072,4096,6144,8192,10240,12288,14336,16384,20480,24576,28672,32768,40960,49152,57344,65536,81920,98304,114688,131072]. IF YOU USE ANYTHING ELSE YOU ARE ON YOUR OWN.",metavar=('[256,512,1024,2048,3072,4096,6144,8192,10240,12288,14336,16384,20480,24576,28672,32768,40960,49152,57344,65536,81920,98304,114688,131072]'), type=check_range(int,256,262144), default=4096)
     parser.add_argument("--gpulayers", help="Set number of layers to offload to GPU when using GPU. Requires GPU. Set to -1 to try autodetect, set to 0 to disable GPU offload.",metavar=('[GPU layers]'), nargs='?', const=1, type=int, default=-1)
-    parser.add_argument("--tensor_split", help="For CUDA and Vulkan only, ratio to split tensors across multiple GPUs, space-separated list of proportions, e.g. 7 3", metavar=('[Ratios]'), type=float, nargs='+')
+    parser.add_argument("--tensor_split", help="For CUDA, Vulkan and RPC only, ratio to split tensors across multiple GPUs, space-separated list of proportions, e.g. 7 3", metavar=('[Ratios]'), type=float, nargs='+')
+    parser.add_argument("--rpc", metavar=('[host:port,...]'), help="GGUF models only. Comma-separated list of koboldcpp_rpc_server endpoints to offload layers to, e.g. 192.168.1.2:50052,192.168.1.3:50052. The offloaded layers (--gpulayers) are divided between the servers and any local GPUs by --tensor_split, servers first.", default="")
 
     #more advanced params
     advparser = parser.add_argument_group('Advanced Commands')
@@ -5775,8 +5984,12 @@ if __name__ == '__main__':
     advparser.add_argument("--blasbatchsize", help="Sets the batch size used in BLAS processing (default 512). Setting it to -1 disables BLAS mode, but keeps other benefits like GPU offload.", type=int,choices=[-1,32,64,128,256,512,1024,2048], default=512)
     advparser.add_argument("--blasthreads", help="Use a different number of threads during BLAS if specified. Otherwise, has the same value as --threads",metavar=('[threads]'), type=int, default=0)
     advparser.add_argument("--lora", help="LLAMA models only, applies a lora file on top of model. Experimental.", metavar=('[lora_filename]', '[lora_base]'), nargs='+')
+    advparser.add_argument("--loraadapter", help="GGUF models only. Preloads GGUF LoRA adapters that requests can enable and scale with the lora field, without reloading the model.", metavar=('[filenames]'), nargs='+')
     advparser.add_argument("--noshift", help="If set, do not attempt to Trim and Shift the GGUF context.", action='store_true')
     advparser.add_argument("--nofastforward", help="If set, do not attempt to fast forward GGUF context (always reprocess). Will also enable noshift", action='store_true')
+    advparser.add_argument("--sinktokens", metavar=('[tokens]'), help="GGUF models only. Replaces the context shifting heuristics with an attention sink rolling window: when the context overflows, the first N tokens (and any memory) are kept and the oldest tokens after them are evicted in place, so long chats never need a full reprocess (default=0, disabled). Requires context shifting.", type=int, default=0)
+    advparser.add_argument("--pagedkv", help="Backs the KV cache in RAM with memory only as its blocks of cells are used, and hands emptied blocks back. A large --contextsize then costs little until it fills up. Has no effect on an offloaded KV cache.", action='store_true')
+    advparser.add_argument("--asyncoutput", help="Detokenizes, streams and checks stop sequences for each generated token on a worker thread while the next token is decoded. A stop sequence then costs one extra decode. Not used when banned phrases are set.", action='store_true')
     compatgroup3 = advparser.add_mutually_exclusive_group()
     compatgroup3.add_argument("--usemmap", help="If set, uses mmap to load model.", action='store_true')
     advparser.add_argument("--usemlock", help="Enables mlock, preventing the RAM used to load the model from being paged out. Not usually recommended.", action='store_true')
@@ -5813,6 +6026,10 @@ if __name__ == '__main__':
     advparser.add_argument("--unpack", help="Extracts the file contents of the KoboldCpp binary into a target directory.", metavar=('destination'), type=str, default="")
     advparser.add_argument("--nomodel", help="Allows you to launch the GUI alone, without selecting any model.", action='store_true')
     advparser.add_argument("--moeexperts", metavar=('[num of experts]'), help="How many experts to use for MoE models (default=follow gguf)", type=int, default=-1)
+    advparser.add_argument("--modelpool", metavar=('[filenames]'), help="Additional GGUF text models that requests can select with the model field (by file name). They share the main model's settings and are loaded on demand.", nargs='+')
+    advparser.add_argument("--modelpoolbudget", metavar=('[MB]'), help="Memory budget for loaded models in the model pool. Least recently used models are unloaded when exceeded (default=0, unlimited).", type=int, default=0)
+    advparser.add_argument("--kvtier", metavar=('[MB]'), help="GGUF and legacy RWKV models only. Keeps the KV state of contexts that a diverging prompt would discard, in up to this much RAM, and restores it when a later prompt matches it again. Legacy RWKV models keep recurrent state checkpoints along the context instead (default=0, disabled).", type=int, default=0)
+    advparser.add_argument("--kvtierdir", metavar=('[directory]'), help="Directory where KV states exceeding the --kvtier RAM budget are spilled to, instead of being discarded. Use a fast local disk.", default="")
     compatgroup2 = parser.add_mutually_exclusive_group()
     compatgroup2.add_argument("--showgui", help="Always show the GUI instead of launching the model right away when loading settings from a .kcpps file.", action='store_true')
     compatgroup2.add_argument("--skiplauncher", help="Doesn't display or use the GUI launcher.", action='store_true')
@@ -5837,6 +6054,7 @@ if __name__ == '__main__':
     sdparsergrouplora = sdparsergroup.add_mutually_exclusive_group()
     sdparsergrouplora.add_argument("--sdquant", help="If specified, loads the model quantized to save memory.", action='store_true')
     sdparsergrouplora.add_argument("--sdlora", metavar=('[filename]'), help="Specify a stable diffusion LORA safetensors model to be applied. Cannot be used with quant models.", default="")
+    sdparsergroup.add_argument("--sdquantcache", metavar=('[directory]'), help="When used with --sdquant, saves the quantized weights as gguf files in this directory and reuses them on later launches instead of quantizing again. Uses the folder of the model if no directory is given.", nargs='?', const='', default=None)
     sdparsergroup.add_argument("--sdloramult", metavar=('[amount]'), help="Multiplier for the LORA model to be applied.", type=float, default=1.0)
     sdparsergroup.add_argument("--sdnotile", help="Disables VAE tiling, may not work for large images.", action='store_true')
 
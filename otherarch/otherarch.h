@@ -55,6 +55,7 @@ struct kcpp_params {
     bool use_smartcontext            = false;
     bool use_contextshift            = false;
     bool use_fastforward             = false;
+    int n_sink_tokens                = 0; // attention sink window: tokens kept at the front when the context overflows, 0 = disabled
 };
 
 // default hparams (GPT-J 6B)
@@ -502,7 +503,7 @@ struct mpt_model {
 
 struct llava_image
 {
-    std::string b64data = "";
+    std::vector<uint8_t> data; //encoded image file bytes
     int32_t clp_image_tokens = 0; //holds number of tokens llava used
     float * clp_img_embd = nullptr; //this holds dynamic memory and must be freed each use!
 };
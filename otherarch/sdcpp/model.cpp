@@ -1960,7 +1960,7 @@ bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type
     LOG_INFO("load tensors done");
     LOG_INFO("trying to save tensors to %s", file_path.c_str());
     if (success) {
-        gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
+        success = gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
     }
     ggml_free(ggml_ctx);
     gguf_free(gguf_ctx);
@@ -111,6 +111,7 @@ static SDParams * sd_params = nullptr;
 static sd_ctx_t * sd_ctx = nullptr;
 static int sddebugmode = 0;
 static std::string recent_data = "";
+static std::vector<uint8_t> recent_png; //raw bytes of recent_data
 
 static std::string sdplatformenv, sddeviceenv, sdvulkandeviceenv;
 static bool notiling = false;
@@ -182,6 +183,11 @@ bool sdtype_load_model(const sd_load_model_inputs inputs) {
     sd_params = new SDParams();
     sd_params->model_path = inputs.model_filename;
     sd_params->wtype = (inputs.quant==0?SD_TYPE_COUNT:SD_TYPE_Q4_0);
+    quant_cache_dir = (inputs.quant==0?"":inputs.quant_cache_dir);
+    if(quant_cache_dir!="")
+    {
+        printf("With quantized weights cache in: %s\n",quant_cache_dir.c_str());
+    }
     sd_params->n_threads = inputs.threads; //if -1 use physical cores
     sd_params->input_path = ""; //unused
     sd_params->batch_count = 1;
@@ -308,6 +314,8 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
     sd_params->height = inputs.height;
     sd_params->strength = inputs.denoising_strength;
     sd_params->clip_skip = inputs.clip_skip;
+    sd_ctx->sd->step_cache_threshold = inputs.step_cache_threshold;
+    sd_ctx->sd->step_cache_max_skip = inputs.step_cache_max_skip;
     sd_params->mode = (img2img_data==""?SDMode::TXT2IMG:SDMode::IMG2IMG);
 
     //ensure unsupported dimensions are fixed
@@ -531,6 +539,7 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
         unsigned char * png = stbi_write_png_to_mem(results[i].data, 0, results[i].width, results[i].height, results[i].channel, &out_data_len, "");
         if (png != NULL)
         {
+            recent_png.assign(png, png + out_data_len);
             recent_data = kcpp_base64_encode(png,out_data_len);
             free(png);
         }
@@ -541,6 +550,8 @@ sd_generation_outputs sdtype_generate(const sd_generation_inputs inputs)
 
     free(results);
     output.data = recent_data.c_str();
+    output.raw_data = recent_png.data();
+    output.raw_data_len = recent_png.size();
     output.status = 1;
     total_img_gens += 1;
     return output;
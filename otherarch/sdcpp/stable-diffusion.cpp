@@ -20,8 +20,107 @@
 
 #include <inttypes.h>
 #include <cinttypes>
+#include <cstdio>
+#include <fstream>
 static std::string pending_apply_lora_fname = "";
 static float pending_apply_lora_power = 1.0f;
+static std::string quant_cache_dir = ""; //if set, weights quantized on load are saved here as gguf and reused
+
+// identifies a source file by its size and sampled blocks of its content (including the header),
+// hashing every byte of a multi-gigabyte checkpoint would cost a good part of what the cache saves
+static bool quant_cache_hash_file(const std::string& path, uint64_t& hash) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+    const uint64_t size  = file.tellg();
+    const uint64_t block = 1 << 20;
+    const int samples    = 16;
+    std::vector<char> buf(block);
+    auto mix = [&](const char* data, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            hash ^= (uint8_t)data[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    mix((const char*)&size, sizeof(size));
+    for (int i = 0; i <= samples; i++) {
+        uint64_t offset = size <= block ? 0 : (size - block) / samples * i;
+        file.clear();
+        file.seekg(offset);
+        file.read(buf.data(), block);
+        mix(buf.data(), file.gcount());
+        if (size <= block) {
+            break;
+        }
+    }
+    return true;
+}
+
+// replaces the loader contents with a gguf holding the sources already converted to wtype,
+// writing that gguf first if this combination of files and weight type was never cached
+static bool load_quant_cache(ModelLoader& model_loader,
+                             const std::vector<std::pair<std::string, std::string>>& sources,
+                             const std::string& vae_path,
+                             ggml_type wtype) {
+    if (sources.empty()) {
+        return false;
+    }
+    // sources that already hold quantized weights are cheap to load as they are
+    for (const auto& pair : model_loader.tensor_storages_types) {
+        if (ggml_is_quantized(pair.second)) {
+            return false;
+        }
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto& source : sources) {
+        if (is_directory(source.first) || !quant_cache_hash_file(source.first, hash)) {
+            return false;
+        }
+        for (char c : source.second) {
+            hash ^= (uint8_t)c;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    std::string name = sources[0].first;
+    size_t pos       = name.find_last_of("/\\");
+    if (pos != std::string::npos) {
+        name = name.substr(pos + 1);
+    }
+    pos = name.rfind('.');
+    if (pos != std::string::npos) {
+        name = name.substr(0, pos);
+    }
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "-%016" PRIx64 "-%s.gguf", hash, ggml_type_name(wtype));
+    std::string cache_path = path_join(quant_cache_dir, name + suffix);
+
+    if (!file_exists(cache_path)) {
+        LOG_INFO("quantizing weights to %s for cache '%s'", ggml_type_name(wtype), cache_path.c_str());
+        ModelLoader writer;
+        for (const auto& source : sources) {
+            if (!writer.init_from_file(source.first, source.second)) {
+                return false;
+            }
+        }
+        std::string temp_path = cache_path + ".tmp";
+        if (!writer.save_to_gguf_file(temp_path, wtype) || rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+            LOG_WARN("failed to write quantized weights cache '%s'", cache_path.c_str());
+            remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    ModelLoader cached;
+    if (!cached.init_from_file(cache_path) || (vae_path.size() > 0 && !cached.init_from_file(vae_path, "vae."))) {
+        LOG_WARN("failed to load quantized weights cache '%s', using the original files", cache_path.c_str());
+        return false;
+    }
+    LOG_INFO("using quantized weights from cache '%s'", cache_path.c_str());
+    model_loader = cached;
+    return true;
+}
 
 const char* model_version_to_str[] = {
     "SD 1.x",
@@ -97,6 +196,11 @@ public:
     bool vae_tiling           = false;
     bool stacked_id           = false;
 
+    // step cache: reuse the previous diffusion model outputs while the scaled model input
+    // stays within this relative L1 distance of the last fully evaluated input (0 = off)
+    float step_cache_threshold = 0.f;
+    int step_cache_max_skip    = 0;
+
     std::map<std::string, struct ggml_tensor*> tensors;
 
     std::string lora_model_dir;
@@ -183,6 +287,7 @@ public:
         }
 
         ModelLoader model_loader;
+        std::vector<std::pair<std::string, std::string>> quant_cache_sources;
 
         vae_tiling = vae_tiling_;
 
@@ -190,6 +295,8 @@ public:
             LOG_INFO("loading model from '%s'", model_path.c_str());
             if (!model_loader.init_from_file(model_path)) {
                 LOG_ERROR("init model loader from file failed: '%s'", model_path.c_str());
+            } else {
+                quant_cache_sources.push_back({model_path, ""});
             }
         }
 
@@ -197,6 +304,8 @@ public:
             LOG_INFO("loading clip_l from '%s'", clip_l_path.c_str());
             if (!model_loader.init_from_file(clip_l_path, "text_encoders.clip_l.transformer.")) {
                 LOG_WARN("loading clip_l from '%s' failed", clip_l_path.c_str());
+            } else {
+                quant_cache_sources.push_back({clip_l_path, "text_encoders.clip_l.transformer."});
             }
         }
 
@@ -204,6 +313,8 @@ public:
             LOG_INFO("loading clip_g from '%s'", clip_g_path.c_str());
             if (!model_loader.init_from_file(clip_g_path, "text_encoders.clip_g.transformer.")) {
                 LOG_WARN("loading clip_g from '%s' failed", clip_g_path.c_str());
+            } else {
+                quant_cache_sources.push_back({clip_g_path, "text_encoders.clip_g.transformer."});
             }
         }
 
@@ -211,6 +322,8 @@ public:
             LOG_INFO("loading t5xxl from '%s'", t5xxl_path.c_str());
             if (!model_loader.init_from_file(t5xxl_path, "text_encoders.t5xxl.transformer.")) {
                 LOG_WARN("loading t5xxl from '%s' failed", t5xxl_path.c_str());
+            } else {
+                quant_cache_sources.push_back({t5xxl_path, "text_encoders.t5xxl.transformer."});
             }
         }
 
@@ -218,6 +331,8 @@ public:
             LOG_INFO("loading diffusion model from '%s'", diffusion_model_path.c_str());
             if (!model_loader.init_from_file(diffusion_model_path, "model.diffusion_model.")) {
                 LOG_WARN("loading diffusion model from '%s' failed", diffusion_model_path.c_str());
+            } else {
+                quant_cache_sources.push_back({diffusion_model_path, "model.diffusion_model."});
             }
         }
 
@@ -237,6 +352,8 @@ public:
                 LOG_INFO("SD Diffusion Model tensors missing! Fallback trying alternative tensor names...\n");
                 if (!model_loader.init_from_file(model_path, "model.diffusion_model.")) {
                     LOG_WARN("loading diffusion model from '%s' failed", model_path.c_str());
+                } else if (!quant_cache_sources.empty() && quant_cache_sources[0].first == model_path) {
+                    quant_cache_sources[0].second = "model.diffusion_model.";
                 }
                 version = model_loader.get_sd_version();
             }
@@ -249,6 +366,10 @@ public:
 
         LOG_INFO("Version: %s ", model_version_to_str[version]);
 
+        if (quant_cache_dir != "" && wtype != GGML_TYPE_COUNT && ggml_is_quantized(wtype)) {
+            load_quant_cache(model_loader, quant_cache_sources, vae_path, wtype);
+        }
+
         if(use_tiny_autoencoder)
         {
             std::string to_search = "taesd.embd";
@@ -886,6 +1007,13 @@ public:
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
 
+        bool use_step_cache              = step_cache_threshold > 0.f && step_cache_max_skip > 0;
+        struct ggml_tensor* cached_input = use_step_cache ? ggml_dup_tensor(work_ctx, x) : NULL;
+        bool step_cache_valid            = false;
+        int step_cache_run               = 0;
+        int step_cache_reused            = 0;
+        int model_evals                  = 0;
+
         auto denoise = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
             if (step == 1) {
                 pretty_progress(0, (int)steps, 0);
@@ -908,16 +1036,45 @@ public:
             // noised_input = noised_input * c_in
             ggml_tensor_scale(noised_input, c_in);
 
+            int step_count         = sigmas.size();
+            bool is_skiplayer_step = has_skiplayer && step > (int)(skip_layer_start * step_count) && step < (int)(skip_layer_end * step_count);
+
+            // the first and last steps and guidance changes always run the full model
+            bool reuse_outputs = false;
+            if (use_step_cache && step_cache_valid && step_cache_run < step_cache_max_skip && std::abs(step) > 1 && std::abs(step) < (int)steps &&
+                !is_skiplayer_step && (start_merge_step == -1 || step != start_merge_step + 1)) {
+                float* cur  = (float*)noised_input->data;
+                float* prev = (float*)cached_input->data;
+                double diff = 0, norm = 0;
+                int64_t n   = ggml_nelements(noised_input);
+                for (int64_t i = 0; i < n; i++) {
+                    diff += std::fabs(cur[i] - prev[i]);
+                    norm += std::fabs(prev[i]);
+                }
+                reuse_outputs = norm > 0 && (diff / norm) < step_cache_threshold;
+            }
+            model_evals++;
+            if (reuse_outputs) {
+                step_cache_run++;
+                step_cache_reused++;
+            } else if (use_step_cache) {
+                copy_ggml_tensor(cached_input, noised_input);
+                step_cache_valid = true;
+                step_cache_run   = 0;
+            }
+
             std::vector<struct ggml_tensor*> controls;
 
-            if (control_hint != NULL) {
+            if (control_hint != NULL && !reuse_outputs) {
                 control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
                 controls = control_net->controls;
                 // print_ggml_tensor(controls[12]);
                 // GGML_ASSERT(0);
             }
 
-            if (start_merge_step == -1 || step <= start_merge_step) {
+            if (reuse_outputs) {
+                // keep out_cond, out_uncond and out_skip from the last full evaluation
+            } else if (start_merge_step == -1 || step <= start_merge_step) {
                 // cond
                 diffusion_model->compute(n_threads,
                                          noised_input,
@@ -945,7 +1102,7 @@ public:
             }
 
             float* negative_data = NULL;
-            if (has_unconditioned) {
+            if (has_unconditioned && !reuse_outputs) {
                 // uncond
                 if (control_hint != NULL) {
                     control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
@@ -962,11 +1119,11 @@ public:
                                          controls,
                                          control_strength,
                                          &out_uncond);
+            }
+            if (has_unconditioned) {
                 negative_data = (float*)out_uncond->data;
             }
 
-            int step_count         = sigmas.size();
-            bool is_skiplayer_step = has_skiplayer && step > (int)(skip_layer_start * step_count) && step < (int)(skip_layer_end * step_count);
             float* skip_layer_data = NULL;
             if (is_skiplayer_step) {
                 LOG_DEBUG("Skipping layers at step %d\n", step);
@@ -1019,6 +1176,10 @@ public:
 
         sample_k_diffusion(method, denoise, work_ctx, x, sigmas, rng);
 
+        if (use_step_cache) {
+            LOG_INFO("step cache reused model outputs for %d of %d evaluations", step_cache_reused, model_evals);
+        }
+
         x = denoiser->inverse_noise_scaling(sigmas[sigmas.size() - 1], x);
 
         if (control_net) {
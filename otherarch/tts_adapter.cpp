@@ -47,7 +47,7 @@ struct wav_header {
     uint32_t data_size;
 };
 
-static std::string save_wav16_base64(const std::vector<float> &data, int sample_rate) {
+static std::string save_wav16(const std::vector<float> &data, int sample_rate) {
     std::ostringstream oss;
     wav_header header;
 
@@ -68,8 +68,7 @@ static std::string save_wav16_base64(const std::vector<float> &data, int sample_
     }
 
     // Get binary WAV data
-    std::string wav_data = oss.str();
-    return kcpp_base64_encode(wav_data); //return as base64 string
+    return oss.str();
 }
 
 static void fill_hann_window(int length, bool periodic, float * output) {
@@ -469,6 +468,7 @@ static int ttsdebugmode = 0;
 static bool tts_is_quiet = false;
 static std::string ttsplatformenv, ttsdeviceenv, ttsvulkandeviceenv;
 static std::string last_generated_audio = "";
+static std::string last_generated_wav = ""; //raw wav bytes of last_generated_audio
 static std::string last_generation_settings_prompt = ""; //for caching purposes to fix ST bug
 static int last_generation_settings_speaker_seed;
 static int last_generation_settings_audio_seed;
@@ -975,12 +975,15 @@ tts_generation_outputs ttstype_generate(const tts_generation_inputs inputs)
             return output;
         }
 
-        last_generated_audio = save_wav16_base64(audio, t_sr);
+        last_generated_wav = save_wav16(audio, t_sr);
+        last_generated_audio = kcpp_base64_encode(last_generated_wav); //return as base64 string
         ttstime = timer_check();
 
         printf("\nTTS Generated %d audio tokens in %.2fs.\n",(int) codes.size(),ttstime);
 
         output.data = last_generated_audio.c_str();
+        output.raw_data = (const unsigned char *)last_generated_wav.data();
+        output.raw_data_len = last_generated_wav.size();
         output.status = 1;
 
         last_generation_settings_audio_seed = inputs.audio_seed;
@@ -10,6 +10,7 @@
 #include <codecvt>
 #include <sstream>
 #include <ctime>
+#include <mutex>
 
 
 void utreplace(std::string & str, const std::string & needle, const std::string & replacement) {
@@ -225,113 +226,90 @@ bool should_transpose_layer(std::string name)
     return false;
 }
 
-static const std::string kcpp_base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
-static inline bool kcpp_is_base64(uint8_t c)
-{
-    return (isalnum(c) || (c == '+') || (c == '/'));
-}
-std::vector<uint8_t> kcpp_base64_decode(const std::string & encoded_string)
-{
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-
-    int in_len = encoded_string.size();
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
-
-    std::vector<uint8_t> ret;
+static const char kcpp_base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-    while (in_len-- && (encoded_string[in_] != '=') && kcpp_is_base64(encoded_string[in_]))
+//lookup tables are built once: 0xFF marks a non-base64 character, and the pair table emits two output chars per 12 input bits
+struct kcpp_base64_tables
+{
+    uint8_t dec[256];
+    char enc_pairs[4096][2];
+    kcpp_base64_tables()
     {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4)
+        memset(dec, 0xFF, sizeof(dec));
+        for (int i = 0; i < 64; ++i)
         {
-            for (i = 0; i <4; i++)
-            {
-                char_array_4[i] = kcpp_base64_chars.find(char_array_4[i]);
-            }
-
-            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
-
-            for (i = 0; (i < 3); i++)
-            {
-                ret.push_back(char_array_3[i]);
-            }
-            i = 0;
+            dec[(uint8_t)kcpp_base64_chars[i]] = (uint8_t)i;
+        }
+        for (int i = 0; i < 4096; ++i)
+        {
+            enc_pairs[i][0] = kcpp_base64_chars[i >> 6];
+            enc_pairs[i][1] = kcpp_base64_chars[i & 0x3F];
         }
     }
+};
+static const kcpp_base64_tables kcpp_b64;
 
-    if (i)
+std::vector<uint8_t> kcpp_base64_decode(const char * encoded, size_t len)
+{
+    //decoding stops at the first padding or non-base64 character
+    size_t valid = 0;
+    while (valid < len && kcpp_b64.dec[(uint8_t)encoded[valid]] != 0xFF)
     {
-        for (j = i; j <4; j++)
-        {
-            char_array_4[j] = 0;
-        }
+        ++valid;
+    }
 
-        for (j = 0; j <4; j++)
+    const size_t quads = valid / 4;
+    const size_t tail = valid % 4;
+    std::vector<uint8_t> ret(quads * 3 + (tail > 1 ? tail - 1 : 0));
+    const uint8_t * in = (const uint8_t *)encoded;
+    uint8_t * out = ret.data();
+    for (size_t q = 0; q < quads; ++q, in += 4, out += 3)
+    {
+        const uint32_t v = ((uint32_t)kcpp_b64.dec[in[0]] << 18) | ((uint32_t)kcpp_b64.dec[in[1]] << 12)
+                         | ((uint32_t)kcpp_b64.dec[in[2]] << 6) | (uint32_t)kcpp_b64.dec[in[3]];
+        out[0] = (uint8_t)(v >> 16);
+        out[1] = (uint8_t)(v >> 8);
+        out[2] = (uint8_t)v;
+    }
+    if (tail > 1)
+    {
+        uint32_t v = ((uint32_t)kcpp_b64.dec[in[0]] << 18) | ((uint32_t)kcpp_b64.dec[in[1]] << 12);
+        if (tail > 2)
         {
-            char_array_4[j] = kcpp_base64_chars.find(char_array_4[j]);
+            v |= ((uint32_t)kcpp_b64.dec[in[2]] << 6);
         }
-
-        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
-
-        for (j = 0; (j < i - 1); j++)
+        out[0] = (uint8_t)(v >> 16);
+        if (tail > 2)
         {
-            ret.push_back(char_array_3[j]);
+            out[1] = (uint8_t)(v >> 8);
         }
     }
-
     return ret;
 }
+std::vector<uint8_t> kcpp_base64_decode(const std::string & encoded_string)
+{
+    return kcpp_base64_decode(encoded_string.data(), encoded_string.size());
+}
 std::string kcpp_base64_encode(const unsigned char* data, unsigned int data_length) {
-    const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string encoded;
-    encoded.reserve(((data_length + 2) / 3) * 4);
-    for (unsigned int i = 0; i < data_length; i += 3) {
-        unsigned int triple = (data[i] << 16) + (i + 1 < data_length ? data[i + 1] << 8 : 0) + (i + 2 < data_length ? data[i + 2] : 0);
-        encoded.push_back(base64_chars[(triple >> 18) & 0x3F]);
-        encoded.push_back(base64_chars[(triple >> 12) & 0x3F]);
+    std::string encoded(((data_length + 2) / 3) * 4, '=');
+    char * out = &encoded[0];
+    unsigned int i = 0;
+    for (; i + 3 <= data_length; i += 3, out += 4) {
+        const uint32_t triple = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | (uint32_t)data[i + 2];
+        memcpy(out, kcpp_b64.enc_pairs[triple >> 12], 2);
+        memcpy(out + 2, kcpp_b64.enc_pairs[triple & 0xFFF], 2);
+    }
+    if (i < data_length) {
+        const uint32_t triple = ((uint32_t)data[i] << 16) | (i + 1 < data_length ? (uint32_t)data[i + 1] << 8 : 0);
+        memcpy(out, kcpp_b64.enc_pairs[triple >> 12], 2);
         if (i + 1 < data_length) {
-            encoded.push_back(base64_chars[(triple >> 6) & 0x3F]);
-        } else {
-            encoded.push_back('=');
-        }
-        if (i + 2 < data_length) {
-            encoded.push_back(base64_chars[triple & 0x3F]);
-        } else {
-            encoded.push_back('=');
+            out[2] = kcpp_base64_chars[(triple >> 6) & 0x3F];
         }
     }
     return encoded;
 }
 std::string kcpp_base64_encode(const std::string &data) {
-    static const char lookup[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string encoded;
-    int val = 0, valb = -6;
-    for (unsigned char c : data) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            encoded.push_back(lookup[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-    if (valb > -6) {
-        encoded.push_back(lookup[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
-    while (encoded.size() % 4) {
-        encoded.push_back('=');
-    }
-    return encoded;
+    return kcpp_base64_encode((const unsigned char *)data.data(), data.size());
 }
 
 std::string get_timestamp_str()
@@ -542,4 +520,177 @@ kcpp_embd_batch::kcpp_embd_batch(std::vector<llama_token> & tokens, int32_t npas
             }
         }
         batch.logits[n_tokens - 1] = true;
-}
\ No newline at end of file
+}
+
+struct kcpp_metric_series
+{
+    double sum = 0;
+    uint64_t count = 0;
+    std::vector<uint64_t> buckets; //per bucket, not cumulative. empty for counters
+};
+struct kcpp_metric_family
+{
+    std::string help;
+    const std::vector<double> * bounds = nullptr; //null for counters
+    std::map<std::string, kcpp_metric_series> series; //keyed by label set
+};
+static std::mutex kcpp_metrics_mtx;
+static std::map<std::string, kcpp_metric_family> kcpp_metrics;
+
+static const std::vector<double> & kcpp_metric_bounds(kcpp_metric_scale scale)
+{
+    static const std::vector<double> seconds = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100};
+    static const std::vector<double> tokens = {1, 4, 16, 64, 256, 1024, 4096, 16384, 65536};
+    return (scale == KCPP_METRIC_TOKENS ? tokens : seconds);
+}
+
+void kcpp_metric_add(const char * name, const char * help, double amount, const std::string & labels)
+{
+    std::lock_guard<std::mutex> lock(kcpp_metrics_mtx);
+    kcpp_metric_family & family = kcpp_metrics[name];
+    if(family.help.empty())
+    {
+        family.help = help;
+    }
+    kcpp_metric_series & series = family.series[labels];
+    series.sum += amount;
+    series.count += 1;
+}
+
+void kcpp_metric_observe(const char * name, const char * help, double value, kcpp_metric_scale scale, const std::string & labels)
+{
+    const std::vector<double> & bounds = kcpp_metric_bounds(scale);
+    std::lock_guard<std::mutex> lock(kcpp_metrics_mtx);
+    kcpp_metric_family & family = kcpp_metrics[name];
+    if(family.help.empty())
+    {
+        family.help = help;
+        family.bounds = &bounds;
+    }
+    kcpp_metric_series & series = family.series[labels];
+    if(series.buckets.empty())
+    {
+        series.buckets.resize(bounds.size(), 0);
+    }
+    for(size_t i = 0; i < bounds.size(); ++i)
+    {
+        if(value <= bounds[i])
+        {
+            series.buckets[i] += 1;
+            break;
+        }
+    }
+    series.sum += value;
+    series.count += 1;
+}
+
+std::string kcpp_metrics_text()
+{
+    std::lock_guard<std::mutex> lock(kcpp_metrics_mtx);
+    std::string out;
+    char buf[512];
+    auto write_sample = [&](const std::string & name, const std::string & labels, double value) {
+        snprintf(buf, sizeof(buf), "%s%s%s%s %.10g\n", name.c_str(), (labels.empty() ? "" : "{"), labels.c_str(), (labels.empty() ? "" : "}"), value);
+        out += buf;
+    };
+    for(const auto & item : kcpp_metrics)
+    {
+        const std::string & name = item.first;
+        const kcpp_metric_family & family = item.second;
+        out += "# HELP " + name + " " + family.help + "\n";
+        out += "# TYPE " + name + (family.bounds ? " histogram\n" : " counter\n");
+        for(const auto & s : family.series)
+        {
+            const std::string & labels = s.first;
+            if(!family.bounds)
+            {
+                write_sample(name, labels, s.second.sum);
+                continue;
+            }
+            std::string sep = (labels.empty() ? "" : labels + ",");
+            uint64_t cumulative = 0;
+            for(size_t i = 0; i < family.bounds->size(); ++i)
+            {
+                cumulative += s.second.buckets[i];
+                snprintf(buf, sizeof(buf), "le=\"%g\"", (*family.bounds)[i]);
+                write_sample(name + "_bucket", sep + buf, (double)cumulative);
+            }
+            write_sample(name + "_bucket", sep + "le=\"+Inf\"", (double)s.second.count);
+            write_sample(name + "_sum", labels, s.second.sum);
+            write_sample(name + "_count", labels, (double)s.second.count);
+        }
+    }
+    return out;
+}
+
+void kcpp_phrase_matcher::build(const std::vector<std::string> & phrases, bool ignore_case)
+{
+    std::locale loc;
+    for(int c=0;c<256;++c)
+    {
+        fold[c] = (ignore_case ? (unsigned char)std::tolower((char)c, loc) : (unsigned char)c); //same folding as toLowerCase
+    }
+    next.assign(1, std::array<int,256>());
+    next[0].fill(-1);
+    phrase.assign(1, -1);
+    phrase_len.clear();
+    for(int p=0;p<phrases.size();++p)
+    {
+        phrase_len.push_back(phrases[p].size());
+        if(phrases[p].empty())
+        {
+            continue;
+        }
+        int s = 0;
+        for(unsigned char c : phrases[p])
+        {
+            c = fold[c];
+            if(next[s][c] < 0)
+            {
+                next[s][c] = next.size();
+                next.emplace_back();
+                next.back().fill(-1);
+                phrase.push_back(-1);
+            }
+            s = next[s][c];
+        }
+        if(phrase[s] < 0)
+        {
+            phrase[s] = p;
+        }
+    }
+
+    //breadth first from the root, filling every missing transition from the failure state
+    std::vector<int> fail(next.size(), 0);
+    std::vector<int> queue;
+    output_link.assign(next.size(), 0);
+    for(int c=0;c<256;++c)
+    {
+        if(next[0][c] < 0)
+        {
+            next[0][c] = 0;
+        }
+        else
+        {
+            queue.push_back(next[0][c]);
+        }
+    }
+    for(size_t q=0;q<queue.size();++q)
+    {
+        int s = queue[q];
+        output_link[s] = (phrase[fail[s]] >= 0 ? fail[s] : output_link[fail[s]]);
+        for(int c=0;c<256;++c)
+        {
+            int t = next[s][c];
+            if(t < 0)
+            {
+                next[s][c] = next[fail[s]][c];
+            }
+            else
+            {
+                fail[t] = next[fail[s]][c];
+                queue.push_back(t);
+            }
+        }
+    }
+}
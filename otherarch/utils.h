@@ -5,6 +5,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <array>
 #include <random>
 #include <thread>
 #include "ggml_v3.h"
@@ -56,6 +57,7 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::stri
 bool should_transpose_layer(std::string name);
 void kcpp_graph_compute_helper(ggml_v3_cgraph * graph, int n_threads);
 
+std::vector<uint8_t> kcpp_base64_decode(const char * encoded, size_t len);
 std::vector<uint8_t> kcpp_base64_decode(const std::string & encoded_string);
 std::string kcpp_base64_encode(const unsigned char* data, unsigned int data_length);
 std::string kcpp_base64_encode(const std::string &data);
@@ -63,6 +65,62 @@ std::string kcpp_base64_encode(const std::string &data);
 std::string get_timestamp_str();
 std::vector<float> resample_wav(const std::vector<float>& input, uint32_t input_rate, uint32_t output_rate);
 
+//
+// Metrics
+//
+
+enum kcpp_metric_scale
+{
+    KCPP_METRIC_SECONDS, //histogram buckets from 0.1ms to 100s
+    KCPP_METRIC_TOKENS, //histogram buckets from 1 to 65536 tokens
+};
+
+//process wide counters and histograms, exported in prometheus text format. labels are preformatted, e.g. sampler="top_k"
+void kcpp_metric_add(const char * name, const char * help, double amount, const std::string & labels = "");
+void kcpp_metric_observe(const char * name, const char * help, double value, kcpp_metric_scale scale, const std::string & labels = "");
+std::string kcpp_metrics_text();
+
+//
+// Phrase matching
+//
+
+//aho-corasick automaton over a list of phrases, so a growing output is scanned once per byte instead of once per phrase.
+//each state keeps the lowest phrase index ending there, and a link to the next shorter suffix state that ends a phrase
+struct kcpp_phrase_matcher
+{
+    std::vector<std::array<int,256>> next;
+    std::vector<int> phrase;
+    std::vector<int> output_link;
+    std::vector<size_t> phrase_len;
+    unsigned char fold[256];
+
+    void build(const std::vector<std::string> & phrases, bool ignore_case);
+
+    bool empty() const
+    {
+        return next.size() <= 1;
+    }
+
+    //continues from state over text, calling on_match(phrase, end) for every phrase ending in it, end is one past its last byte
+    template<typename F>
+    int scan(int state, const std::string & text, F on_match) const
+    {
+        if(empty())
+        {
+            return 0;
+        }
+        for(size_t i=0;i<text.size();++i)
+        {
+            state = next[state][fold[(unsigned char)text[i]]];
+            for(int m = (phrase[state] >= 0 ? state : output_link[state]); m > 0; m = output_link[m])
+            {
+                on_match(phrase[m], i + 1);
+            }
+        }
+        return state;
+    }
+};
+
 int32_t kcpp_quick_sample(float * logits, const int n_logits, const std::vector<int32_t> & last_n_tokens, float rep_pen, float top_p, int top_k, float temp, std::mt19937 & rng);
 
 struct kcpp_embd_batch { //duplcated from llava_embd_batch
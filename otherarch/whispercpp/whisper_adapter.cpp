@@ -16,6 +16,7 @@
 #include <cstring>
 #include <mutex>
 #include <cinttypes>
+#include <map>
 
 #define COMMON_SAMPLE_RATE 16000
 
@@ -42,12 +43,11 @@ static bool is_wav_buffer(const std::string buf) {
     return true;
 }
 
-static bool read_wav(const std::string & b64data, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo)
+static bool read_wav(const uint8_t * wav_data, size_t wav_len, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo)
 {
     drwav wav;
-    std::vector<uint8_t> wav_data = kcpp_base64_decode(b64data);
 
-    if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) == false) {
+    if (drwav_init_memory(&wav, wav_data, wav_len, nullptr) == false) {
         printf("error: failed to open WAV file from stdin\n");
         return false;
     }
@@ -64,7 +64,7 @@ static bool read_wav(const std::string & b64data, std::vector<float>& pcmf32, st
         return false;
     }
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+    const uint64_t n = wav_len==0 ? wav.totalPCMFrameCount : wav_len/(wav.channels*wav.bitsPerSample/8);
 
     std::vector<int16_t> pcm16;
     pcm16.resize(n*wav.channels);
@@ -92,7 +92,7 @@ static bool read_wav(const std::string & b64data, std::vector<float>& pcmf32, st
 
     if(whisperdebugmode==1 && !whisper_is_quiet)
     {
-        printf("\nwav_data_size: %d, n:%d",wav_data.size(),n);
+        printf("\nwav_data_size: %d, n:%d",(int)wav_len,(int)n);
     }
 
     // convert to mono, float
@@ -135,6 +135,42 @@ static std::string output_txt(struct whisper_context * ctx, std::vector<std::vec
     return outtxt;
 }
 
+static whisper_full_params get_whisper_params(const std::string & langcode, const std::string & initprompt, bool suppress_non_speech)
+{
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.strategy = WHISPER_SAMPLING_GREEDY;
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.translate        = false;
+    wparams.language         = langcode.c_str();
+    wparams.detect_language  = false;
+    wparams.n_threads        = 4;
+    wparams.n_max_text_ctx   = wparams.n_max_text_ctx;
+    wparams.offset_ms        = 0;
+    wparams.duration_ms      = 0;
+    wparams.token_timestamps = false;
+    wparams.thold_pt         = 0.01f;
+    wparams.max_len          = 100;
+    wparams.split_on_word    = false;
+    wparams.audio_ctx        = 0;
+    wparams.speed_up         = false;
+    wparams.debug_mode       = (whisperdebugmode==1);
+    wparams.tdrz_enable      = false;
+    wparams.suppress_regex   = nullptr;
+    wparams.suppress_non_speech_tokens = suppress_non_speech;
+    wparams.initial_prompt   = initprompt.c_str();
+    wparams.greedy.best_of        = -1;
+    wparams.beam_search.beam_size = -1;
+    wparams.temperature_inc  = 0.2f;
+    wparams.temperature      = 0.0f;
+    wparams.entropy_thold    = 2.40f;
+    wparams.logprob_thold    = -1.00f;
+    wparams.no_timestamps    = true;
+    return wparams;
+}
+
 void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
 
 static std::string whisperplatformenv, whisperdeviceenv, whispervulkandeviceenv;
@@ -210,14 +246,23 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
         printf("\nWhisper Transcribe Generating...");
     }
 
-    const std::string b64data = std::string(inputs.audio_data);
+    //raw wav bytes are used as-is, otherwise fall back to the base64 string
+    std::vector<uint8_t> decoded_wav;
+    const uint8_t * wav_data = inputs.audio_buffer;
+    size_t wav_len = (inputs.audio_buffer_len > 0 ? inputs.audio_buffer_len : 0);
+    if (wav_data == nullptr || wav_len == 0)
+    {
+        decoded_wav = kcpp_base64_decode(inputs.audio_data, (inputs.audio_data ? strlen(inputs.audio_data) : 0));
+        wav_data = decoded_wav.data();
+        wav_len = decoded_wav.size();
+    }
     const std::string initprompt = std::string(inputs.prompt);
     const std::string langcode = std::string(inputs.langcode);
 
     std::vector<float> pcmf32;               // mono-channel F32 PCM
     std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-    if (!::read_wav(b64data, pcmf32, pcmf32s, false)) {
+    if (!::read_wav(wav_data, wav_len, pcmf32, pcmf32s, false)) {
         printf("\nWhisper: Failed to read input wav data!\n");
         output.text = "";
         output.status = 0;
@@ -225,44 +270,16 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
     }
 
     // run the inference
-    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    wparams.strategy = WHISPER_SAMPLING_GREEDY;
-    wparams.print_realtime   = false;
-    wparams.print_progress   = false;
-    wparams.print_timestamps = false;
-    wparams.print_special    = false;
-    wparams.translate        = false;
-    wparams.language         = langcode.c_str();
-    wparams.detect_language  = false;
-    wparams.n_threads        = 4;
-    wparams.n_max_text_ctx   = wparams.n_max_text_ctx;
-    wparams.offset_ms        = 0;
-    wparams.duration_ms      = 0;
-    wparams.token_timestamps = false;
-    wparams.thold_pt         = 0.01f;
-    wparams.max_len          = 100;
-    wparams.split_on_word    = false;
-    wparams.audio_ctx        = 0;
-    wparams.speed_up         = false;
-    wparams.debug_mode       = (whisperdebugmode==1);
-    wparams.tdrz_enable      = false;
-    wparams.suppress_regex   = nullptr;
-    wparams.suppress_non_speech_tokens = inputs.suppress_non_speech;
-    wparams.initial_prompt   = initprompt.c_str();
-    wparams.greedy.best_of        = -1;
-    wparams.beam_search.beam_size = -1;
-    wparams.temperature_inc  = 0.2f;
-    wparams.temperature      = 0.0f;
-    wparams.entropy_thold    = 2.40f;
-    wparams.logprob_thold    = -1.00f;
-    wparams.no_timestamps    = true;
+    whisper_full_params wparams = get_whisper_params(langcode, initprompt, inputs.suppress_non_speech);
 
+    int64_t transcribe_start_us = ggml_time_us();
     if (whisper_full_parallel(whisper_ctx, wparams, pcmf32.data(), pcmf32.size(), 1) != 0) {
         printf("\nWhisper: Failed to process audio!\n");
         output.text = "";
         output.status = 0;
         return output;
     }
+    kcpp_metric_observe("kcpp_audio_transcribe_seconds", "Time to transcribe an audio clip.", (ggml_time_us() - transcribe_start_us) / 1000000.0, KCPP_METRIC_SECONDS);
 
     if (!whisper_is_quiet && whisperdebugmode==1) {
         whisper_print_timings(whisper_ctx);
@@ -281,3 +298,196 @@ whisper_generation_outputs whispertype_generate(const whisper_generation_inputs
     output.status = 1;
     return output;
 }
+
+//streaming transcription. each session keeps its whisper_state and uncommitted audio alive between chunks,
+//the pending audio is re-transcribed as a sliding window and finished segments are committed as it grows
+struct whisper_stream_session
+{
+    whisper_state * state = nullptr;
+    std::vector<float> pcm; //uncommitted 16khz mono audio
+    size_t pcm_at_last_run = 0;
+    std::string committed_tail = ""; //end of committed text, used as decoder prompt for the next window
+    int64_t last_used = 0;
+};
+static std::map<std::string,whisper_stream_session> whisper_stream_sessions;
+static int64_t whisper_stream_counter = 0;
+static std::string whisper_stream_committed = "";
+static std::string whisper_stream_partial = "";
+const int whisper_stream_max_sessions = 4;
+const int whisper_stream_step_ms = 1000; //min new audio before the window is transcribed again
+const int whisper_stream_commit_ms = 10000; //past this, all but the last segment get committed
+const int whisper_stream_window_ms = 30000; //whisper encoder window
+const int whisper_stream_keep_ms = 500; //overlap retained when a full window has to be committed whole
+const int whisper_stream_prompt_chars = 200;
+
+static void whisper_stream_release(const std::string & session_id)
+{
+    auto it = whisper_stream_sessions.find(session_id);
+    if(it!=whisper_stream_sessions.end())
+    {
+        if(it->second.state)
+        {
+            whisper_free_state(it->second.state);
+        }
+        whisper_stream_sessions.erase(it);
+    }
+}
+
+whisper_stream_outputs whispertype_stream(const whisper_stream_inputs inputs)
+{
+    whisper_stream_outputs output;
+    whisper_stream_committed = "";
+    whisper_stream_partial = "";
+    output.committed = "";
+    output.partial = "";
+    output.status = 0;
+
+    if(whisper_ctx==nullptr)
+    {
+        printf("\nWarning: KCPP whisper not initialized!\n");
+        return output;
+    }
+
+    const std::string session_id = (inputs.session_id?inputs.session_id:"");
+    const std::string initprompt = (inputs.prompt?inputs.prompt:"");
+    const std::string langcode = (inputs.langcode?inputs.langcode:"auto");
+
+    if(inputs.reset_session)
+    {
+        whisper_stream_release(session_id);
+    }
+
+    if(whisper_stream_sessions.find(session_id)==whisper_stream_sessions.end())
+    {
+        if(whisper_stream_sessions.size()>=whisper_stream_max_sessions)
+        {
+            //evict least recently used session
+            auto oldest = whisper_stream_sessions.begin();
+            for(auto it = whisper_stream_sessions.begin(); it != whisper_stream_sessions.end(); ++it)
+            {
+                if(it->second.last_used < oldest->second.last_used)
+                {
+                    oldest = it;
+                }
+            }
+            whisper_stream_release(oldest->first);
+        }
+        whisper_stream_session newsess;
+        newsess.state = whisper_init_state(whisper_ctx);
+        if(newsess.state==nullptr)
+        {
+            printf("\nWhisper Stream: Failed to create whisper state!\n");
+            return output;
+        }
+        whisper_stream_sessions[session_id] = newsess;
+    }
+    whisper_stream_session & sess = whisper_stream_sessions[session_id];
+    sess.last_used = ++whisper_stream_counter;
+
+    //append new audio, 16-bit signed little endian mono
+    if(inputs.pcm_data && inputs.pcm_bytes >= 2)
+    {
+        const int n = inputs.pcm_bytes/2;
+        std::vector<float> chunk(n);
+        for(int i=0;i<n;++i)
+        {
+            int16_t v;
+            memcpy(&v, inputs.pcm_data + i*2, 2);
+            chunk[i] = float(v)/32768.0f;
+        }
+        if(inputs.sample_rate > 0 && inputs.sample_rate != COMMON_SAMPLE_RATE)
+        {
+            chunk = resample_wav(chunk, inputs.sample_rate, COMMON_SAMPLE_RATE);
+        }
+        sess.pcm.insert(sess.pcm.end(), chunk.begin(), chunk.end());
+    }
+
+    const size_t step_samples = (size_t)COMMON_SAMPLE_RATE*whisper_stream_step_ms/1000;
+    const size_t window_samples = (size_t)COMMON_SAMPLE_RATE*whisper_stream_window_ms/1000;
+    const size_t keep_samples = (size_t)COMMON_SAMPLE_RATE*whisper_stream_keep_ms/1000;
+    bool must_run = !sess.pcm.empty() && (inputs.final_chunk || sess.pcm.size() >= sess.pcm_at_last_run + step_samples);
+
+    while(must_run)
+    {
+        const size_t n = std::min(sess.pcm.size(), window_samples);
+        const std::string windowprompt = initprompt + sess.committed_tail;
+        whisper_full_params wparams = get_whisper_params(langcode, windowprompt, inputs.suppress_non_speech);
+        wparams.no_timestamps = false; //segment boundaries decide what can be committed
+        wparams.max_len = 0;
+
+        int64_t transcribe_start_us = ggml_time_us();
+        if (whisper_full_with_state(whisper_ctx, sess.state, wparams, sess.pcm.data(), n) != 0) {
+            printf("\nWhisper Stream: Failed to process audio!\n");
+            whisper_stream_release(session_id);
+            return output;
+        }
+        kcpp_metric_observe("kcpp_audio_stream_window_seconds", "Time to transcribe one window of a streamed audio session.", (ggml_time_us() - transcribe_start_us) / 1000000.0, KCPP_METRIC_SECONDS);
+
+        const int n_segments = whisper_full_n_segments_from_state(sess.state);
+        const bool window_full = (n + step_samples > window_samples);
+        int commit_segments = 0;
+        size_t drop = 0;
+        if(inputs.final_chunk || (window_full && n_segments <= 1))
+        {
+            commit_segments = n_segments;
+            drop = (inputs.final_chunk ? n : n - keep_samples);
+        }
+        else if((n >= (size_t)COMMON_SAMPLE_RATE*whisper_stream_commit_ms/1000 || window_full) && n_segments > 1)
+        {
+            //the last segment may still be cut mid word, keep it and its audio pending
+            commit_segments = n_segments - 1;
+            drop = (size_t)whisper_full_get_segment_t0_from_state(sess.state, n_segments - 1) * COMMON_SAMPLE_RATE / 100;
+            drop = std::min(drop, n);
+        }
+
+        std::string committed = "";
+        std::string partial = "";
+        for (int i = 0; i < n_segments; ++i) {
+            const char * text = whisper_full_get_segment_text_from_state(sess.state, i);
+            if(i < commit_segments)
+            {
+                committed += text;
+            }
+            else
+            {
+                partial += text;
+            }
+        }
+        whisper_stream_committed += committed;
+        whisper_stream_partial = partial;
+
+        //the next window in this call already decodes after the text just committed
+        sess.committed_tail += committed;
+        if(sess.committed_tail.size() > whisper_stream_prompt_chars)
+        {
+            sess.committed_tail = sess.committed_tail.substr(sess.committed_tail.size() - whisper_stream_prompt_chars);
+        }
+
+        if(drop > 0)
+        {
+            sess.pcm.erase(sess.pcm.begin(), sess.pcm.begin() + drop);
+        }
+        sess.pcm_at_last_run = sess.pcm.size();
+        must_run = (drop > 0 && (sess.pcm.size() > window_samples || (inputs.final_chunk && !sess.pcm.empty())));
+    }
+
+    if(whisper_stream_committed!="" && !whisper_is_quiet && whisperdebugmode==1)
+    {
+        printf("\nWhisper Stream Commit: %s",whisper_stream_committed.c_str());
+    }
+
+    if(inputs.final_chunk)
+    {
+        whisper_stream_release(session_id);
+        if(!whisper_is_quiet)
+        {
+            std::string ts = get_timestamp_str();
+            printf("\n[%s] Whisper Stream Done.",ts.c_str());
+        }
+    }
+
+    output.committed = whisper_stream_committed.c_str();
+    output.partial = whisper_stream_partial.c_str();
+    output.status = 1;
+    return output;
+}
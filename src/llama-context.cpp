@@ -651,10 +651,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
+    ctx->graph_reuse.gf = nullptr;
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
+    ctx->graph_reuse.gf = nullptr;
 }
 
 void llama_synchronize(struct llama_context * ctx) {
@@ -1222,6 +1224,8 @@ struct llama_data_read {
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            llama_kv_cache_mark_resident(kv_self, 0, cell_count);
         }
 
         if (kv_self.recurrent) {
@@ -1510,6 +1514,11 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // cells copied on write only hold their data after the next update
+    if (!ctx->kv_self.pending_copies.empty()) {
+        llama_kv_cache_update(ctx);
+    }
+
     data_ctx.write_model_info(ctx);
 
     // copy outputs
@@ -1650,6 +1659,10 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    if (!ctx->kv_self.pending_copies.empty()) {
+        llama_kv_cache_update(ctx);
+    }
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
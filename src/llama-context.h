@@ -88,6 +88,23 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_ptr sched;
 
+    // the last decode graph, kept allocated while consecutive ubatches have the same shape
+    // cleared whenever another graph is built or an option that changes the graph is set
+    struct llama_graph_reuse {
+        ggml_cgraph * gf   = nullptr;
+        ggml_tensor * res  = nullptr;
+        ggml_tensor * embd = nullptr;
+
+        uint32_t n_tokens  = 0;
+        uint32_t n_seqs    = 0;
+        uint32_t n_kv      = 0;
+        int32_t  n_outputs = 0;
+        bool     use_embd  = false;
+
+        // views of the KV cache written by the graph, with their offset per cell of the KV head
+        std::vector<std::pair<ggml_tensor *, size_t>> kv_store;
+    } graph_reuse;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
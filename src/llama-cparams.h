@@ -29,6 +29,7 @@ struct llama_cparams {
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool kv_paged;
 
     enum llama_pooling_type pooling_type;
 
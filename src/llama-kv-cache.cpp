@@ -5,12 +5,105 @@
 #include "llama-cparams.h"
 #include "llama-model.h"
 
+#include "ggml-alloc.h"
+
 #include <algorithm>
 #include <limits>
 #include <map>
 
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
 static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
 
+llama_kv_paged_mem::llama_kv_paged_mem(size_t size) {
+#ifdef _WIN32
+    // only reserve the range, blocks are committed as they are written
+    addr = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+    }
+#endif
+    this->size = addr ? size : 0;
+}
+
+llama_kv_paged_mem::~llama_kv_paged_mem() {
+    if (!addr) {
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(addr, 0, MEM_RELEASE);
+#else
+    munmap(addr, size);
+#endif
+}
+
+size_t llama_kv_paged_mem::page_size() {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+void llama_kv_paged_mem::commit(void * ptr, size_t len) {
+#ifdef _WIN32
+    static const size_t page = page_size();
+    const uintptr_t begin = (uintptr_t) ptr & ~(uintptr_t) (page - 1);
+    const uintptr_t end   = ((uintptr_t) ptr + len + page - 1) & ~(uintptr_t) (page - 1);
+    if (end > begin && !VirtualAlloc((void *) begin, end - begin, MEM_COMMIT, PAGE_READWRITE)) {
+        GGML_ABORT("failed to commit %zu bytes of paged kv memory", (size_t) (end - begin));
+    }
+#else
+    GGML_UNUSED(ptr);
+    GGML_UNUSED(len);
+#endif
+}
+
+void llama_kv_paged_mem::release(void * ptr, size_t len, bool decommit) {
+    static const size_t page = page_size();
+    const uintptr_t begin = ((uintptr_t) ptr + page - 1) & ~(uintptr_t) (page - 1);
+    const uintptr_t end   = ((uintptr_t) ptr + len) & ~(uintptr_t) (page - 1);
+    if (end <= begin) {
+        return;
+    }
+#if defined(_WIN32)
+    if (decommit) {
+        VirtualFree((void *) begin, end - begin, MEM_DECOMMIT);
+    } else {
+        // stays committed and readable, the contents are either kept or zeroed
+        VirtualAlloc((void *) begin, end - begin, MEM_RESET, PAGE_READWRITE);
+    }
+#elif defined(__linux__)
+    GGML_UNUSED(decommit);
+    madvise((void *) begin, end - begin, MADV_DONTNEED);
+#else
+    // MADV_DONTNEED does not guarantee zeroed pages everywhere, so map fresh ones over the range
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    mmap((void *) begin, end - begin, PROT_READ | PROT_WRITE, flags, -1, 0);
+    GGML_UNUSED(decommit);
+#endif
+}
+
 uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
@@ -47,6 +140,12 @@ bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.paged = cparams.kv_paged && !cache.recurrent;
+    cache.block_size = 256;
+    cache.block_resident.assign((kv_size + cache.block_size - 1)/cache.block_size, false);
+    cache.paged_mem.clear();
+    cache.pending_copies.clear();
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -104,13 +203,37 @@ bool llama_kv_cache_init(
         auto * buft = it.first;
         auto * ctx  = it.second;
 
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        ggml_backend_buffer_t buf = nullptr;
+        if (cache.paged && buft == ggml_backend_cpu_buffer_type()) {
+            // place the tensors in a lazily backed mapping, which starts out zeroed
+            const size_t align = ggml_backend_buft_get_alignment(buft);
+            size_t size = align;
+            for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                size += GGML_PAD(ggml_backend_buft_get_alloc_size(buft, t), align);
+            }
+            auto mem = std::make_unique<llama_kv_paged_mem>(size);
+            if (mem->addr) {
+                buf = ggml_backend_cpu_buffer_from_ptr(mem->addr, mem->size);
+                ggml_tallocr talloc = ggml_tallocr_new(buf);
+                for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                    ggml_tallocr_alloc(&talloc, t);
+                }
+                cache.paged_mem.push_back(std::move(mem));
+                LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB (paged, %u cells per block)\n", __func__,
+                        ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0, cache.block_size);
+            } else {
+                LLAMA_LOG_WARN("%s: failed to reserve paged kv memory, allocating it upfront\n", __func__);
+            }
+        }
         if (!buf) {
-            LLAMA_LOG_ERROR("%s: failed to allocate buffer for kv cache\n", __func__);
-            return false;
+            buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+            if (!buf) {
+                LLAMA_LOG_ERROR("%s: failed to allocate buffer for kv cache\n", __func__);
+                return false;
+            }
+            ggml_backend_buffer_clear(buf, 0);
+            LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
         }
-        ggml_backend_buffer_clear(buf, 0);
-        LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
         cache.bufs.emplace_back(buf);
     }
 
@@ -335,6 +458,8 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
 
     cache.used += n_tokens;
 
+    llama_kv_cache_mark_resident(cache, cache.head, cache.head + n_tokens);
+
     return llama_kv_cache_slot_info(cache.head, cache.head + n_tokens);
 }
 
@@ -350,6 +475,126 @@ uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+// calls fn(ptr, len) for the memory of cells [c0, c1) of every paged tensor
+template <typename F>
+static void llama_kv_cache_paged_ranges(struct llama_kv_cache & cache, uint32_t c0, uint32_t c1, F fn) {
+    auto is_paged = [&](const ggml_tensor * t) {
+        for (const auto & mem : cache.paged_mem) {
+            if (mem->contains(t->data)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (size_t il = 0; il < cache.k_l.size(); ++il) {
+        ggml_tensor * k = cache.k_l[il];
+        if (is_paged(k)) {
+            const size_t row = ggml_nbytes(k)/cache.size;
+            fn((char *) k->data + c0*row, (c1 - c0)*row);
+        }
+
+        ggml_tensor * v = cache.v_l[il];
+        if (!is_paged(v)) {
+            continue;
+        }
+        if (!cache.v_trans) {
+            const size_t row = ggml_nbytes(v)/cache.size;
+            fn((char *) v->data + c0*row, (c1 - c0)*row);
+        } else {
+            // transposed: the cells are spread over one row per embedding element
+            const size_t ev = ggml_type_size(v->type);
+            const int64_t n_rows = ggml_nelements(v)/cache.size;
+            for (int64_t r = 0; r < n_rows; ++r) {
+                fn((char *) v->data + (r*cache.size + c0)*ev, (c1 - c0)*ev);
+            }
+        }
+    }
+}
+
+void llama_kv_cache_mark_resident(struct llama_kv_cache & cache, uint32_t c0, uint32_t c1) {
+    if (!cache.paged || c1 <= c0) {
+        return;
+    }
+    const uint32_t b1 = (c1 - 1)/cache.block_size + 1;
+    for (uint32_t b = c0/cache.block_size; b < b1; ++b) {
+        cache.block_resident[b] = true;
+    }
+    if (b1 > cache.n_blocks_committed && !cache.paged_mem.empty()) {
+        llama_kv_cache_paged_ranges(cache, cache.n_blocks_committed*cache.block_size, std::min(b1*cache.block_size, cache.size),
+            [](void * ptr, size_t len) { llama_kv_paged_mem::commit(ptr, len); });
+        cache.n_blocks_committed = b1;
+    }
+}
+
+// hands the memory of cells [c0, c1) of every paged tensor back to the os
+static void llama_kv_cache_release_cells(struct llama_kv_cache & cache, uint32_t c0, uint32_t c1, bool decommit) {
+    llama_kv_cache_paged_ranges(cache, c0, c1, [&](void * ptr, size_t len) {
+        llama_kv_paged_mem::release(ptr, len, decommit);
+    });
+}
+
+void llama_kv_cache_release_blocks(struct llama_kv_cache & cache) {
+    if (!cache.paged || cache.paged_mem.empty()) {
+        return;
+    }
+
+    const uint32_t n_blocks = cache.block_resident.size();
+
+    std::vector<bool> empty(n_blocks, true);
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].pos >= 0) {
+            empty[i/cache.block_size] = false;
+        }
+    }
+    for (const auto & it : cache.pending_copies) {
+        empty[it.first/cache.block_size]  = false;
+        empty[it.second/cache.block_size] = false;
+    }
+
+    // the first empty block after a used one is kept, so a sequence that is trimmed and grows again does not refault it
+    for (uint32_t b = 0; b < n_blocks; ) {
+        if (!empty[b] || (b > 0 && !empty[b - 1])) {
+            ++b;
+            continue;
+        }
+        uint32_t e = b;
+        bool any_resident = false;
+        while (e < n_blocks && empty[e]) {
+            any_resident = any_resident || cache.block_resident[e];
+            ++e;
+        }
+        // blocks below the last used one stay committed, attention still reads them
+        const bool trailing = e == n_blocks && cache.n_blocks_committed > b;
+        if (any_resident || trailing) {
+            llama_kv_cache_release_cells(cache, b*cache.block_size, std::min(e*cache.block_size, cache.size), trailing);
+            for (uint32_t i = b; i < e; ++i) {
+                cache.block_resident[i] = false;
+            }
+            if (trailing) {
+                cache.n_blocks_committed = b;
+            }
+        }
+        b = e;
+    }
+}
+
+size_t llama_kv_cache_resident_size(const struct llama_kv_cache & cache) {
+    size_t size = 0;
+    for (const auto & buf : cache.bufs) {
+        size += ggml_backend_buffer_get_size(buf.get());
+    }
+    if (!cache.paged || cache.paged_mem.empty()) {
+        return size;
+    }
+    size_t paged_size = 0;
+    for (const auto & mem : cache.paged_mem) {
+        paged_size += mem->size;
+    }
+    const size_t n_resident = std::count(cache.block_resident.begin(), cache.block_resident.end(), true);
+    return size - paged_size + paged_size*n_resident/cache.block_resident.size();
+}
+
 void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
@@ -359,10 +604,22 @@ void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     }
     cache.head = 0;
     cache.used = 0;
+    cache.pending_copies.clear();
 
     for (auto & buf : cache.bufs) {
-        ggml_backend_buffer_clear(buf.get(), 0);
+        bool paged = false;
+        for (const auto & mem : cache.paged_mem) {
+            paged = paged || mem->contains(ggml_backend_buffer_get_base(buf.get()));
+        }
+        if (paged) {
+            // zeroing would touch every page, releasing them reads back as zeros too
+            llama_kv_paged_mem::release(ggml_backend_buffer_get_base(buf.get()), ggml_backend_buffer_get_size(buf.get()), true);
+        } else {
+            ggml_backend_buffer_clear(buf.get(), 0);
+        }
     }
+    std::fill(cache.block_resident.begin(), cache.block_resident.end(), false);
+    cache.n_blocks_committed = 0;
 }
 
 bool llama_kv_cache_seq_rm(
@@ -425,6 +682,10 @@ bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    if (new_head != cache.size) {
+        llama_kv_cache_release_blocks(cache);
+    }
+
     return true;
 }
 
@@ -496,6 +757,44 @@ void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id)
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    if (new_head != cache.size) {
+        llama_kv_cache_release_blocks(cache);
+    }
+}
+
+// before seq_id changes the position of cell i, the other sequences sharing it get their own copy of the cell.
+// the data follows with the next update; returns false if there is no free cell to copy to
+static bool llama_kv_cache_unshare(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id, uint32_t & search_from) {
+    llama_kv_cell & cell = cache.cells[i];
+    if (cell.seq_id.size() <= 1) {
+        return true;
+    }
+
+    uint32_t dst = search_from;
+    while (dst < cache.size && !(cache.cells[dst].pos < 0 && cache.cells[dst].is_empty())) {
+        ++dst;
+    }
+    search_from = dst;
+    if (dst == cache.size) {
+        return false;
+    }
+
+    llama_kv_cell & copy = cache.cells[dst];
+    copy.pos   = cell.pos;
+    copy.delta = cell.delta;
+    copy.seq_id = cell.seq_id;
+    copy.seq_id.erase(seq_id);
+    cell.seq_id.clear();
+    cell.seq_id.insert(seq_id);
+    cache.used++;
+
+    // a cell that is itself still waiting for its data copies from the same source
+    const auto it = cache.pending_copies.find(i);
+    cache.pending_copies[dst] = it != cache.pending_copies.end() ? it->second : i;
+    llama_kv_cache_mark_resident(cache, dst, dst + 1);
+
+    return true;
 }
 
 void llama_kv_cache_seq_add(
@@ -525,8 +824,21 @@ void llama_kv_cache_seq_add(
         return;
     }
 
+    uint32_t cow_from = 0;
+    bool cow_failed = false;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            if (cache.paged && cache.cells[i].seq_id.size() > 1) {
+                if (cache.cells[i].pos + delta < 0) {
+                    // shifted out for this sequence only
+                    cache.cells[i].seq_id.erase(seq_id);
+                    continue;
+                }
+                if (!llama_kv_cache_unshare(cache, i, seq_id, cow_from)) {
+                    cow_failed = true;
+                }
+            }
             cache.has_shift = true;
             cache.cells[i].pos   += delta;
             cache.cells[i].delta += delta;
@@ -544,9 +856,17 @@ void llama_kv_cache_seq_add(
         }
     }
 
+    if (cow_failed) {
+        LLAMA_LOG_WARN("%s: no free cells to copy shared cells to, the shift of seq %d also moves the other sequences\n", __func__, seq_id);
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    if (new_head != cache.size) {
+        llama_kv_cache_release_blocks(cache);
+    }
 }
 
 void llama_kv_cache_seq_div(
@@ -574,8 +894,14 @@ void llama_kv_cache_seq_div(
         return;
     }
 
+    uint32_t cow_from = 0;
+    bool cow_failed = false;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            if (cache.paged && cache.cells[i].seq_id.size() > 1 && !llama_kv_cache_unshare(cache, i, seq_id, cow_from)) {
+                cow_failed = true;
+            }
             cache.has_shift = true;
 
             {
@@ -585,6 +911,10 @@ void llama_kv_cache_seq_div(
             }
         }
     }
+
+    if (cow_failed) {
+        LLAMA_LOG_WARN("%s: no free cells to copy shared cells to, the shift of seq %d also moves the other sequences\n", __func__, seq_id);
+    }
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
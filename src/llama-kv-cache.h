@@ -4,6 +4,8 @@
 
 #include "ggml-cpp.h"
 
+#include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -28,6 +30,29 @@ struct llama_kv_cell {
     }
 };
 
+// address space reserved for a paged KV buffer. pages are only backed by memory once something is written to them
+struct llama_kv_paged_mem {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    explicit llama_kv_paged_mem(size_t size);
+    ~llama_kv_paged_mem();
+
+    llama_kv_paged_mem(const llama_kv_paged_mem &) = delete;
+    llama_kv_paged_mem & operator=(const llama_kv_paged_mem &) = delete;
+
+    bool contains(const void * ptr) const {
+        return ptr >= addr && (const char *) ptr < (const char *) addr + size;
+    }
+
+    // backs the pages touching [ptr, ptr + len) with memory. only windows needs this, elsewhere pages are backed on first write
+    static void commit(void * ptr, size_t len);
+    // hands the whole pages inside [ptr, ptr + len) back to the os. decommit also gives up the commit charge on windows,
+    // the range must be committed again before it is read
+    static void release(void * ptr, size_t len, bool decommit);
+    static size_t page_size();
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -54,6 +79,18 @@ struct llama_kv_cache {
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
+    // paged mode: the cpu buffers are lazily backed mappings, split into blocks of cells. memory follows the blocks
+    // that have been written, and runs of blocks that are empty again are handed back to the os
+    bool paged = false;
+    uint32_t block_size = 0; // cells per block
+    std::vector<bool> block_resident;
+    uint32_t n_blocks_committed = 0; // blocks [0, n) are committed. attention reads every cell below the max, so it is a prefix
+    std::vector<std::unique_ptr<llama_kv_paged_mem>> paged_mem;
+
+    // paged mode copy-on-write of shared cells: before a sequence shifts the positions of cells it shares with other
+    // sequences, the others get a copy in a free cell. the data is copied by the next llama_kv_cache_update, ahead of the K-shift
+    std::map<uint32_t, uint32_t> pending_copies; // dst cell -> src cell
+
     std::vector<ggml_context_ptr> ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
@@ -112,6 +149,15 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
 // find how many cells are currently in use
 uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache);
 
+// paged mode: note that cells [c0, c1) are about to be written
+void llama_kv_cache_mark_resident(struct llama_kv_cache & cache, uint32_t c0, uint32_t c1);
+
+// paged mode: give the memory of empty blocks back
+void llama_kv_cache_release_blocks(struct llama_kv_cache & cache);
+
+// bytes of the KV buffers currently backed by memory (the full size unless paged)
+size_t llama_kv_cache_resident_size(const struct llama_kv_cache & cache);
+
 void llama_kv_cache_clear(struct llama_kv_cache & cache);
 
 bool llama_kv_cache_seq_rm(
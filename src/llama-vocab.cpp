@@ -12,11 +12,15 @@
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <sstream>
 #include <regex>
 #include <set>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -630,6 +634,36 @@ struct llm_tokenizer_bpe : llm_tokenizer {
     }
 
     std::vector<std::string> regex_exprs;
+
+    // bounded LRU cache of word fragment -> merged tokens, shared by all sessions of this vocab
+    // the caller must hold cache_mutex
+    static constexpr size_t CACHE_MAX_FRAGMENTS = 65536;
+
+    bool cache_get(const std::string & word, std::vector<llama_token> & tokens) const {
+        auto it = cache_map.find(word);
+        if (it == cache_map.end()) {
+            return false;
+        }
+        cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+        tokens = it->second->second;
+        return true;
+    }
+
+    void cache_put(const std::string & word, const std::vector<llama_token> & tokens) const {
+        if (cache_map.find(word) != cache_map.end()) {
+            return;
+        }
+        cache_lru.emplace_front(word, tokens);
+        cache_map.emplace(cache_lru.front().first, cache_lru.begin());
+        if (cache_lru.size() > CACHE_MAX_FRAGMENTS) {
+            cache_map.erase(cache_lru.back().first);
+            cache_lru.pop_back();
+        }
+    }
+
+    mutable std::mutex cache_mutex;
+    mutable std::list<std::pair<std::string, std::vector<llama_token>>> cache_lru;
+    mutable std::unordered_map<std::string_view, std::list<std::pair<std::string, std::vector<llama_token>>>::iterator> cache_map;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -672,107 +706,156 @@ struct llm_tokenizer_bpe_session {
         // }
     }
 
+    // inputs with fewer words than this are merged directly without the fragment cache
+    static constexpr size_t CACHE_MIN_WORDS = 64;
+    // minimum number of uncached fragments per merge thread
+    static constexpr size_t PARALLEL_MIN_FRAGMENTS = 4096;
+    static constexpr size_t PARALLEL_MAX_THREADS = 8;
+
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
-
-            int index = 0;
-            size_t offset = 0;
+        if (word_collection.size() < CACHE_MIN_WORDS) {
+            for (const auto & word : word_collection) {
+                tokenize_word(word, output);
+            }
+            return;
+        }
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        // every fragment is merged independently, so look up each unique one in the cache first
+        std::vector<std::vector<llama_token>> fragments;
+        std::vector<int> word_fragment(word_collection.size());
+        std::vector<size_t> missing; // index of the first word of each uncached fragment
+        {
+            std::unordered_map<std::string_view, int> fragment_ids;
+            std::lock_guard<std::mutex> lock(tokenizer.cache_mutex);
+            for (size_t i = 0; i < word_collection.size(); ++i) {
+                auto it = fragment_ids.find(word_collection[i]);
+                if (it != fragment_ids.end()) {
+                    word_fragment[i] = it->second;
+                    continue;
+                }
+                word_fragment[i] = fragments.size();
+                fragment_ids.emplace(word_collection[i], word_fragment[i]);
+                fragments.emplace_back();
+                if (!tokenizer.cache_get(word_collection[i], fragments.back())) {
+                    missing.push_back(i);
+                }
             }
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+        // merge the uncached fragments, split across threads for very long inputs
+        auto merge_range = [&](size_t first, size_t last) {
+            llm_tokenizer_bpe_session session(vocab, tokenizer);
+            for (size_t i = first; i < last; ++i) {
+                session.tokenize_word(word_collection[missing[i]], fragments[word_fragment[missing[i]]]);
             }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+        };
+        const size_t n_threads = std::min<size_t>({ PARALLEL_MAX_THREADS, (size_t) std::max(1u, std::thread::hardware_concurrency()), missing.size() / PARALLEL_MIN_FRAGMENTS });
+        if (n_threads <= 1) {
+            merge_range(0, missing.size());
+        } else {
+            std::vector<std::thread> workers;
+            const size_t per_thread = (missing.size() + n_threads - 1) / n_threads;
+            for (size_t t = 1; t < n_threads; ++t) {
+                workers.emplace_back(merge_range, std::min(missing.size(), t * per_thread), std::min(missing.size(), (t + 1) * per_thread));
+            }
+            merge_range(0, per_thread);
+            for (auto & worker : workers) {
+                worker.join();
             }
+        }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        if (!missing.empty()) {
+            std::lock_guard<std::mutex> lock(tokenizer.cache_mutex);
+            for (size_t i : missing) {
+                tokenizer.cache_put(word_collection[i], fragments[word_fragment[i]]);
+            }
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        for (int id : word_fragment) {
+            output.insert(output.end(), fragments[id].begin(), fragments[id].end());
+        }
+    }
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+    // merges a single pre-tokenized word and appends its tokens
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        int index = 0;
+        size_t offset = 0;
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // merged symbols never move left, so the surviving ones are already in text order
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(str);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
     }
@@ -808,7 +891,6 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -35,6 +35,7 @@ static bool old_mixtral_warning_showed = false;
 #include <functional>
 #include <numeric>
 #include <type_traits>
+#include <unordered_set>
 #include <iostream>
 
 #ifdef GGML_USE_CUDA
@@ -1174,6 +1175,9 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // building any graph replaces the one allocated in the scheduler
+        lctx.graph_reuse.gf = nullptr;
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -8607,6 +8611,73 @@ static int llama_prepare_ubatch(
     return 0;
 }
 
+// keep an allocated decode graph for the next ubatches of the same shape. only done when the graph runs on the CPU
+// backend in a single split and the only state baked into it is the KV head, at which the new K/V rows are stored
+static void llama_graph_reuse_save(llama_context & lctx, const llama_ubatch & ubatch, ggml_cgraph * gf, ggml_tensor * res, ggml_tensor * embd) {
+    auto & reuse = lctx.graph_reuse;
+
+    const auto & kv_self = lctx.kv_self;
+    const auto & hparams = lctx.model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    reuse.gf = nullptr;
+    reuse.kv_store.clear();
+
+    if (kv_self.recurrent || !cparams.causal_attn || cparams.cb_eval != nullptr || llama_model_has_encoder(&lctx.model)) {
+        return;
+    }
+
+    ggml_backend_sched_t sched = lctx.sched.get();
+    if (ggml_backend_sched_get_n_splits(sched) != 1 || ggml_backend_sched_get_tensor_backend(sched, ggml_graph_node(gf, -1)) != lctx.backend_cpu) {
+        return;
+    }
+
+    // size of one KV cell in each cache tensor, as used for the store offsets
+    std::unordered_map<const ggml_tensor *, size_t> cell_size;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        cell_size[kv_self.k_l[il]] = ggml_row_size(kv_self.k_l[il]->type, hparams.n_embd_k_gqa(il));
+        cell_size[kv_self.v_l[il]] = cparams.flash_attn ? ggml_row_size(kv_self.v_l[il]->type, hparams.n_embd_v_gqa(il)) : ggml_element_size(kv_self.v_l[il]);
+    }
+
+    std::unordered_set<const ggml_tensor *> stores;
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->op != GGML_OP_CPY || !cell_size.count(node->view_src)) {
+            continue;
+        }
+        const size_t size = cell_size.at(node->view_src);
+        for (ggml_tensor * t : { node, node->src[1] }) {
+            if (t->view_src != node->view_src || t->view_offs != size*kv_self.head) {
+                reuse.kv_store.clear();
+                return; // not a plain store at the KV head
+            }
+            reuse.kv_store.emplace_back(t, size);
+            stores.insert(t);
+        }
+    }
+
+    // any other view of the cache must not depend on the KV head
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        const ggml_tensor * node = ggml_graph_node(gf, i);
+        for (int j = -1; j < GGML_MAX_SRC; ++j) {
+            const ggml_tensor * t = j < 0 ? node : node->src[j];
+            if (t && cell_size.count(t->view_src) && t->view_offs != 0 && !stores.count(t)) {
+                reuse.kv_store.clear();
+                return;
+            }
+        }
+    }
+
+    reuse.gf        = gf;
+    reuse.res       = res;
+    reuse.embd      = embd;
+    reuse.n_tokens  = ubatch.n_tokens;
+    reuse.n_seqs    = ubatch.n_seqs;
+    reuse.n_kv      = kv_self.n;
+    reuse.n_outputs = lctx.n_outputs;
+    reuse.use_embd  = ubatch.embd != nullptr;
+}
+
 // decode a batch of tokens by evaluating the transformer
 // in case of unsuccessful decoding (error or warning),
 // the kv_cache state will be returned to its original state
@@ -8674,42 +8745,62 @@ static int llama_decode_impl(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched.get());
-        ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
-
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
-
-        // the output is always the last tensor in the graph
-        struct ggml_tensor * res  = ggml_graph_node(gf, -1);
-        struct ggml_tensor * embd = ggml_graph_node(gf, -2);
-
-        if (lctx.n_outputs == 0) {
-            // no output
-            res  = nullptr;
-            embd = nullptr;
-        } else if (cparams.embeddings) {
-            res  = nullptr; // do not extract logits for embedding case
-            embd = nullptr;
-            for (int i = ggml_graph_n_nodes(gf) - 1; i >= 0; --i) {
-                if (strcmp(ggml_graph_node(gf, i)->name, "result_embd_pooled") == 0) {
-                    embd = ggml_graph_node(gf, i);
-                    break;
-                }
+        ggml_cgraph * gf = nullptr;
+        struct ggml_tensor * res  = nullptr;
+        struct ggml_tensor * embd = nullptr;
+
+        auto & reuse = lctx.graph_reuse;
+        if (reuse.gf && reuse.n_tokens == ubatch.n_tokens && reuse.n_seqs == ubatch.n_seqs && reuse.n_kv == kv_self.n &&
+            reuse.n_outputs == lctx.n_outputs && reuse.use_embd == (ubatch.embd != nullptr)) {
+            // same shape as the previous ubatch: the graph is still allocated, only move the KV stores to the new head
+            gf   = reuse.gf;
+            res  = reuse.res;
+            embd = reuse.embd;
+            for (auto & it : reuse.kv_store) {
+                it.first->view_offs = it.second*kv_self.head;
+                it.first->data      = (char *) it.first->view_src->data + it.first->view_offs;
             }
-            GGML_ASSERT(embd != nullptr && "missing embeddings tensor");
         } else {
-            embd = nullptr; // do not extract embeddings when not needed
-            GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
-        }
+            ggml_backend_sched_reset(lctx.sched.get());
+            ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+            gf = llama_build_graph(lctx, ubatch, false);
+
+            // the output is always the last tensor in the graph
+            res  = ggml_graph_node(gf, -1);
+            embd = ggml_graph_node(gf, -2);
+
+            if (lctx.n_outputs == 0) {
+                // no output
+                res  = nullptr;
+                embd = nullptr;
+            } else if (cparams.embeddings) {
+                res  = nullptr; // do not extract logits for embedding case
+                embd = nullptr;
+                for (int i = ggml_graph_n_nodes(gf) - 1; i >= 0; --i) {
+                    if (strcmp(ggml_graph_node(gf, i)->name, "result_embd_pooled") == 0) {
+                        embd = ggml_graph_node(gf, i);
+                        break;
+                    }
+                }
+                GGML_ASSERT(embd != nullptr && "missing embeddings tensor");
+            } else {
+                embd = nullptr; // do not extract embeddings when not needed
+                GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
+            }
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+            ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+            llama_graph_reuse_save(lctx, ubatch, gf, res, embd);
+        }
 
         llama_set_inputs(lctx, ubatch);
 
         const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
         if (compute_status != GGML_STATUS_SUCCESS) {
+            reuse.gf = nullptr;
             kv_slot_restorer.restore(kv_self);
             switch (compute_status) {
                 case GGML_STATUS_ABORTED:
@@ -8851,8 +8942,10 @@ static int llama_decode_impl(
     }
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched.get());
+    // overlap with device computation. a reusable graph stays allocated instead
+    if (lctx.graph_reuse.gf == nullptr) {
+        ggml_backend_sched_reset(lctx.sched.get());
+    }
 
     return 0;
 }
@@ -9258,9 +9351,18 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
 
     ggml_backend_sched_reset(lctx.sched.get());
 
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        if (ids[i] != i && ids[i] != n_kv) {
+            llama_kv_cache_mark_resident(kv_self, ids[i], ids[i] + 1);
+        }
+    }
+
     ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
 
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+
+    // the cells moved out of the tail, which can now be handed back
+    llama_kv_cache_release_blocks(kv_self);
 #endif
 
     //const int64_t t_end = ggml_time_us();
@@ -9268,9 +9370,51 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
 }
 
+// copies the data of the cells queued by the copy-on-write in seq_add/seq_div, reusing the defrag graph
+static void llama_kv_cache_copy_impl(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    const uint32_t n_layer   = lctx.model.hparams.n_layer;
+    const uint32_t max_moves = (lctx.model.max_nodes() - 2*n_layer)/(6*n_layer);
+
+    // (dst, src), a source can only go to one destination per graph
+    std::vector<std::pair<uint32_t, uint32_t>> todo(kv_self.pending_copies.begin(), kv_self.pending_copies.end());
+    kv_self.pending_copies.clear();
+
+    while (!todo.empty()) {
+        std::vector<uint32_t> ids(kv_self.size, kv_self.size);
+        std::vector<std::pair<uint32_t, uint32_t>> rest;
+        uint32_t n_moves = 0;
+
+        for (const auto & it : todo) {
+            if (ids[it.second] != kv_self.size || n_moves == max_moves) {
+                rest.push_back(it);
+                continue;
+            }
+            ids[it.second] = it.first;
+            n_moves++;
+        }
+
+        ggml_backend_sched_reset(lctx.sched.get());
+
+        ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+
+        todo.swap(rest);
+    }
+}
+
 static void llama_kv_cache_update_impl(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // copy shared cells before the K-shift changes them in place
+    if (!lctx.kv_self.pending_copies.empty()) {
+        llama_kv_cache_copy_impl(lctx);
+
+        need_reserve = true;
+    }
+
     if (lctx.kv_self.has_shift) {
         if (!llama_kv_cache_can_shift(&lctx)) {
             printf("\nWARNING: The current context does not support K-shift!\n");
@@ -9286,8 +9430,13 @@ static void llama_kv_cache_update_impl(struct llama_context & lctx) {
 
             llama_set_k_shift(lctx);
 
+            // the shift rotates every cell, paged blocks must be backed for it and are given back afterwards
+            llama_kv_cache_mark_resident(lctx.kv_self, 0, lctx.kv_self.size);
+
             llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
 
+            llama_kv_cache_release_blocks(lctx.kv_self);
+
             need_reserve = true;
         }
 
@@ -9335,6 +9484,7 @@ int32_t llama_set_adapter_lora(
             struct llama_adapter_lora * adapter,
             float scale) {
     ctx->lora[adapter] = scale;
+    ctx->graph_reuse.gf = nullptr;
     return 0;
 }
 
@@ -9344,6 +9494,7 @@ int32_t llama_rm_adapter_lora(
     auto pos = ctx->lora.find(adapter);
     if (pos != ctx->lora.end()) {
         ctx->lora.erase(pos);
+        ctx->graph_reuse.gf = nullptr;
         return 0;
     }
 
@@ -9352,6 +9503,7 @@ int32_t llama_rm_adapter_lora(
 
 void llama_clear_adapter_lora(struct llama_context * ctx) {
     ctx->lora.clear();
+    ctx->graph_reuse.gf = nullptr;
 }
 
 int32_t llama_apply_adapter_cvec(
@@ -9361,6 +9513,7 @@ int32_t llama_apply_adapter_cvec(
                      int32_t   n_embd,
                      int32_t   il_start,
                      int32_t   il_end) {
+    ctx->graph_reuse.gf = nullptr;
     return ctx->cvec.apply(ctx->model, data, len, n_embd, il_start, il_end);
 }
 
@@ -9396,6 +9549,7 @@ struct llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.kv_paged                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -9636,6 +9790,7 @@ struct llama_context * llama_init_from_model(
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.kv_paged         = params.kv_paged;
     cparams.pooling_type     = params.pooling_type;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;